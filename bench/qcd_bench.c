@@ -0,0 +1,478 @@
+/*============================================================================
+  
+  qcd
+
+  qcd_bench.c
+
+  Startup-latency benchmark. For each database size, this builds a
+  synthetic directory list in a temporary HOME, and then runs the qcd
+  binary many times on each of its code paths, reporting the median
+  and 99th percentile wall time, and the peak RSS, of each. If strace
+  is installed, it also counts the system calls that one run of each
+  path makes.
+
+  The database is written with the original schema, and an unmeasured
+  first run of qcd brings it up to date, so what is measured is what
+  the binary under test does with a database of its own. Each run is
+  a fresh fork and exec, in a new session with no controlling
+  terminal. The selector can't open /dev/tty there, and gives up at
+  once, so the multi-match and list cases measure everything up to
+  drawing the list.
+
+  Usage: qcd_bench [-n runs] [-s size,size...] [path/to/qcd]
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "sqlite3.h"
+
+#define BENCH_DEFAULT_RUNS 50
+#define BENCH_DEFAULT_SIZES "1000,10000,100000,1000000"
+// A directory that only one stored path matches, and which exists on
+//   disk, so that visits to it are recorded
+#define BENCH_UNIQUE "qcdbenchunique"
+// A term that many stored paths match
+#define BENCH_MULTI "proj"
+#define BENCH_MAX_ARGS 4
+
+/*============================================================================
+  
+  Words that synthetic paths are made from. Words near the start of the
+  list are picked much more often than the rest, as in a real home
+  directory.
+
+  ==========================================================================*/
+static const char *bench_words[] =
+  {
+  "src", "projects", "work", "docs", "build", "lib", "include", "test",
+  "tmp", "Downloads", "git", "java", "python", "main", "resources",
+  "config", "scripts", "data", "images", "notes", "archive", "backup",
+  "web", "static", "assets", "www", "api", "client", "server", "common",
+  "util", "core", "model", "view", "controller", "service", "kernel",
+  "drivers", "net", "fs", "mm", "arch", "x86", "arm", "tools", "examples",
+  "photos", "music", "videos", "Documents", "Desktop", "papers", "thesis",
+  "chapter1", "chapter2", "release", "debug", "target", "classes", "node",
+  "modules", "vendor", "third_party", "external", "deps", "cmake", "doc",
+  "man", "share", "bin", "etc", "var", "log", "cache", "local", "opt",
+  "usr", "home", "mail", "inbox", "2019", "2020", "2021", "reports",
+  "invoices", "clients", "alpha", "beta", "gamma", "delta", "prototype",
+  "experiments", "results", "figures", "slides", "talks", "books",
+  "recipes", "games", "saves", "mods", "themes", "fonts", "icons",
+  };
+#define BENCH_NWORDS (int)(sizeof (bench_words) / sizeof (bench_words[0]))
+
+/*============================================================================
+  
+  BenchCase
+
+  One code path through qcd_main. In args and cwd, "@" stands for the
+  unique directory. If setup is given, qcd is run with those arguments,
+  unmeasured, before each measured run.
+
+  ==========================================================================*/
+typedef struct _BenchCase
+  {
+  const char *name;
+  const char *cwd; // NULL for HOME
+  const char *args[BENCH_MAX_ARGS];
+  const char *setup[BENCH_MAX_ARGS];
+  } BenchCase;
+
+static const BenchCase bench_cases[] =
+  {
+  { "dotdot",   NULL, { "..", NULL },         { NULL } },
+  { "complete", NULL, { "@", NULL },          { NULL } },
+  { "unique",   NULL, { BENCH_UNIQUE, NULL }, { NULL } },
+  { "multi",    NULL, { BENCH_MULTI, NULL },  { NULL } },
+  { "add",      "@",  { "-a", NULL },         { NULL } },
+  { "del",      "@",  { "-d", NULL },         { "-a", NULL } },
+  { "list",     NULL, { "-l", NULL },         { NULL } },
+  };
+#define BENCH_NCASES (int)(sizeof (bench_cases) / sizeof (bench_cases[0]))
+
+/*============================================================================
+  
+  BenchResult
+
+  ==========================================================================*/
+typedef struct _BenchResult
+  {
+  double p50; // msec
+  double p99;
+  long max_rss; // kB
+  int syscalls; // -1 if unknown
+  } BenchResult;
+
+/*============================================================================
+  
+  bench_fail
+
+  ==========================================================================*/
+static void bench_fail (const char *what)
+  {
+  fprintf (stderr, "qcd_bench: %s: %s\n", what, strerror (errno));
+  exit (1);
+  }
+
+/*============================================================================
+  
+  bench_subst
+
+  ==========================================================================*/
+static const char *bench_subst (const char *s, const char *unique)
+  {
+  return (s && strcmp (s, "@") == 0) ? unique : s;
+  }
+
+/*============================================================================
+  
+  bench_exec
+
+  Run qcd in a child process, with the given arguments, optionally
+  under strace, and wait for it. Returns the wall time in msec, and
+  sets *max_rss from the child's resource usage.
+
+  ==========================================================================*/
+static double bench_exec (const char *qcd, const char *cwd,
+      const char * const *args, const char *unique, const char *trace,
+      long *max_rss)
+  {
+  const char *argv[BENCH_MAX_ARGS + 8];
+  int argc = 0;
+  if (trace)
+    {
+    argv[argc++] = "strace";
+    argv[argc++] = "-f";
+    argv[argc++] = "-qq";
+    argv[argc++] = "-o";
+    argv[argc++] = trace;
+    }
+  argv[argc++] = qcd;
+  for (int i = 0; i < BENCH_MAX_ARGS && args[i]; i++)
+    argv[argc++] = bench_subst (args[i], unique);
+  argv[argc] = NULL;
+
+  struct timespec start, end;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  pid_t pid = fork ();
+  if (pid < 0) bench_fail ("fork");
+  if (pid == 0)
+    {
+    // A new session has no controlling terminal, so the selector
+    //   can't start
+    setsid ();
+    int fd = open ("/dev/null", O_RDWR);
+    dup2 (fd, 0);
+    dup2 (fd, 1);
+    dup2 (fd, 2);
+    if (cwd && chdir (cwd) != 0) _exit (127);
+    if (trace)
+      execvp (argv[0], (char **)argv);
+    else
+      execv (argv[0], (char **)argv);
+    _exit (127);
+    }
+  int status;
+  struct rusage ru;
+  if (wait4 (pid, &status, 0, &ru) < 0) bench_fail ("wait4");
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  if (!WIFEXITED (status) || WEXITSTATUS (status) == 127)
+    {
+    fprintf (stderr, "qcd_bench: %s failed\n", argv[0]);
+    exit (1);
+    }
+  *max_rss = ru.ru_maxrss;
+  return (end.tv_sec - start.tv_sec) * 1000.0
+    + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+  }
+
+/*============================================================================
+  
+  bench_have_strace
+
+  ==========================================================================*/
+static int bench_have_strace (void)
+  {
+  const char *path = getenv ("PATH");
+  if (!path) return 0;
+  char *p = strdup (path);
+  int ret = 0;
+  char *save;
+  for (char *dir = strtok_r (p, ":", &save); dir && !ret;
+        dir = strtok_r (NULL, ":", &save))
+    {
+    char file[PATH_MAX];
+    snprintf (file, sizeof (file), "%s/strace", dir);
+    ret = (access (file, X_OK) == 0);
+    }
+  free (p);
+  return ret;
+  }
+
+/*============================================================================
+  
+  bench_count_syscalls
+
+  Count the system calls in an strace log. With -f, a call that is
+  interrupted by another process appears twice, once as 'unfinished'
+  and once as 'resumed', so the resumed lines are not counted. Nor are
+  signals and exits.
+
+  ==========================================================================*/
+static int bench_count_syscalls (const char *trace)
+  {
+  FILE *f = fopen (trace, "r");
+  if (!f) return -1;
+  int ret = 0;
+  char *line = NULL;
+  size_t n = 0;
+  while (getline (&line, &n, f) >= 0)
+    {
+    if (!strstr (line, "resumed>") && !strstr (line, "+++ ")
+         && !strstr (line, "--- "))
+      ret++;
+    }
+  free (line);
+  fclose (f);
+  unlink (trace);
+  return ret;
+  }
+
+/*============================================================================
+  
+  bench_compare
+
+  ==========================================================================*/
+static int bench_compare (const void *a, const void *b)
+  {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+  }
+
+/*============================================================================
+  
+  bench_case
+
+  ==========================================================================*/
+static void bench_case (const char *qcd, const char *home,
+      const char *unique, const BenchCase *c, int runs, int strace,
+      BenchResult *result)
+  {
+  const char *cwd = c->cwd ? bench_subst (c->cwd, unique) : home;
+  double *times = malloc (runs * sizeof (double));
+  result->max_rss = 0;
+  for (int i = 0; i < runs; i++)
+    {
+    long rss;
+    if (c->setup[0])
+      bench_exec (qcd, cwd, c->setup, unique, NULL, &rss);
+    times[i] = bench_exec (qcd, cwd, c->args, unique, NULL, &rss);
+    if (rss > result->max_rss) result->max_rss = rss;
+    }
+  qsort (times, runs, sizeof (double), bench_compare);
+  result->p50 = times[runs / 2];
+  result->p99 = times[(runs * 99) / 100 < runs ? (runs * 99) / 100 : runs - 1];
+  free (times);
+
+  result->syscalls = -1;
+  if (strace)
+    {
+    char trace[PATH_MAX];
+    long rss;
+    snprintf (trace, sizeof (trace), "%s/strace.out", home);
+    if (c->setup[0])
+      bench_exec (qcd, cwd, c->setup, unique, NULL, &rss);
+    bench_exec (qcd, cwd, c->args, unique, trace, &rss);
+    result->syscalls = bench_count_syscalls (trace);
+    }
+  }
+
+/*============================================================================
+  
+  bench_word
+
+  ==========================================================================*/
+static const char *bench_word (void)
+  {
+  double r = drand48 ();
+  return bench_words[(int)(BENCH_NWORDS * r * r)];
+  }
+
+/*============================================================================
+  
+  bench_exec_sql
+
+  ==========================================================================*/
+static void bench_exec_sql (sqlite3 *db, const char *sql)
+  {
+  char *e = NULL;
+  sqlite3_exec (db, sql, NULL, NULL, &e);
+  if (e)
+    {
+    fprintf (stderr, "qcd_bench: %s: %s\n", sql, e);
+    exit (1);
+    }
+  }
+
+/*============================================================================
+  
+  bench_make_db
+
+  Store 'size' directories under HOME, between two and seven levels
+  deep, with visit counts that fall off with the order in which they
+  are generated, roughly as a Zipf distribution. The unique directory
+  is the most popular.
+
+  ==========================================================================*/
+static void bench_make_db (const char *home, const char *unique, int size)
+  {
+  char file[PATH_MAX];
+  snprintf (file, sizeof (file), "%s/.qcd.db", home);
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  if (sqlite3_open (file, &db) != SQLITE_OK) bench_fail (file);
+  bench_exec_sql (db, "create table dirs "
+    "(dir varchar not null primary key, count integer)");
+  bench_exec_sql (db, "begin");
+  sqlite3_prepare_v2 (db,
+    "insert or ignore into dirs (dir, count) values (?1, ?2)",
+    -1, &stmt, NULL);
+
+  sqlite3_bind_text (stmt, 1, unique, -1, SQLITE_STATIC);
+  sqlite3_bind_int (stmt, 2, 5000);
+  sqlite3_step (stmt);
+  sqlite3_reset (stmt);
+
+  srand48 (size);
+  int n = 1;
+  for (int i = 0; n < size && i < size * 20; i++)
+    {
+    char path[PATH_MAX];
+    int l = snprintf (path, sizeof (path), "%s", home);
+    int depth = 2 + (int)(drand48 () * 6);
+    for (int d = 0; d < depth; d++)
+      l += snprintf (path + l, sizeof (path) - l, "/%s", bench_word ());
+    sqlite3_bind_text (stmt, 1, path, l, SQLITE_STATIC);
+    sqlite3_bind_int (stmt, 2, 1 + (int)(2000.0 / (i + 1)));
+    if (sqlite3_step (stmt) != SQLITE_DONE)
+      {
+      fprintf (stderr, "qcd_bench: %s\n", sqlite3_errmsg (db));
+      exit (1);
+      }
+    sqlite3_reset (stmt);
+    n += sqlite3_changes (db);
+    }
+
+  sqlite3_finalize (stmt);
+  bench_exec_sql (db, "commit");
+  sqlite3_close (db);
+  }
+
+/*============================================================================
+  
+  bench_remove_fn
+
+  ==========================================================================*/
+static int bench_remove_fn (const char *path, const struct stat *sb,
+      int flag, struct FTW *ftw)
+  {
+  remove (path);
+  return 0;
+  }
+
+/*============================================================================
+  
+  bench_size
+
+  ==========================================================================*/
+static void bench_size (const char *qcd, int size, int runs, int strace)
+  {
+  char home[] = "/tmp/qcd-bench-XXXXXX";
+  if (!mkdtemp (home)) bench_fail ("mkdtemp");
+  setenv ("HOME", home, 1);
+  char unique[PATH_MAX];
+  snprintf (unique, sizeof (unique), "%s/bench", home);
+  mkdir (unique, 0700);
+  strcat (unique, "/" BENCH_UNIQUE);
+  mkdir (unique, 0700);
+
+  fprintf (stderr, "Building a database of %d directories...\n", size);
+  bench_make_db (home, unique, size);
+  // Bring the schema up to date, and leave the journal empty
+  long rss;
+  const char *warm_up[] = { "-l", NULL };
+  bench_exec (qcd, home, warm_up, unique, NULL, &rss);
+
+  for (int i = 0; i < BENCH_NCASES; i++)
+    {
+    BenchResult r;
+    bench_case (qcd, home, unique, &bench_cases[i], runs, strace, &r);
+    printf ("%-9d %-9s %9.2f %9.2f %11ld", size, bench_cases[i].name,
+      r.p50, r.p99, r.max_rss);
+    if (r.syscalls >= 0)
+      printf (" %9d\n", r.syscalls);
+    else
+      printf (" %9s\n", "-");
+    fflush (stdout);
+    }
+
+  nftw (home, bench_remove_fn, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+/*============================================================================
+  
+  main
+
+  ==========================================================================*/
+int main (int argc, char **argv)
+  {
+  int runs = BENCH_DEFAULT_RUNS;
+  const char *sizes = BENCH_DEFAULT_SIZES;
+  int opt;
+  while ((opt = getopt (argc, argv, "n:s:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'n': runs = atoi (optarg); break;
+      case 's': sizes = optarg; break;
+      default:
+        fprintf (stderr, "Usage: %s [-n runs] [-s size,size...] [qcd]\n",
+          argv[0]);
+        return 1;
+      }
+    }
+  if (runs < 1) runs = 1;
+  char qcd[PATH_MAX];
+  if (!realpath (optind < argc ? argv[optind] : "./qcd", qcd))
+    bench_fail ("qcd binary");
+  int strace = bench_have_strace ();
+
+  printf ("%s, %d runs per case%s\n", qcd, runs,
+    strace ? "" : " (install strace to count system calls)");
+  printf ("%-9s %-9s %9s %9s %11s %9s\n", "dirs", "case", "p50 ms",
+    "p99 ms", "max RSS kB", "syscalls");
+  fflush (stdout);
+  char *s = strdup (sizes);
+  char *save;
+  for (char *size = strtok_r (s, ",", &save); size;
+        size = strtok_r (NULL, ",", &save))
+    bench_size (qcd, atoi (size), runs, strace);
+  free (s);
+  return 0;
+  }
+
@@ -0,0 +1,86 @@
+/*============================================================================
+  
+  qcd 
+  
+  qcd_builtin.c
+
+  A bash loadable builtin, which does what qcd_init.sh does, but without
+  running a subshell and the qcd program for every cd. Build it with
+  "make builtin", and load it with 
+
+  enable -f /path/to/qcd.so qcd
+
+  The builtin takes the same arguments as the qcd program, and passes
+  the directory that qcd_run() chooses straight to bash's own cd.
+
+  This file is kept out of src/, because it can only be compiled 
+  against the bash headers.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "builtins.h"
+#include "shell.h"
+#include "common.h"
+#include "qcd_main.h"
+
+extern int cd_builtin (WORD_LIST *list);
+
+/*============================================================================
+  
+  qcd_builtin_cd
+
+  ==========================================================================*/
+static void qcd_builtin_cd (const char *dir, void *user_data)
+  {
+  WORD_LIST *cd_list = make_word_list (make_word (dir), NULL);
+  *(int *)user_data = cd_builtin (cd_list);
+  dispose_words (cd_list);
+  }
+
+/*============================================================================
+  
+  qcd_builtin
+
+  ==========================================================================*/
+int qcd_builtin (WORD_LIST *list)
+  {
+  int argc = 1 + list_length (list);
+  char **argv = malloc ((argc + 1) * sizeof (char *));
+  argv[0] = "qcd";
+  int i = 1;
+  for (WORD_LIST *l = list; l; l = l->next)
+    argv[i++] = l->word->word;
+  argv[i] = NULL;
+
+  int ret = EXECUTION_FAILURE;
+  qcd_run (argc, argv, qcd_builtin_cd, &ret);
+
+  free (argv);
+  return ret;
+  }
+
+char *qcd_doc[] =
+  {
+  "Change the current directory, using qcd.",
+  "",
+  "Change to DIRECTORY if it exists, or else to the stored directory",
+  "that best matches it, prompting if there is more than one. See",
+  "qcd(1) for the options.",
+  NULL
+  };
+
+struct builtin qcd_struct =
+  {
+  "qcd",
+  qcd_builtin,
+  BUILTIN_ENABLED,
+  qcd_doc,
+  "qcd [options] [directory]",
+  0
+  };
+
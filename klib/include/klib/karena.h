@@ -0,0 +1,53 @@
+/*============================================================================
+  
+  klib
+
+  karena.h
+
+  An arena, from which small objects are allocated by bumping a 
+  pointer, and which is released all at once. It suits a process that
+  runs for a moment, makes many small allocations, and exits: the 
+  allocations are cheap, and the frees cost nothing, because they do
+  nothing. A long-lived process should not use it.
+
+  KString, KList and KPath allocate with kmalloc(), krealloc() and 
+  kfree(). Until karena_init() is called, and after karena_stop(), 
+  these are just malloc(), realloc() and free(). kfree() and 
+  krealloc() can be given memory from either source.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stddef.h>
+#include <klib/types.h>
+#include <klib/defs.h>
+
+BEGIN_DECLS
+
+/** Start allocating from the arena. */
+extern void        karena_init (void);
+
+/** Go back to malloc(), for a process that is about to become 
+    long-lived. Memory already allocated from the arena stays valid,
+    and is never reused. */
+extern void        karena_stop (void);
+
+/** Whether allocations come from the arena. */
+extern BOOL        karena_active (void);
+
+/** Free the arena, and everything allocated from it, and go back to
+    malloc(). Nothing allocated from the arena may be used after this. */
+extern void        karena_release (void);
+
+extern void       *kmalloc (size_t size);
+extern void       *krealloc (void *p, size_t size);
+/** Does nothing for memory from the arena, except to give back the 
+    most recent allocation. */
+extern void        kfree (void *p);
+extern char       *kstrdup (const char *s);
+
+END_DECLS
+
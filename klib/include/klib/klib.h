@@ -15,6 +15,8 @@
 #include <klib/types.h>
 #include <klib/defs.h>
 #include <klib/klog.h>
+#include <klib/ktrace.h>
+#include <klib/karena.h>
 #include <klib/kbuffer.h>
 #include <klib/kstring.h>
 #include <klib/kpath.h>
@@ -6,9 +6,11 @@
 
   Definition of the KList class
 
-  This class holds a linked list of references. Once added, the references
-  "belong" to the list, and should not be called or modified except 
-  by removing them from the list, or destroying the list. 
+  This class holds a list of references, in a growable array, so that
+  appending is cheap and any item can be got in constant time. Once 
+  added, the references "belong" to the list, and should not be called
+  or modified except by removing them from the list, or destroying the
+  list. 
 
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
@@ -24,11 +24,36 @@ typedef enum
   KLOG_TRACE = 4
   } KLogLevel;
 
+/** The least severe level that is compiled in at all, as a number, 
+    because the preprocessor can't see the enum. Messages at more 
+    verbose levels cost nothing, whatever the level set at run time. 
+    Release builds set this to 2 (KLOG_INFO), so that the KLOG_IN and 
+    KLOG_OUT in every function disappear. */
+#ifndef KLOG_MIN_LEVEL
+#define KLOG_MIN_LEVEL 4
+#endif
+
+#if KLOG_MIN_LEVEL >= 4
 #define KLOG_IN klog_trace(KLOG_CLASS, "Entering %s ", __PRETTY_FUNCTION__);
 #define KLOG_OUT klog_trace(KLOG_CLASS, "Leaving %s", __PRETTY_FUNCTION__);
+#else
+#define KLOG_IN
+#define KLOG_OUT
+#endif
+
+/** Whether a message at this level would be logged. The arguments of 
+    the logging calls below are only evaluated if it would. */
+#define KLOG_ENABLED(level) \
+  ((int)(level) <= KLOG_MIN_LEVEL && (int)(level) <= klog_log_level)
+
+#define KLOG_AT(level, fn, ...) \
+  do { if (KLOG_ENABLED (level)) fn (__VA_ARGS__); } while (0)
 
 BEGIN_DECLS
 
+/** The level set at run time. Use klog_set_log_level() to change it. */
+extern int         klog_log_level;
+
 typedef void (*KLogHandler) (KLogLevel level, const char *cls, 
                   void *user_data, const char *msg); 
 
@@ -37,6 +62,11 @@ extern void        klog_error (const char *cls, const char *fmt,...);
 extern void        klog_info (const char *cls, const char *fmt,...);
 extern void        klog_init (KLogLevel level, KLogHandler handler, 
                      void *user_data);
+/** Write messages to file, through a buffer, rather than to the handler
+    or stderr. The buffer is written out when it fills, and by 
+    klog_close_file(), which also restores the handler. */
+extern BOOL        klog_open_file (const char *file);
+extern void        klog_close_file (void);
 extern const UTF8 *klog_level_to_utf8 (KLogLevel level);
 extern void        klog_set_handler (KLogHandler handler);
 extern void        klog_set_log_level (int level);
@@ -45,3 +75,11 @@ extern void        klog_warn (const char *cls, const char *fmt,...);
 
 END_DECLS
 
+// Defined after the functions, so that the declarations above are not
+//   expanded
+#define klog_error(...) KLOG_AT (KLOG_ERROR, klog_error, __VA_ARGS__)
+#define klog_warn(...) KLOG_AT (KLOG_WARN, klog_warn, __VA_ARGS__)
+#define klog_info(...) KLOG_AT (KLOG_INFO, klog_info, __VA_ARGS__)
+#define klog_debug(...) KLOG_AT (KLOG_DEBUG, klog_debug, __VA_ARGS__)
+#define klog_trace(...) KLOG_AT (KLOG_TRACE, klog_trace, __VA_ARGS__)
+
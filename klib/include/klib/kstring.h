@@ -39,7 +39,13 @@ extern void          kstring_append_utf32 (KString *self, const UTF32 *s);
 extern void          kstring_append_utf8 (KString *self, const UTF8 *s);
 extern void          kstring_append_printf (KString *self, char *fmt,...);
 
+/** The string as UTF-32. This is made on the first call, and is valid
+    until the string is next changed or destroyed. Where UTF-8 will do,
+    use kstring_cstr_utf8(), which costs nothing. */
 extern const UTF32  *kstring_cstr (const KString *self);
+/** The string as UTF-8, without copying it. It is valid until the string
+    is next changed or destroyed. */
+extern const UTF8   *kstring_cstr_utf8 (const KString *self);
 
 /** Returns the numerical value of a specific character. '0'->0, '5'->5, 
     etc. To be able to use this in number base conversion, 'a' and 'A' -> 10,
@@ -90,6 +96,8 @@ extern KString      *kstring_substring (const KString *self, int start,
 extern BOOL          kstring_to_integer (const KString *self, int *value, 
                        int radix);
 
+/** Returns a copy of the string as UTF-8, from malloc(), which the caller
+    must free(). */
 extern UTF8         *kstring_to_utf8 (const KString *self);
 
 /** Remove whitspace from the start of a string. */
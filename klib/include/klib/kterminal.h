@@ -31,6 +31,11 @@
 #define VK_PGDN  1005 
 #define VK_HOME  1006 
 #define VK_END   10067
+// Not a key: read_key returns this when the terminal has changed size
+#define VK_RESIZE 1100
+// Not a key: read_key returns this when the terminal can no longer be
+//   read, because it has been closed, or on an error
+#define VK_EOF    1101
 
 //Terminal attributes
 #define KTATTR_REVERSE   0x0001
@@ -49,6 +54,7 @@ typedef BOOL (*KTerminalGetSizeFn) (const struct _KTerminal *self, int *rows,
                     int *cols, KString **error);
 typedef void (*KTerminalSetRawModeFn) (struct _KTerminal *self, BOOL raw);
 typedef int (*KTerminalReadKeyFn) (const struct _KTerminal *self);
+typedef BOOL (*KTerminalKeyAvailableFn) (const struct _KTerminal *self);
 typedef void (*KTerminalClearFn) (struct _KTerminal *self);
 typedef void (*KTerminalSetCursorFn) (const struct _KTerminal *self,
                     int row, int col);
@@ -56,6 +62,9 @@ typedef void (*KTerminalWriteAtFn) (const struct _KTerminal *self, int row,
                     int col, const KString *text, BOOL truncate);
 typedef void (*KTerminalSetAttrFn) (const struct _KTerminal *self, int attrs, BOOL on);
 typedef void (*KTerminalEraseLineFn) (struct _KTerminal *self, int line);
+typedef void (*KTerminalFrameFn) (struct _KTerminal *self);
+typedef void (*KTerminalScrollFn) (struct _KTerminal *self, int top, 
+                    int bottom, int n);
 
 typedef struct _KTerminal
   {
@@ -65,11 +74,15 @@ typedef struct _KTerminal
   KTerminalGetSizeFn get_size;
   KTerminalSetRawModeFn set_raw_mode;
   KTerminalReadKeyFn read_key;
+  KTerminalKeyAvailableFn key_available;
   KTerminalClearFn clear;
   KTerminalWriteAtFn write_at;
   KTerminalSetCursorFn set_cursor;
   KTerminalSetAttrFn set_attr;
   KTerminalEraseLineFn erase_line;
+  KTerminalFrameFn begin_frame;
+  KTerminalFrameFn flush;
+  KTerminalScrollFn scroll;
   } KTerminal;
 
 
@@ -79,8 +92,18 @@ extern void    kterminal_destroy (KTerminal *self);
 
 extern BOOL    kterminal_deinit (KTerminal *self, KString **error);
 
+/** Output is held back from here until kterminal_flush(), and then 
+    written all at once, so that the screen is redrawn in one piece. 
+    The terminal size is read once, at the start of the frame. Outside
+    a frame, each call writes its output at once. */
+extern void    kterminal_begin_frame (KTerminal *self);
+
 extern void    kterminal_clear (KTerminal *self);
 
+/** Write any output held back since kterminal_begin_frame(), and end
+    the frame. */
+extern void    kterminal_flush (KTerminal *self);
+
 extern BOOL    kterminal_get_size (const KTerminal *self, int *rows, 
                    int *cols, KString **error);
 
@@ -89,6 +112,11 @@ extern void    kterminal_erase_line (KTerminal *self, int line);
 
 extern BOOL    kterminal_init (KTerminal *self, KString **error);
 
+/** Whether a key, or part of one, is waiting to be read, so that 
+    kterminal_read_key() would not block for long. A caller can use this
+    to act on all the keys typed ahead, and redraw only after the last. */
+extern BOOL    kterminal_key_available (const KTerminal *self);
+
 extern int     kterminal_read_key (const KTerminal *self);
 
 extern void    kterminal_set_attributes (const KTerminal *self, int attrs, BOOL on);
@@ -98,6 +126,12 @@ extern void    kterminal_set_cursor (const KTerminal *self, int row,
 
 extern void    kterminal_set_raw_mode (KTerminal *self, BOOL raw);
 
+/** Scroll the lines from top to bottom, inclusive and zero-based, up by
+    n lines, or down if n is negative. The lines that scroll into view
+    are blank; the rest of the screen is not touched. */
+extern void    kterminal_scroll (KTerminal *self, int top, int bottom, 
+                   int n);
+
 extern void    kterminal_write_at (const KTerminal *self, int row, 
                    int col, const KString *text, BOOL truncate);
 extern void    kterminal_write_at_utf8 (const KTerminal *self, int row, 
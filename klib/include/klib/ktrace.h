@@ -0,0 +1,51 @@
+/*============================================================================
+  
+  klib
+
+  ktrace.h
+
+  Timing of the phases of a program run. Spans are opened and closed
+  with KTRACE_BEGIN and KTRACE_END, which cost one test of a global
+  flag when tracing is off. When it is on, ktrace_finish() writes
+  the spans to a file -- as Chrome trace JSON if the file name ends
+  in .json, or otherwise as a one-line summary appended to the file.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <klib/types.h>
+#include <klib/defs.h>
+
+/** The most spans recorded in one run. Later ones are dropped. */
+#define KTRACE_MAX_SPANS 64
+
+#define KTRACE_BEGIN(name) (ktrace_on ? ktrace_begin (name) : -1)
+#define KTRACE_END(span) do { if ((span) >= 0) ktrace_end (span); } while (0)
+
+BEGIN_DECLS
+
+/** Set between ktrace_init() and ktrace_finish(). Use the macros, rather
+    than testing this directly. */
+extern BOOL        ktrace_on;
+
+/** Start tracing to file. label identifies the run in the summary.
+    If start is not zero, it is the wall-clock time, in seconds since the
+    epoch, at which the caller's caller set out to run us, and the
+    time up to now is recorded as an 'exec' span. */
+extern void        ktrace_init (const char *file, const char *label,
+                     double start);
+
+/** Open a span. name must be a string constant, or at least outlive
+    the call to ktrace_finish(). Returns a handle for ktrace_end(). */
+extern int         ktrace_begin (const char *name);
+
+extern void        ktrace_end (int span);
+
+/** Close any open spans, write the trace, and stop tracing. */
+extern BOOL        ktrace_finish (void);
+
+END_DECLS
+
@@ -0,0 +1,227 @@
+/*============================================================================
+  
+  klib
+
+  karena.c
+
+  The arena is a list of blocks, each twice the size of the one 
+  before, so that there are never many of them. Each allocation is 
+  preceded by its size, so that krealloc() knows how much to copy. 
+  The most recent allocation in the current block can be grown, or 
+  given back, in place; anything else is left where it is until the 
+  arena is released. A request that is large compared to the current
+  block gets a block of its own.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <klib/karena.h>
+
+// Allocations are aligned as malloc() aligns them, and the size that
+//   precedes each one takes the same space
+#define KARENA_ALIGN 16
+#define KARENA_HEADER KARENA_ALIGN
+#define KARENA_FIRST_BLOCK 65536
+#define KARENA_MAX_BLOCK (4 * 1024 * 1024)
+
+#define KARENA_ROUND(n) (((n) + KARENA_ALIGN - 1) & ~(size_t)(KARENA_ALIGN - 1))
+
+/*============================================================================
+  
+  KArenaBlock
+
+  ==========================================================================*/
+typedef struct _KArenaBlock
+  {
+  struct _KArenaBlock *next;
+  size_t size; // Of data
+  size_t used;
+  size_t last; // Offset of the header of the most recent allocation
+  _Alignas (KARENA_ALIGN) char data[];
+  } KArenaBlock;
+
+static BOOL active = FALSE;
+static KArenaBlock *blocks = NULL; // Most recent first
+static KArenaBlock *current = NULL; // The one that is being filled
+static size_t next_size = KARENA_FIRST_BLOCK;
+
+/*============================================================================
+  
+  karena_init
+
+  ==========================================================================*/
+void karena_init (void)
+  {
+  active = TRUE;
+  }
+
+/*============================================================================
+  
+  karena_stop
+
+  ==========================================================================*/
+void karena_stop (void)
+  {
+  active = FALSE;
+  }
+
+/*============================================================================
+  
+  karena_active
+
+  ==========================================================================*/
+BOOL karena_active (void)
+  {
+  return active;
+  }
+
+/*============================================================================
+  
+  karena_release
+
+  ==========================================================================*/
+void karena_release (void)
+  {
+  while (blocks)
+    {
+    KArenaBlock *next = blocks->next;
+    free (blocks);
+    blocks = next;
+    }
+  current = NULL;
+  next_size = KARENA_FIRST_BLOCK;
+  active = FALSE;
+  }
+
+/*============================================================================
+  
+  karena_new_block
+
+  ==========================================================================*/
+static KArenaBlock *karena_new_block (size_t size)
+  {
+  KArenaBlock *b = malloc (sizeof (KArenaBlock) + size);
+  if (!b) return NULL;
+  b->size = size;
+  b->used = 0;
+  b->last = SIZE_MAX;
+  b->next = blocks;
+  blocks = b;
+  return b;
+  }
+
+/*============================================================================
+  
+  karena_find
+
+  The block that p was allocated from, if any
+
+  ==========================================================================*/
+static KArenaBlock *karena_find (const void *p)
+  {
+  const char *c = p;
+  for (KArenaBlock *b = blocks; b; b = b->next)
+    if (c > b->data && c < b->data + b->size) return b;
+  return NULL;
+  }
+
+/*============================================================================
+  
+  karena_alloc
+
+  ==========================================================================*/
+static void *karena_alloc (size_t size)
+  {
+  size_t need = KARENA_HEADER + KARENA_ROUND (size);
+  KArenaBlock *b = current;
+  if (!b || b->size - b->used < need)
+    {
+    if (need > next_size / 4)
+      b = karena_new_block (need);
+    else
+      {
+      b = current = karena_new_block (next_size);
+      if (next_size < KARENA_MAX_BLOCK) next_size *= 2;
+      }
+    if (!b) return NULL;
+    }
+  char *h = b->data + b->used;
+  *(size_t *)h = size;
+  b->last = b->used;
+  b->used += need;
+  return h + KARENA_HEADER;
+  }
+
+/*============================================================================
+  
+  kmalloc
+
+  ==========================================================================*/
+void *kmalloc (size_t size)
+  {
+  if (!active) return malloc (size);
+  return karena_alloc (size);
+  }
+
+/*============================================================================
+  
+  krealloc
+
+  ==========================================================================*/
+void *krealloc (void *p, size_t size)
+  {
+  if (!p) return kmalloc (size);
+  KArenaBlock *b = blocks ? karena_find (p) : NULL;
+  if (!b) return realloc (p, size);
+
+  char *h = (char *)p - KARENA_HEADER;
+  size_t old = *(size_t *)h;
+  if (h == b->data + b->last 
+       && b->last + KARENA_HEADER + KARENA_ROUND (size) <= b->size)
+    {
+    *(size_t *)h = size;
+    b->used = b->last + KARENA_HEADER + KARENA_ROUND (size);
+    return p;
+    }
+  void *q = kmalloc (size);
+  if (q) memcpy (q, p, old < size ? old : size);
+  return q;
+  }
+
+/*============================================================================
+  
+  kfree
+
+  ==========================================================================*/
+void kfree (void *p)
+  {
+  if (!p) return;
+  KArenaBlock *b = blocks ? karena_find (p) : NULL;
+  if (!b)
+    free (p);
+  else if ((char *)p - KARENA_HEADER == b->data + b->last)
+    {
+    b->used = b->last;
+    b->last = SIZE_MAX;
+    }
+  }
+
+/*============================================================================
+  
+  kstrdup
+
+  ==========================================================================*/
+char *kstrdup (const char *s)
+  {
+  size_t l = strlen (s) + 1;
+  char *ret = kmalloc (l);
+  if (ret) memcpy (ret, s, l);
+  return ret;
+  }
+
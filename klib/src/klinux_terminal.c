@@ -4,6 +4,23 @@
   
   klinux_terminal.c
 
+  Output is collected in a buffer, and written with a single write(). 
+  Between begin_frame and flush, it is held back until the end, so that
+  a whole screen is drawn at once; otherwise it is written at the end of
+  each call.
+
+  The terminal size is read once, and then only again after SIGWINCH.
+  The signal handler sets a flag, which get_size checks, and writes a
+  byte to a pipe, which read_key waits on along with the terminal, so
+  that it can return VK_RESIZE at once, rather than at the next key.
+
+  Input is read into a buffer, taking everything that is waiting at 
+  once, and keys are parsed from that. The bytes of an escape sequence
+  may arrive separately, so while one is incomplete, we wait a short 
+  time for the rest; if nothing comes, it was the Escape key on its own.
+  Sequences we don't recognize are skipped whole, rather than being 
+  returned as Escape followed by junk.
+
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
 
@@ -18,8 +35,11 @@
 #include <termios.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <klib/klog.h>
+#include <klib/ktrace.h>
 #include <klib/kterminal.h>
 #include <klib/klinux_terminal.h>
 
@@ -33,6 +53,7 @@ BOOL klinux_terminal_get_size (const KTerminal *self, int *rows,
       int *cols, KString **error); //FWD
 void klinux_terminal_set_raw_mode (KTerminal *self, BOOL raw); //FWD
 int klinux_terminal_read_key (const KTerminal *self);
+BOOL klinux_terminal_key_available (const KTerminal *self); // FWD
 void klinux_terminal_clear (KTerminal *self); // FWD
 void klinux_terminal_write_at (const KTerminal *self, int row, 
       int col, const KString *text, BOOL truncate); //FWD
@@ -42,6 +63,10 @@ void klinux_terminal_set_attributes (const KTerminal *self, int attrs, BOOL on);
 BOOL klinux_terminal_smcup (KTerminal *self, KString **error); //FWD
 BOOL klinux_terminal_rmcup (KTerminal *self, KString **error); //FWD
 void klinux_terminal_erase_line (KTerminal *self, int line); // FWD
+void klinux_terminal_begin_frame (KTerminal *self); // FWD
+void klinux_terminal_flush (KTerminal *self); // FWD
+void klinux_terminal_scroll (KTerminal *self, int top, int bottom, 
+      int n); // FWD
 
 #define TERM_CLEAR "\033[2J\033[1;1H"
 #define TERM_ERASE_LINE "\033[K"
@@ -51,6 +76,19 @@ void klinux_terminal_erase_line (KTerminal *self, int line); // FWD
 #define TERM_SET_ATTR "\033[%dm"
 #define TERM_SMCUP "\033[?1049h"
 #define TERM_RMCUP "\033[?1049l"
+#define TERM_SET_REGION "\033[%d;%dr"
+#define TERM_RESET_REGION "\033[r"
+#define TERM_INDEX "\033D" // Down a line, scrolling at the bottom
+#define TERM_REVERSE_INDEX "\033M" // Up a line, scrolling at the top
+
+// The output buffer starts at this size, and grows as needed
+#define KLINUX_TERMINAL_OUT_SIZE 4096
+// The size of the input buffer -- enough for many keys typed ahead
+#define KLINUX_TERMINAL_IN_SIZE 256
+// How long to wait, in msec, for the rest of an escape sequence
+#define KLINUX_TERMINAL_ESC_TIMEOUT 50
+// The longest parameter string in a CSI sequence that we will look at
+#define KLINUX_TERMINAL_MAX_PARAMS 16
 
 /*============================================================================
   
@@ -62,8 +100,107 @@ struct _KLinuxTerminal
   KTerminal parent; // Ensure space for inherited fn pointers
   struct termios orig_termios;
   int fd;
+  char *out; // Output not yet written
+  size_t out_used;
+  size_t out_size;
+  BOOL in_frame;
+  int frame_rows; // The terminal size at the start of the frame
+  int frame_cols;
+  int rows; // The terminal size, when size_known
+  int cols;
+  BOOL size_known;
+  struct sigaction old_winch; // To put back at deinit
+  unsigned char in[KLINUX_TERMINAL_IN_SIZE]; // Input not yet parsed
+  int in_start;
+  int in_end;
+  BOOL in_failed; // The terminal can no longer be read
   };
 
+// There can only be one handler, so the signal state is global
+static volatile sig_atomic_t winch_pending = 0;
+static int winch_pipe[2] = { -1, -1 };
+
+
+/*============================================================================
+  
+  klinux_terminal_write_out
+
+  Write everything in the output buffer
+
+  ==========================================================================*/
+static void klinux_terminal_write_out (KLinuxTerminal *self)
+  {
+  size_t done = 0;
+  while (done < self->out_used)
+    {
+    ssize_t n = write (self->fd, self->out + done, self->out_used - done);
+    if (n > 0)
+      done += n;
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else
+      break; // Nothing else we can do with it
+    }
+  self->out_used = 0;
+  }
+
+/*============================================================================
+  
+  klinux_terminal_output
+
+  All output goes through here. It is written at once, unless we are
+  in a frame.
+
+  ==========================================================================*/
+static void klinux_terminal_output (const KTerminal *self, const char *s, 
+      size_t n)
+  {
+  KLinuxTerminal *_self = (KLinuxTerminal *)self;
+  if (_self->out_used + n > _self->out_size)
+    {
+    size_t size = _self->out_size ? _self->out_size 
+      : KLINUX_TERMINAL_OUT_SIZE;
+    while (size < _self->out_used + n)
+      size *= 2;
+    _self->out = realloc (_self->out, size);
+    _self->out_size = size;
+    }
+  memcpy (_self->out + _self->out_used, s, n);
+  _self->out_used += n;
+  if (!_self->in_frame)
+    klinux_terminal_write_out (_self);
+  }
+
+/*============================================================================
+  
+  klinux_terminal_winch
+
+  The SIGWINCH handler
+
+  ==========================================================================*/
+static void klinux_terminal_winch (int sig)
+  {
+  int saved = errno;
+  winch_pending = 1;
+  if (write (winch_pipe[1], "", 1) < 0) {} // Full is fine
+  errno = saved;
+  }
+
+/*============================================================================
+  
+  klinux_terminal_drain_winch
+
+  Empty the pipe, returning whether there was anything in it
+
+  ==========================================================================*/
+static BOOL klinux_terminal_drain_winch (void)
+  {
+  char buf[16];
+  BOOL ret = FALSE;
+  while (winch_pipe[0] >= 0 && read (winch_pipe[0], buf, sizeof (buf)) > 0)
+    ret = TRUE;
+  return ret;
+  }
 
 /*============================================================================
   
@@ -81,16 +218,48 @@ KLinuxTerminal *klinux_terminal_new (void)
   parent->get_size = klinux_terminal_get_size;
   parent->set_raw_mode = klinux_terminal_set_raw_mode;
   parent->read_key = klinux_terminal_read_key;
+  parent->key_available = klinux_terminal_key_available;
   parent->clear = klinux_terminal_clear;
   parent->write_at = klinux_terminal_write_at;
   parent->set_cursor = klinux_terminal_set_cursor;
   parent->set_attr = klinux_terminal_set_attributes;
   parent->erase_line = klinux_terminal_erase_line;
+  parent->begin_frame = klinux_terminal_begin_frame;
+  parent->flush = klinux_terminal_flush;
+  parent->scroll = klinux_terminal_scroll;
+  self->out = NULL;
+  self->out_used = 0;
+  self->out_size = 0;
+  self->in_frame = FALSE;
+  self->size_known = FALSE;
+  self->in_start = 0;
+  self->in_end = 0;
+  self->in_failed = FALSE;
 
   KLOG_OUT
   return self;
   }
 
+/*============================================================================
+  
+  klinux_terminal_begin_frame
+
+  ==========================================================================*/
+void klinux_terminal_begin_frame (KTerminal *self)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  KLinuxTerminal *_self = (KLinuxTerminal *)self;
+  if (!klinux_terminal_get_size (self, &_self->frame_rows, 
+        &_self->frame_cols, NULL))
+    {
+    _self->frame_rows = 24;
+    _self->frame_cols = 80;
+    }
+  _self->in_frame = TRUE;
+  KLOG_OUT
+  }
+
 /*============================================================================
   
   klinux_terminal_destroy
@@ -100,7 +269,7 @@ void klinux_terminal_destroy (KTerminal *self)
   {
   if (self)
     {
-
+    free (((KLinuxTerminal *)self)->out);
     free (self);
     }
   }
@@ -114,8 +283,19 @@ BOOL klinux_terminal_deinit (KTerminal *self, KString **error)
   {
   KLOG_IN
   BOOL ret = TRUE; 
+  kterminal_begin_frame (self);
   kterminal_clear (self);
   ret = klinux_terminal_rmcup (self, NULL);
+  kterminal_flush (self);
+
+  KLinuxTerminal *_self = (KLinuxTerminal *)self;
+  if (winch_pipe[0] >= 0)
+    {
+    sigaction (SIGWINCH, &_self->old_winch, NULL);
+    close (winch_pipe[0]);
+    close (winch_pipe[1]);
+    winch_pipe[0] = winch_pipe[1] = -1;
+    }
   KLOG_OUT;
   return ret;
   }
@@ -128,9 +308,8 @@ BOOL klinux_terminal_deinit (KTerminal *self, KString **error)
 void klinux_terminal_erase_line (KTerminal *self, int line)
   {
   KLOG_IN
-  KLinuxTerminal *_self = (KLinuxTerminal *)self;
   kterminal_set_cursor (self, line, 0);
-  write (_self->fd, TERM_ERASE_LINE, sizeof (TERM_ERASE_LINE) - 1);
+  klinux_terminal_output (self, TERM_ERASE_LINE, sizeof (TERM_ERASE_LINE) - 1);
   KLOG_OUT;
   }
 
@@ -145,9 +324,21 @@ BOOL klinux_terminal_init (KTerminal *self, KString **error)
   BOOL ret = TRUE; 
 
   KLinuxTerminal *_self = (KLinuxTerminal *)self;
+  int span = KTRACE_BEGIN ("terminal_init");
   _self->fd = open ("/dev/tty", O_RDWR);
   if (_self->fd >= 0)
     {
+    if (winch_pipe[0] < 0 && pipe2 (winch_pipe, O_NONBLOCK | O_CLOEXEC) == 0)
+      {
+      struct sigaction sa;
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_handler = klinux_terminal_winch;
+      sigemptyset (&sa.sa_mask);
+      sa.sa_flags = SA_RESTART;
+      sigaction (SIGWINCH, &sa, &_self->old_winch);
+      }
+    winch_pending = 0;
+    _self->size_known = FALSE;
     int rows; int columns;
     // Check that we can get the terminal size. If we can,
     //   everything is probably OK
@@ -172,6 +363,7 @@ BOOL klinux_terminal_init (KTerminal *self, KString **error)
       }
     ret = FALSE;
     }
+  KTRACE_END (span);
   KLOG_OUT
   return ret;
   }
@@ -183,12 +375,26 @@ BOOL klinux_terminal_init (KTerminal *self, KString **error)
 
   ==========================================================================*/
 void klinux_terminal_clear (KTerminal *self)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  klinux_terminal_output (self, TERM_CLEAR, sizeof (TERM_CLEAR) - 1);
+  klinux_terminal_output (self, TERM_CUR_BLOCK, sizeof (TERM_CUR_BLOCK) - 1);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  klinux_terminal_flush
+
+  ==========================================================================*/
+void klinux_terminal_flush (KTerminal *self)
   {
   KLOG_IN
   assert (self != NULL);
   KLinuxTerminal *_self = (KLinuxTerminal *)self;
-  write (_self->fd, TERM_CLEAR, sizeof (TERM_CLEAR) - 1);
-  write (_self->fd, TERM_CUR_BLOCK, sizeof (TERM_CUR_BLOCK) - 1);
+  _self->in_frame = FALSE;
+  klinux_terminal_write_out (_self);
   KLOG_OUT
   }
 
@@ -203,12 +409,30 @@ BOOL klinux_terminal_get_size (const KTerminal *self, int *rows,
   KLOG_IN
   assert (self != NULL);
   KLinuxTerminal *_self = (KLinuxTerminal *)self;
+  if (_self->in_frame)
+    {
+    // The size can't change in the middle of drawing
+    *rows = _self->frame_rows;
+    *cols = _self->frame_cols;
+    KLOG_OUT
+    return TRUE;
+    }
+  if (_self->size_known && !winch_pending)
+    {
+    *rows = _self->rows;
+    *cols = _self->cols;
+    KLOG_OUT
+    return TRUE;
+    }
   BOOL ret;
   struct winsize w;
+  winch_pending = 0;
   if (ioctl (_self->fd, TIOCGWINSZ, (unsigned long) &w) == 0)
     {
-    *rows = w.ws_row;
-    *cols = w.ws_col;
+    *rows = _self->rows = w.ws_row;
+    *cols = _self->cols = w.ws_col;
+    // Without the handler, we wouldn't know when it changed
+    _self->size_known = (winch_pipe[0] >= 0);
     ret = TRUE;
     }
   else
@@ -227,57 +451,208 @@ BOOL klinux_terminal_get_size (const KTerminal *self, int *rows,
 
 /*===========================================================================
 
-  klinux_terminal_read_key
+  klinux_terminal_fill
+
+  Read whatever input is waiting into the buffer, first waiting up to
+  timeout msec (or indefinitely, if it is negative) for some to arrive.
+  If resize is not NULL, a change of terminal size also ends the wait,
+  and sets it. Returns whether anything was read. If the terminal has
+  been closed, or can't be read, in_failed is set.
 
 ===========================================================================*/
-int klinux_terminal_read_key (const KTerminal *self)
+static BOOL klinux_terminal_fill (KLinuxTerminal *self, int timeout, 
+      BOOL *resize)
   {
-  int nread;
-  char c;
-  KLinuxTerminal *_self = (KLinuxTerminal *)self;
-  while ((nread = read (_self->fd, &c, 1)) != 1)
+  if (self->in_start > 0)
     {
-    if (nread == -1 && errno != EAGAIN) exit (-1); // TODO
+    memmove (self->in, self->in + self->in_start, 
+      self->in_end - self->in_start);
+    self->in_end -= self->in_start;
+    self->in_start = 0;
     }
-  if (c == '\x1b')
+  if (self->in_end == KLINUX_TERMINAL_IN_SIZE) return TRUE;
+
+  for (;;)
     {
-    char seq[3];
-    if (read (_self->fd, &seq[0], 1) != 1) return '\x1b';
-    if (read (_self->fd, &seq[1], 1) != 1) return '\x1b';
-    if (seq[0] == '[')
+    struct pollfd fds[2] = { { self->fd, POLLIN, 0 }, 
+                             { winch_pipe[0], POLLIN, 0 } };
+    int nfds = (resize && winch_pipe[0] >= 0) ? 2 : 1;
+    int n = poll (fds, nfds, timeout);
+    if ((n < 0 && errno != EINTR) || (n > 0 && (fds[0].revents & POLLNVAL)))
+      {
+      self->in_failed = TRUE;
+      return FALSE;
+      }
+    if (resize && klinux_terminal_drain_winch ())
       {
-      if (seq[1] >= '0' && seq[1] <= '9')
+      *resize = TRUE;
+      return FALSE;
+      }
+    if (n == 0) return FALSE;
+    if (n < 0 || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+      continue;
+    ssize_t nread = read (self->fd, self->in + self->in_end, 
+      KLINUX_TERMINAL_IN_SIZE - self->in_end);
+    if (nread > 0)
+      {
+      self->in_end += nread;
+      return TRUE;
+      }
+    if ((nread == 0 && (fds[0].revents & (POLLHUP | POLLERR)))
+        || (nread == -1 && errno != EAGAIN && errno != EINTR))
+      {
+      self->in_failed = TRUE;
+      return FALSE;
+      }
+    if (timeout >= 0) return FALSE;
+    }
+  }
+
+/*===========================================================================
+
+  klinux_terminal_next_byte
+
+  The next byte of an escape sequence, waiting briefly for it if need
+  be. Returns -1 if it does not arrive.
+
+===========================================================================*/
+static int klinux_terminal_next_byte (KLinuxTerminal *self)
+  {
+  if (self->in_start == self->in_end && 
+      !klinux_terminal_fill (self, KLINUX_TERMINAL_ESC_TIMEOUT, NULL))
+    return -1;
+  return self->in[self->in_start++];
+  }
+
+/*===========================================================================
+
+  klinux_terminal_parse_csi
+
+  Parse the rest of a sequence that started ESC [. Returns the key, or
+  zero if the sequence is not one we know, or was cut short. Modifiers,
+  as in ESC [ 1 ; 5 A for ctrl+up, are ignored.
+
+===========================================================================*/
+static int klinux_terminal_parse_csi (KLinuxTerminal *self)
+  {
+  char params[KLINUX_TERMINAL_MAX_PARAMS + 1];
+  int nparams = 0;
+  int c;
+  // Parameter bytes, then intermediate bytes, then the final byte
+  while ((c = klinux_terminal_next_byte (self)) >= 0x30 && c <= 0x3F)
+    {
+    if (nparams < KLINUX_TERMINAL_MAX_PARAMS) params[nparams++] = c;
+    }
+  while (c >= 0x20 && c <= 0x2F)
+    c = klinux_terminal_next_byte (self);
+  params[nparams] = 0;
+  if (c < 0x40 || c > 0x7E)
+    {
+    // Not a well-formed sequence. If it was interrupted by another key,
+    //   leave that to be read
+    if (c >= 0) self->in_start--;
+    return 0;
+    }
+
+  switch (c)
+    {
+    case 'A': return VK_UP;
+    case 'B': return VK_DOWN;
+    case 'C': return VK_RIGHT;
+    case 'D': return VK_LEFT;
+    case 'H': return VK_HOME;
+    case 'F': return VK_END;
+    case '~':
+      switch (atoi (params))
         {
-        if (read(_self->fd, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~')
-          {
-          switch (seq[1])
-            {
-            case '3': return VK_DEL; // Usually the key marked "del"
-            case '5': return VK_PGUP;
-            case '6': return VK_PGDN;
-            }
-          }
+        case 1: case 7: return VK_HOME;
+        case 3: return VK_DEL; // Usually the key marked "del"
+        case 4: case 8: return VK_END;
+        case 5: return VK_PGUP;
+        case 6: return VK_PGDN;
         }
+    }
+  return 0;
+  }
+
+/*===========================================================================
+
+  klinux_terminal_parse_ss3
+
+  Parse the rest of a sequence that started ESC O, which is what some
+  terminals send for the cursor keys in application mode
+
+===========================================================================*/
+static int klinux_terminal_parse_ss3 (KLinuxTerminal *self)
+  {
+  switch (klinux_terminal_next_byte (self))
+    {
+    case 'A': return VK_UP;
+    case 'B': return VK_DOWN;
+    case 'C': return VK_RIGHT;
+    case 'D': return VK_LEFT;
+    case 'H': return VK_HOME;
+    case 'F': return VK_END;
+    }
+  return 0;
+  }
+
+/*===========================================================================
+
+  klinux_terminal_key_available
+
+===========================================================================*/
+BOOL klinux_terminal_key_available (const KTerminal *self)
+  {
+  KLinuxTerminal *_self = (KLinuxTerminal *)self;
+  if (_self->in_start < _self->in_end) return TRUE;
+  struct pollfd fds = { _self->fd, POLLIN, 0 };
+  return poll (&fds, 1, 0) > 0 && (fds.revents & POLLIN);
+  }
+
+/*===========================================================================
+
+  klinux_terminal_read_key
+
+===========================================================================*/
+int klinux_terminal_read_key (const KTerminal *self)
+  {
+  KLinuxTerminal *_self = (KLinuxTerminal *)self;
+  // Whatever has been drawn must be seen before the user can respond
+  klinux_terminal_write_out (_self);
+  for (;;)
+    {
+    if (_self->in_start == _self->in_end)
+      {
+      BOOL resize = FALSE;
+      if (_self->in_failed) return VK_EOF;
+      klinux_terminal_fill (_self, -1, &resize);
+      if (resize) return VK_RESIZE;
+      continue;
+      }
+    int c = _self->in[_self->in_start++];
+    if (c == '\x1b')
+      {
+      int key;
+      int c2 = klinux_terminal_next_byte (_self);
+      if (c2 == '[')
+        key = klinux_terminal_parse_csi (_self);
+      else if (c2 == 'O')
+        key = klinux_terminal_parse_ss3 (_self);
       else
         {
-        switch (seq[1])
-          {
-          case 'A': return VK_UP;
-          case 'B': return VK_DOWN;
-          case 'C': return VK_RIGHT;
-          case 'D': return VK_LEFT;
-          case 'H': return VK_HOME;
-          case 'F': return VK_END;
-          }
+        // Escape on its own, or followed by a key that is not part of
+        //   a sequence
+        if (c2 >= 0) _self->in_start--;
+        return '\x1b';
         }
+      if (key) return key;
+      }
+    else
+      {
+      if (c == 127) c = VK_BACK;
+      return c;
       }
-    return '\x1b';
-    }
-  else
-    {
-    if (c == 127) c = VK_BACK;
-    return c;
     }
   }
 
@@ -290,8 +665,7 @@ BOOL klinux_terminal_rmcup (KTerminal *self, KString **error)
   {
   KLOG_IN
   assert (self != NULL);
-  KLinuxTerminal *_self = (KLinuxTerminal *)self;
-  write (_self->fd, TERM_RMCUP, sizeof (TERM_SMCUP) - 1);
+  klinux_terminal_output (self, TERM_RMCUP, sizeof (TERM_RMCUP) - 1);
   KLOG_OUT
   return TRUE;
   }
@@ -305,8 +679,8 @@ static void klinux_terminal_set_attr (const KTerminal *self, int attr)
   {
   KLOG_IN
   char s[20];
-  sprintf (s, TERM_SET_ATTR, attr);
-  write (((KLinuxTerminal *)self)->fd, s, strlen (s));
+  int n = snprintf (s, sizeof (s), TERM_SET_ATTR, attr);
+  klinux_terminal_output (self, s, n);
   KLOG_OUT
   }
 
@@ -353,12 +727,43 @@ void klinux_terminal_set_cursor (const KTerminal *self, int row,
   {
   KLOG_IN
   char s[40];
-  sprintf (s, TERM_SET_CUR, row + 1, col + 1);
-  write (((KLinuxTerminal *)self)->fd, s, strlen (s));
+  int n = snprintf (s, sizeof (s), TERM_SET_CUR, row + 1, col + 1);
+  klinux_terminal_output (self, s, n);
   KLOG_OUT
   }
 
 
+/*============================================================================
+  
+  klinux_terminal_scroll
+
+  Limit scrolling to the lines in question, and then move the cursor
+  past the bottom of them, or the top, as many times as needed.
+  Setting the region moves the cursor, so it has to be set again 
+  afterwards by anything that writes.
+
+  ==========================================================================*/
+void klinux_terminal_scroll (KTerminal *self, int top, int bottom, int n)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  char s[40];
+  int l = snprintf (s, sizeof (s), TERM_SET_REGION, top + 1, bottom + 1);
+  klinux_terminal_output (self, s, l);
+  klinux_terminal_set_cursor (self, n > 0 ? bottom : top, 0);
+  for (int i = 0; i < abs (n); i++)
+    {
+    if (n > 0)
+      klinux_terminal_output (self, TERM_INDEX, sizeof (TERM_INDEX) - 1);
+    else
+      klinux_terminal_output (self, TERM_REVERSE_INDEX, 
+        sizeof (TERM_REVERSE_INDEX) - 1);
+    }
+  klinux_terminal_output (self, TERM_RESET_REGION, 
+    sizeof (TERM_RESET_REGION) - 1);
+  KLOG_OUT
+  }
+
 /*============================================================================
   
   klinux_terminal_set_raw_mode
@@ -400,8 +805,7 @@ BOOL klinux_terminal_smcup (KTerminal *self, KString **error)
   {
   KLOG_IN
   assert (self != NULL);
-  KLinuxTerminal *_self = (KLinuxTerminal *)self;
-  write (_self->fd, TERM_SMCUP, sizeof (TERM_SMCUP) - 1);
+  klinux_terminal_output (self, TERM_SMCUP, sizeof (TERM_SMCUP) - 1);
   KLOG_OUT
   return TRUE;
   }
@@ -444,21 +848,21 @@ void klinux_terminal_write_at (const KTerminal *self, int row,
       int col, const KString *text, BOOL truncate)
   {
   KLOG_IN
-  KLinuxTerminal *_self = (KLinuxTerminal*)self;
-  int len = kstring_length (text); 
   int rows = 24; int columns = 80; // defaults, in case get_size fails
   klinux_terminal_set_cursor (self, row, col);
   klinux_terminal_get_size (self, &rows, &columns, NULL);
 
-  int newcol = col;
-  for (int i = 0; i < len && newcol < columns; i++)
+  // Take as many characters as fit, each one starting at a byte that 
+  //   is not a UTF-8 continuation byte
+  // TODO non-print characters
+  const UTF8 *s = kstring_cstr_utf8 (text);
+  size_t n = 0;
+  for (int newcol = col; s[n] && newcol < columns; newcol++)
     {
-    // TODO non-print characters
-    UTF8 u[UTF8_MAX_BYTES + 1];
-    int n = kstring_get_utf8 (text, i, u);
-    write (_self->fd, u, n); 
-    newcol++;
+    n++;
+    while ((s[n] & 0xC0) == 0x80) n++;
     }
+  klinux_terminal_output (self, (const char *)s, n);
   KLOG_OUT
   }
 
@@ -4,6 +4,12 @@
   
   klist.c
 
+  The references are held in an array, which doubles in size when it
+  fills, so that appending takes constant time on average, and 
+  klist_get() takes constant time always. Removal moves the rest of
+  the array down, but that is rare, and lists are walked by index
+  far more often than they are changed.
+
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
 
@@ -12,23 +18,16 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <klib/klog.h>
 #include <klib/klist.h>
+#include <klib/karena.h>
 
 #define KLOG_CLASS "klib.klist"
 
-/*============================================================================
-  
-  ListItem
-
-  ==========================================================================*/
-typedef struct _ListItem
-  {
-  struct _ListItem *next;
-  void *data;
-  } ListItem;
-
+// The capacity of a list when the first item is added
+#define KLIST_INITIAL_CAPACITY 8
 
 /*============================================================================
   
@@ -38,8 +37,9 @@ typedef struct _ListItem
 struct _KList
   {
   KListFreeFn free_fn;
-  ListItem *head;
+  void **items;
   size_t length;
+  size_t capacity;
   };
 
 
@@ -51,10 +51,11 @@ struct _KList
 extern KList *klist_new_empty (KListFreeFn free_fn)
   {
   KLOG_IN
-  KList *self = malloc (sizeof (KList));
+  KList *self = kmalloc (sizeof (KList));
   self->free_fn = free_fn;
+  self->items = NULL;
   self->length = 0;
-  self->head = NULL;
+  self->capacity = 0;
   KLOG_OUT
   return self;
   }
@@ -70,11 +71,29 @@ void klist_destroy (KList *self)
   if (self)
     {
     klist_clear (self);
-    free (self);
+    kfree (self->items);
+    kfree (self);
     }
   KLOG_OUT
   }
 
+/*============================================================================
+  
+  klist_reserve
+
+  Make room for at least n items in all
+
+  ==========================================================================*/
+static void klist_reserve (KList *self, size_t n)
+  {
+  if (n <= self->capacity) return;
+  size_t capacity = self->capacity ? self->capacity : KLIST_INITIAL_CAPACITY;
+  while (capacity < n)
+    capacity *= 2;
+  self->items = krealloc (self->items, capacity * sizeof (void *));
+  self->capacity = capacity;
+  }
+
 /*============================================================================
   
   klist_append
@@ -86,23 +105,8 @@ void klist_append (KList *self, void *ref)
   assert (self != NULL);
   assert (ref != NULL);
 
-  ListItem *i = malloc (sizeof (ListItem));
-  i->data = ref;
-  i->next = NULL;
-
-  if (self->head)
-    {
-    ListItem *l = self->head;
-    while (l->next)
-      l = l->next;
-    l->next = i;
-    }
-  else
-    {
-    self->head = i;
-    }
-
-  self->length++;
+  klist_reserve (self, self->length + 1);
+  self->items[self->length++] = ref;
   KLOG_OUT
   }
 
@@ -110,20 +114,17 @@ void klist_append (KList *self, void *ref)
   
   klist_clear
 
+  The array is kept, on the basis that a list that has been filled once
+  is likely to be filled again
+
   ==========================================================================*/
 void klist_clear (KList *self)
   {
   KLOG_IN
   assert (self != NULL);
 
-  ListItem *l = self->head;
-  while (l)
-    {
-    self->free_fn (l->data);
-    ListItem *temp = l;
-    l = l->next;
-    free (temp);
-    }
+  for (size_t i = 0; i < self->length; i++)
+    self->free_fn (self->items[i]);
   
   self->length = 0;
   KLOG_OUT
@@ -136,19 +137,9 @@ void klist_clear (KList *self)
   ==========================================================================*/
 void *klist_get (const KList *self, size_t index)
   {
-  KLOG_IN
   assert (self != 0);
-  assert (index >= 0);
   assert (index < self->length);
-  ListItem *l = self->head;
-  int i = 0;
-  while (l != NULL && i != index)
-    {
-    l = l->next;
-    i++;
-    }
-  KLOG_OUT
-  return l->data;
+  return self->items[index];
   }
 
 /*============================================================================
@@ -158,10 +149,54 @@ void *klist_get (const KList *self, size_t index)
   ==========================================================================*/
 size_t klist_length (const KList *self)
   {
-  KLOG_IN
   assert (self != NULL);
   return self->length;
-  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  klist_remove_where
+
+  Remove the items for which match() is true, keeping the others in 
+  order, in one pass
+
+  ==========================================================================*/
+static void klist_remove_where (KList *self, 
+      BOOL (*match) (const void *data, const void *arg, void *fn), 
+      const void *arg, void *fn, BOOL destroy)
+  {
+  size_t kept = 0;
+  for (size_t i = 0; i < self->length; i++)
+    {
+    void *data = self->items[i];
+    if (match (data, arg, fn))
+      {
+      if (destroy) self->free_fn (data);
+      }
+    else
+      self->items[kept++] = data;
+    }
+  self->length = kept;
+  }
+
+/*============================================================================
+  
+  klist_match_value
+
+  ==========================================================================*/
+static BOOL klist_match_value (const void *data, const void *item, void *fn)
+  {
+  return ((ListCompareFn)fn) (data, item, NULL) == 0;
+  }
+
+/*============================================================================
+  
+  klist_match_ref
+
+  ==========================================================================*/
+static BOOL klist_match_ref (const void *data, const void *ref, void *fn)
+  {
+  return data == ref;
   }
 
 /*============================================================================
@@ -175,32 +210,7 @@ void klist_remove (KList *self, const void *item, ListCompareFn fn)
   assert (self != NULL);
   assert (item != NULL);
   assert (fn != NULL);
-  ListItem *l = self->head;
-  ListItem *last_good = NULL;
-  while (l != NULL)
-    {
-    if (fn (l->data, item, NULL) == 0)
-      {
-      if (l == self->head)
-        {
-        self->head = l->next; // l-> next might be null
-        }
-      else
-        {
-        if (last_good) last_good->next = l->next;
-        }
-      self->free_fn (l->data);
-      ListItem *temp = l->next;
-      free (l);
-      self->length--;
-      l = temp;
-      }
-    else
-      {
-      last_good = l;
-      l = l->next;
-      }
-    }
+  klist_remove_where (self, klist_match_value, item, fn, TRUE);
   KLOG_OUT                        
   }
 
@@ -213,33 +223,7 @@ void klist_remove_ref (KList *self, const void *ref, BOOL destroy)
   {
   KLOG_IN
   assert (self != NULL);
-  ListItem *l = self->head;
-  ListItem *last_good = NULL;
-  while (l != NULL)
-    {
-    if (l->data == ref)
-      {
-      if (l == self->head)
-        {
-        self->head = l->next; // l-> next might be null
-        }
-      else
-        {
-        if (last_good) last_good->next = l->next;
-        }
-      if (destroy) self->free_fn (l->data);
-      ListItem *temp = l->next;
-      self->length--;
-      free (l);
-      l = temp;
-      }
-    else
-      {
-      last_good = l;
-      l = l->next;
-      }
-    }
-
+  klist_remove_where (self, klist_match_ref, ref, NULL, destroy);
   KLOG_OUT;
   }
 
@@ -251,35 +235,7 @@ void klist_remove_ref (KList *self, const void *ref, BOOL destroy)
 void klist_sort (KList *self, ListSortFn fn, void *user_data)
   {
   KLOG_IN
-  int length = klist_length (self);
-  
-  void **temp = malloc (length * sizeof (void *));
-  ListItem *l = self->head;
-  int i = 0;
-  while (l != NULL)
-    {
-    temp[i] = l->data;
-    l = l->next;
-    i++;
-    }
-
-  // Sort temp
-
-  qsort_r (temp, length, sizeof (void *), fn, user_data); 
-  
-  // Copy the sorted data back
-   
-  l = self->head;
-  i = 0;
-  while (l != NULL)
-    {
-    l->data = temp[i];
-    l = l->next;
-    i++;
-    }
-  
-  free (temp);
-
+  qsort_r (self->items, self->length, sizeof (void *), fn, user_data); 
   KLOG_OUT
   }
 
@@ -294,13 +250,14 @@ void klist_transfer_list (KList *self, KList *list)
   KLOG_IN
   assert (self != NULL);
   assert (list != NULL);
-  for (int i = list->length - 1; i >= 0; i--)
+  if (list->length > 0)
     {
-    void *ref = klist_get (list, i);
-    klist_append (self, ref);
-    klist_remove_ref (list, ref, FALSE); // Don't destroy -- item has moved 
+    klist_reserve (self, self->length + list->length);
+    memcpy (self->items + self->length, list->items, 
+      list->length * sizeof (void *));
+    self->length += list->length;
+    list->length = 0;
     }
   KLOG_OUT
   }
 
-
@@ -15,19 +15,148 @@
 #include <memory.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "convertutf.h" 
 #include <klib/klog.h>
 
+// The functions are defined here under the same names as the macros
+//   in klog.h that check the level before calling them
+#undef klog_error
+#undef klog_warn
+#undef klog_info
+#undef klog_debug
+#undef klog_trace
+
+// Messages are formatted into a buffer of this size on the stack, and 
+//   only longer ones need an allocation
+#define KLOG_MESSAGE_SIZE 512
+#define KLOG_FILE_BUFFER_SIZE 4096
+
 // Fwd refs
 static void klog_v (KLogLevel level, const char *cls, const char *fmt, 
          va_list ap);
 
-static int log_level = KLOG_INFO;
+int klog_log_level = KLOG_INFO;
 
 static KLogHandler log_handler = NULL;
 
 static void *log_user_data = NULL;
 
+static int log_fd = -1; // Set by klog_open_file()
+static pid_t log_pid; // The process whose messages are in the buffer
+static char log_buffer[KLOG_FILE_BUFFER_SIZE];
+static size_t log_buffer_used = 0;
+
+/*============================================================================
+  
+  klog_check_pid
+
+  A child process inherits a copy of the buffer, which its parent will
+  write out, so the child must discard it
+
+  ==========================================================================*/
+static void klog_check_pid (void)
+  {
+  pid_t pid = getpid ();
+  if (pid != log_pid)
+    {
+    log_buffer_used = 0;
+    log_pid = pid;
+    }
+  }
+
+/*============================================================================
+  
+  klog_flush_file
+
+  ==========================================================================*/
+static void klog_flush_file (void)
+  {
+  size_t done = 0;
+  while (done < log_buffer_used)
+    {
+    ssize_t n = write (log_fd, log_buffer + done, log_buffer_used - done);
+    if (n <= 0) break;
+    done += n;
+    }
+  log_buffer_used = 0;
+  }
+
+/*============================================================================
+  
+  klog_write_file
+
+  Append a message to the file buffer, writing the buffer out first if
+  the message won't fit. A message too big for the buffer is written 
+  straight to the file.
+
+  ==========================================================================*/
+static void klog_write_file (KLogLevel level, const char *cls, 
+      const char *msg)
+  {
+  char line[KLOG_MESSAGE_SIZE + 100];
+  char *s = line;
+  int l = snprintf (line, sizeof (line), "%s %s: %s\n", 
+    klog_level_to_utf8 (level), cls, msg);
+  if (l >= sizeof (line))
+    l = asprintf (&s, "%s %s: %s\n", klog_level_to_utf8 (level), cls, msg);
+  klog_check_pid ();
+  if (l > 0)
+    {
+    if (log_buffer_used + l > sizeof (log_buffer))
+      klog_flush_file ();
+    if (l > sizeof (log_buffer))
+      {
+      if (write (log_fd, s, l) < 0) {} // Nowhere to report this
+      }
+    else
+      {
+      memcpy (log_buffer + log_buffer_used, s, l);
+      log_buffer_used += l;
+      }
+    }
+  if (s != line) free (s);
+  }
+
+/*============================================================================
+  
+  klog_open_file
+
+  ==========================================================================*/
+BOOL klog_open_file (const char *file)
+  {
+  static BOOL registered = FALSE;
+  klog_close_file ();
+  log_fd = open (file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  log_pid = getpid ();
+  if (log_fd >= 0 && !registered)
+    {
+    // Don't lose what's in the buffer if the program exits without
+    //   closing the file
+    atexit (klog_close_file);
+    registered = TRUE;
+    }
+  return log_fd >= 0;
+  }
+
+/*============================================================================
+  
+  klog_close_file
+
+  ==========================================================================*/
+void klog_close_file (void)
+  {
+  if (log_fd >= 0)
+    {
+    klog_check_pid ();
+    klog_flush_file ();
+    close (log_fd);
+    log_fd = -1;
+    }
+  }
+
 /*============================================================================
   
   klog_debug
@@ -93,7 +222,7 @@ const UTF8 *klog_level_to_utf8 (KLogLevel level)
   ==========================================================================*/
 void klog_init (KLogLevel level, KLogHandler handler, void *user_data)
   {
-  log_level = level;
+  klog_log_level = level;
   log_handler = handler;
   log_user_data = user_data;
   }
@@ -128,7 +257,7 @@ extern void klog_set_handler (KLogHandler handler)
   ==========================================================================*/
 void klog_set_log_level (int level)
   {
-  log_level = level;
+  klog_log_level = level;
   }
 
 /*============================================================================
@@ -150,13 +279,23 @@ klog_v
 void klog_v (KLogLevel level, const char *cls, const char *fmt,  
                      va_list ap)
   {
-  if (level > log_level) return;
-  char *s;
-  vasprintf (&s, fmt, ap);
-  if (log_handler)
+  if (level > klog_log_level) return;
+  char buff[KLOG_MESSAGE_SIZE];
+  char *s = buff;
+  va_list ap2;
+  va_copy (ap2, ap);
+  if (vsnprintf (buff, sizeof (buff), fmt, ap) >= sizeof (buff))
+    {
+    if (vasprintf (&s, fmt, ap2) < 0) s = buff;
+    }
+  va_end (ap2);
+
+  if (log_fd >= 0)
+    klog_write_file (level, cls, s);
+  else if (log_handler)
     log_handler (level, cls, log_user_data, s);
   else
     fprintf (stderr, "%s %s: %s\n", klog_level_to_utf8 (level), cls, s);
-  free (s);
+  if (s != buff) free (s);
   }
 
@@ -180,7 +180,7 @@ BOOL kpath_create_directory (const KPath *self)
   {
   KLOG_IN
   BOOL ret = FALSE; 
-  UTF8 *path = kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
 
   pid_t pid = fork();
 
@@ -202,7 +202,6 @@ BOOL kpath_create_directory (const KPath *self)
     }
   // else fork() failed
 
-  free (path);
   KLOG_OUT
   return ret;
   }
@@ -217,7 +216,7 @@ KList *kpath_expand (const KPath *self, uint32_t flags)
   KLOG_IN
   assert (self != NULL);
   KList *ret = NULL;
-  char *path = (char *)kstring_to_utf8 ((KString*)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   klog_debug (KLOG_CLASS, "%s: path '%s'", __PRETTY_FUNCTION__, path); 
   DIR *d = opendir (path);
   if (d)
@@ -253,7 +252,6 @@ KList *kpath_expand (const KPath *self, uint32_t flags)
 
     closedir (d);
     }
-  free (path);
   KLOG_OUT
   return ret;
   }
@@ -267,9 +265,8 @@ FILE *kpath_fopen (const KPath *self, const char *mode)
   {
   KLOG_IN
   FILE *ret = NULL;
-  UTF8 *path = kstring_to_utf8 ((KString *)self);
-  ret = fopen ((char *)path, mode);
-  free (path);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
+  ret = fopen (path, mode);
   KLOG_OUT
   return ret;
   }
@@ -352,7 +349,7 @@ KPathType kpath_get_type (const KPath *self)
 extern BOOL kpath_mtime (const KPath *self, time_t *mtime)
   {
   KLOG_IN
-  char *path = (char *)kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   BOOL ret = FALSE;
   klog_debug (KLOG_CLASS, "Getting mtime for '%s'", path);
 
@@ -368,7 +365,6 @@ extern BOOL kpath_mtime (const KPath *self, time_t *mtime)
     ret = FALSE;
     }
 
-  free (path);
   KLOG_OUT
   return ret;
   }
@@ -383,10 +379,9 @@ int kpath_open_read (const KPath *self)
   {
   KLOG_IN
   int ret = 0;  
-  UTF8 *path = kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   klog_debug (KLOG_CLASS, "Open '%s' for read", path);
-  ret = open ((char *)path, O_RDONLY);
-  free (path);
+  ret = open (path, O_RDONLY);
   KLOG_OUT
   return ret;
   }
@@ -400,10 +395,9 @@ int kpath_open_write (const KPath *self)
   {
   KLOG_IN
   int ret = 0;  
-  UTF8 *path = kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   klog_debug (KLOG_CLASS, "Open '%s' for write", path);
-  ret = open ((char *)path, O_WRONLY | O_CREAT | O_TRUNC);
-  free (path);
+  ret = open (path, O_WRONLY | O_CREAT | O_TRUNC);
   KLOG_OUT
   return ret;
   }
@@ -417,7 +411,7 @@ KBuffer *kpath_read_to_buffer (const KPath *self)
   {
   KLOG_IN
   KBuffer *ret = NULL;
-  char *path = (char *)kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   klog_debug (KLOG_CLASS, "Read to buffer from '%s'", path);
 
   uint64_t size;
@@ -455,7 +449,6 @@ KBuffer *kpath_read_to_buffer (const KPath *self)
        strerror (errno));
     }
 
-  free (path);
   KLOG_OUT
   return ret;
   }
@@ -469,7 +462,7 @@ KString *kpath_read_to_string (const KPath *self)
   {
   KLOG_IN
   KString *ret = NULL;
-  char *path = (char *)kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   klog_debug (KLOG_CLASS, "Read to string from '%s'", path);
 
   KBuffer *buff = kpath_read_to_buffer (self);
@@ -479,7 +472,6 @@ KString *kpath_read_to_string (const KPath *self)
     kbuffer_destroy (buff);
     }
 
-  free (path);
   KLOG_OUT
   return ret;
   }
@@ -526,7 +518,7 @@ void kpath_remove_filename (KPath *self)
 BOOL kpath_size (const KPath *self, uint64_t *size)
   {
   KLOG_IN
-  char *path = (char *)kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   BOOL ret = FALSE;
   klog_debug (KLOG_CLASS, "Getting size of '%s'", path);
 
@@ -542,7 +534,6 @@ BOOL kpath_size (const KPath *self, uint64_t *size)
     ret = FALSE;
     }
 
-  free (path);
   KLOG_OUT
   return ret;
   }
@@ -556,7 +547,7 @@ BOOL kpath_size (const KPath *self, uint64_t *size)
 BOOL kpath_lstat (const KPath *self, struct stat *sb)
   {
   KLOG_IN
-  char *path = (char *)kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   klog_debug (KLOG_CLASS, "Calling lstat() on '%s'", path);
 
   BOOL ret;
@@ -569,7 +560,6 @@ BOOL kpath_lstat (const KPath *self, struct stat *sb)
     ret = FALSE;
     }
 
-  free (path);
   KLOG_OUT
   return ret;
   }
@@ -671,7 +661,7 @@ int kpath_sort_fn (const void *p1, const void *p2, void *user_data)
 BOOL kpath_stat (const KPath *self, struct stat *sb)
   {
   KLOG_IN
-  char *path = (char *)kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   klog_debug (KLOG_CLASS, "Calling stat() on '%s'", path);
 
   BOOL ret;
@@ -684,7 +674,6 @@ BOOL kpath_stat (const KPath *self, struct stat *sb)
     ret = FALSE;
     }
 
-  free (path);
   KLOG_OUT
   return ret;
   }
@@ -710,9 +699,8 @@ UTF8 *kpath_to_utf8 (const KPath *self)
 extern BOOL kpath_unlink (const KPath *self)
   {
   KLOG_IN
-  char *path = (char *)kstring_to_utf8 ((KString *)self);
+  const char *path = (const char *)kstring_cstr_utf8 ((KString *)self);
   BOOL ret = (unlink (path) == 0);
-  free (path);
   KLOG_OUT
   return ret;
   }
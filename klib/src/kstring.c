@@ -4,6 +4,23 @@
   
   kstring.c
 
+  The text is held as UTF-8, because that is how it nearly always 
+  arrives and leaves, with the number of bytes, the room available,
+  and the number of characters (code points). Short strings are held
+  in a buffer inside the object, so that they need no second 
+  allocation; longer ones on the heap, in a buffer that doubles in
+  size as the string grows.
+
+  Positions in the API are counted in characters, not bytes. While 
+  every character is a single byte, which is almost always, a 
+  position is an offset into the buffer; otherwise the text has to be
+  decoded up to that position. A UTF-32 copy is made only if 
+  kstring_cstr() is called, and kept until the string changes.
+
+  Bytes that are not valid UTF-8 are kept as they are, and count as
+  a character each, so that any path can be held and given back 
+  unchanged.
+
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
 
@@ -12,15 +29,19 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
-#include <memory.h>
+#include <string.h>
 #include <assert.h>
 #include <stdarg.h>
-#include "convertutf.h" 
 #include <klib/kstring.h>
+#include <klib/karena.h>
 #include <klib/klog.h>
 
 #define KLOG_CLASS "klib.kstring"
 
+// Strings of up to this many bytes, less one for the terminating zero,
+//   are held inside the KString
+#define KSTRING_SMALL_SIZE 32
+
 /*============================================================================
   
   KString 
@@ -28,10 +49,202 @@
   ==========================================================================*/
 struct _KString
   {
-  size_t length;
-  UTF32 *str;
+  UTF8 *str; // Either small, or on the heap; always zero-terminated
+  size_t size; // In bytes, not counting the terminating zero
+  size_t capacity; // Bytes that str can hold, including the zero
+  size_t length; // In characters
+  UTF32 *utf32; // Made by kstring_cstr(); NULL until then
+  UTF8 small[KSTRING_SMALL_SIZE];
   };
 
+/*============================================================================
+  
+  kstring_decode
+
+  Decode the character that starts at s[*pos], and move *pos past it.
+  Anything that is not a valid, shortest-form UTF-8 sequence is taken
+  to be a single character, with the value of its first byte.
+
+  ==========================================================================*/
+static UTF32 kstring_decode (const UTF8 *s, size_t size, size_t *pos)
+  {
+  size_t p = *pos;
+  UTF32 c = s[p];
+  int extra = 0;
+  UTF32 min = 0;
+  if (c >= 0xF0 && c < 0xF5) { extra = 3; c &= 0x07; min = 0x10000; }
+  else if (c >= 0xE0 && c < 0xF0) { extra = 2; c &= 0x0F; min = 0x800; }
+  else if (c >= 0xC2 && c < 0xE0) { extra = 1; c &= 0x1F; min = 0x80; }
+
+  if (extra == 0 || p + extra >= size)
+    {
+    *pos = p + 1;
+    return s[p];
+    }
+  for (int i = 1; i <= extra; i++)
+    {
+    if ((s[p + i] & 0xC0) != 0x80)
+      {
+      *pos = p + 1;
+      return s[p];
+      }
+    c = (c << 6) | (s[p + i] & 0x3F);
+    }
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000))
+    {
+    *pos = p + 1;
+    return s[p];
+    }
+  *pos = p + 1 + extra;
+  return c;
+  }
+
+/*============================================================================
+  
+  kstring_encode
+
+  Store the UTF-8 for c in u, which must have room for UTF8_MAX_BYTES,
+  and return the number of bytes
+
+  ==========================================================================*/
+static int kstring_encode (UTF32 c, UTF8 *u)
+  {
+  if (c < 0x80)
+    {
+    u[0] = (BYTE)c;
+    return 1;
+    }
+  else if (c < 0x0800)
+    {
+    u[0] = (BYTE)((c >> 6) | 0xC0);
+    u[1] = (BYTE)((c & 0x3F) | 0x80);
+    return 2;
+    }
+  else if (c < 0x10000)
+    {
+    u[0] = (BYTE)((c >> 12) | 0xE0);
+    u[1] = (BYTE)((c >> 6 & 0x3F) | 0x80);
+    u[2] = (BYTE)((c & 0x3F) | 0x80);
+    return 3;
+    }
+  else
+    {
+    u[0] = (BYTE)((c >> 18) | 0xF0);
+    u[1] = (BYTE)(((c >> 12) & 0x3F) | 0x80);
+    u[2] = (BYTE)(((c >> 6) & 0x3F) | 0x80);
+    u[3] = (BYTE)((c & 0x3F) | 0x80);
+    return 4;
+    }
+  }
+
+/*============================================================================
+  
+  kstring_count
+
+  The number of characters in size bytes of s
+
+  ==========================================================================*/
+static size_t kstring_count (const UTF8 *s, size_t size)
+  {
+  size_t n = 0;
+  size_t p = 0;
+  while (p < size)
+    {
+    if (s[p] < 0x80)
+      p++;
+    else
+      kstring_decode (s, size, &p);
+    n++;
+    }
+  return n;
+  }
+
+/*============================================================================
+  
+  kstring_offset
+
+  The byte offset of character i, which may be the length of the 
+  string
+
+  ==========================================================================*/
+static size_t kstring_offset (const KString *self, size_t i)
+  {
+  if (self->length == self->size) return i;
+  size_t p = 0;
+  for (size_t n = 0; n < i && p < self->size; n++)
+    kstring_decode (self->str, self->size, &p);
+  return p;
+  }
+
+/*============================================================================
+  
+  kstring_changed
+
+  Drop the UTF-32 copy, which no longer matches
+
+  ==========================================================================*/
+static void kstring_changed (KString *self)
+  {
+  if (self->utf32)
+    {
+    kfree (self->utf32);
+    self->utf32 = NULL;
+    }
+  }
+
+/*============================================================================
+  
+  kstring_reserve
+
+  Make room for size bytes, plus the terminating zero
+
+  ==========================================================================*/
+static void kstring_reserve (KString *self, size_t size)
+  {
+  if (size < self->capacity) return;
+  size_t capacity = self->capacity * 2;
+  while (capacity < size + 1)
+    capacity *= 2;
+  if (self->str == self->small)
+    {
+    self->str = kmalloc (capacity);
+    memcpy (self->str, self->small, self->size + 1);
+    }
+  else
+    self->str = krealloc (self->str, capacity);
+  self->capacity = capacity;
+  }
+
+/*============================================================================
+  
+  kstring_append_bytes
+
+  ==========================================================================*/
+static void kstring_append_bytes (KString *self, const UTF8 *s, 
+      size_t size, size_t length)
+  {
+  kstring_reserve (self, self->size + size);
+  memcpy (self->str + self->size, s, size);
+  self->size += size;
+  self->str[self->size] = 0;
+  self->length += length;
+  kstring_changed (self);
+  }
+
+/*============================================================================
+  
+  kstring_set_size
+
+  Cut the string to its first size bytes, which hold length characters
+
+  ==========================================================================*/
+static void kstring_set_size (KString *self, size_t size, size_t length)
+  {
+  self->size = size;
+  self->str[size] = 0;
+  self->length = length;
+  kstring_changed (self);
+  }
 
 /*============================================================================
   
@@ -41,10 +254,13 @@ struct _KString
 KString *kstring_new_empty (void)
   {
   KLOG_IN
-  KString *self = malloc (sizeof (KString));
-  self->str = malloc(1 * sizeof (UTF32));
+  KString *self = kmalloc (sizeof (KString));
+  self->str = self->small;
   self->str[0] = 0;
+  self->size = 0;
+  self->capacity = KSTRING_SMALL_SIZE;
   self->length = 0;
+  self->utf32 = NULL;
   KLOG_OUT
   return self;
   }
@@ -55,25 +271,13 @@ KString *kstring_new_empty (void)
   KString *kstring_new_from_utf8
 
   ==========================================================================*/
-KString *kstring_new_from_utf8 (const UTF8 *_in)
+KString *kstring_new_from_utf8 (const UTF8 *in)
   {
   KLOG_IN
-  assert (_in != NULL);
-  KString *self = malloc (sizeof (KString));
-
-  const UTF8* in = (UTF8 *)_in;
-  int max_out = strlen ((char *)_in); // This is an absolute maximum
-  UTF32 *out = malloc ((max_out + 1) * sizeof (UTF32));
-  memset (out, 0, max_out * sizeof (UTF32));
-  UTF32 *out_temp = out;
-
-  ConvertUTF8toUTF32 ((const UTF8 **)&in, (const UTF8 *)in+strlen((char *)in),
-      &out_temp, out + max_out, 0);
-
-  int len = out_temp - out;
-  out [len] = 0;
-  self->str = out;
-  self->length = len;
+  assert (in != NULL);
+  KString *self = kstring_new_empty ();
+  size_t size = strlen ((const char *)in);
+  kstring_append_bytes (self, in, size, kstring_count (in, size));
   KLOG_OUT
   return self;
   }
@@ -88,10 +292,8 @@ KString *kstring_new_from_utf32 (const UTF32 *s)
   {
   KLOG_IN
   assert (s != NULL);
-  KString *self = malloc (sizeof (KString));
-  self->length = kstring_length_utf32 (s);
-  self->str = malloc ((self->length + 1) * sizeof (UTF32));
-  memcpy (self->str, s, (self->length + 1) * sizeof (UTF32));
+  KString *self = kstring_new_empty ();
+  kstring_append_utf32 (self, s);
   KLOG_OUT
   return self;
   }
@@ -106,8 +308,9 @@ void kstring_destroy (KString *self)
   KLOG_IN
   if (self)
     {
-    if (self->str) free (self->str);
-    free (self);
+    if (self->str != self->small) kfree (self->str);
+    kfree (self->utf32);
+    kfree (self);
     }
   KLOG_OUT
   }
@@ -139,33 +342,21 @@ void kstring_append (KString *self, const KString *s)
   KLOG_IN
   assert (self != NULL);
   assert (s != NULL);
-  int newlen = self->length + s->length;
-  self->str = realloc (self->str, (newlen + 1) * sizeof (UTF32));
-  memcpy (self->str + self->length, s->str, (s->length * sizeof (UTF32)));
-  self->length = newlen;
-  self->str [self->length] = 0;
+  kstring_append_bytes (self, s->str, s->size, s->length);
   KLOG_OUT
   }
 
 /*============================================================================
   
-  kstring_append_printf
-
-  Better hope the C library memory allocator is efficient, because this
-    implementation is not :/
+  kstring_append_char
 
   ==========================================================================*/
 void kstring_append_char (KString *self, UTF32 c)
   {
   KLOG_IN
   assert (self != NULL);
-  assert (self->str != NULL);
-
-  self->str = realloc (self->str, (self->length + 2) * sizeof (UTF32)); 
-  self->str[self->length] = c;
-  self->str[self->length + 1] = 0;
-  self->length += 1;
-
+  UTF8 u[UTF8_MAX_BYTES];
+  kstring_append_bytes (self, u, kstring_encode (c, u), 1);
   KLOG_OUT
   }
 
@@ -179,12 +370,21 @@ void kstring_append_printf (KString *self, char *fmt,...)
   KLOG_IN
   assert (self != NULL);
   assert (fmt != NULL);
-  va_list ap;
+  // Format straight into the buffer, having first found out how much
+  //   room is needed
+  va_list ap, ap2;
   va_start (ap, fmt);
-  char *s;
-  vasprintf (&s, fmt, ap);
-  kstring_append_utf8 (self, (UTF8*)s);
-  free (s);
+  va_copy (ap2, ap);
+  int size = vsnprintf (NULL, 0, fmt, ap);
+  if (size > 0)
+    {
+    kstring_reserve (self, self->size + size);
+    vsnprintf ((char *)self->str + self->size, size + 1, fmt, ap2);
+    self->length += kstring_count (self->str + self->size, size);
+    self->size += size;
+    kstring_changed (self);
+    }
+  va_end (ap2);
   va_end (ap);
   KLOG_OUT
   }
@@ -197,10 +397,10 @@ void kstring_append_printf (KString *self, char *fmt,...)
 void kstring_append_utf8 (KString *self, const UTF8 *s)
   {
   KLOG_IN
+  assert (self != NULL);
   assert (s != NULL);
-  KString *temp = kstring_new_from_utf8 (s);
-  kstring_append (self, temp);
-  kstring_destroy (temp);
+  size_t size = strlen ((const char *)s);
+  kstring_append_bytes (self, s, size, kstring_count (s, size));
   KLOG_OUT
   }
 
@@ -212,7 +412,10 @@ void kstring_append_utf8 (KString *self, const UTF8 *s)
 void kstring_append_utf32 (KString *self, const UTF32 *s)
   {
   KLOG_IN
-  kstring_append_utf32 (self, s);
+  assert (self != NULL);
+  assert (s != NULL);
+  for (; *s; s++)
+    kstring_append_char (self, *s);
   KLOG_OUT
   }
 
@@ -225,9 +428,29 @@ const UTF32 *kstring_cstr (const KString *self)
   {
   KLOG_IN
   assert (self != NULL);
-  UTF32 *ret = self->str;
+  if (!self->utf32)
+    {
+    // The copy is a cache, so making it does not change the string 
+    KString *_self = (KString *)self;
+    _self->utf32 = kmalloc ((self->length + 1) * sizeof (UTF32));
+    size_t p = 0;
+    for (size_t i = 0; i < self->length; i++)
+      _self->utf32[i] = kstring_decode (self->str, self->size, &p);
+    _self->utf32[self->length] = 0;
+    }
   KLOG_OUT
-  return ret;
+  return self->utf32;
+  }
+
+/*============================================================================
+  
+  kstring_cstr_utf8
+
+  ==========================================================================*/
+const UTF8 *kstring_cstr_utf8 (const KString *self)
+  {
+  assert (self != NULL);
+  return self->str;
   }
 
 /*============================================================================
@@ -239,11 +462,7 @@ void kstring_clear (KString *self)
   {
   KLOG_IN
   assert (self != NULL);
-  assert (self->str != NULL);
-  free (self->str);
-  self->str = malloc (sizeof (UTF32));
-  self->str[0] = 0;
-  self->length = 0;
+  kstring_set_size (self, 0, 0);
   KLOG_OUT
   }
 
@@ -255,20 +474,16 @@ void kstring_clear (KString *self)
 void kstring_delete (KString *self, int pos, int len)
   {
   KLOG_IN
-  UTF32 *str = self->str;
-  int lself = self->length; 
-  if (pos + len > lself)
-    kstring_delete (self, pos, lself - len);
-  else
-    {
-    UTF32 *buff = malloc ((lself - len + 2) * sizeof (UTF32));
-    memcpy (buff, str, pos  * sizeof (UTF32));
-    memcpy (buff + pos, str + pos + len,
-      (1 + kstring_length_utf32 (str + pos + len)) * sizeof (UTF32));
-    free (self->str);
-    self->str = buff;
-    self->length -= len;
-    }
+  assert (self != NULL);
+  assert (pos >= 0 && pos <= self->length);
+  if (pos + len > self->length)
+    len = self->length - pos;
+  size_t start = kstring_offset (self, pos);
+  size_t end = start;
+  for (int i = 0; i < len; i++)
+    kstring_decode (self->str, self->size, &end);
+  memmove (self->str + start, self->str + end, self->size - end);
+  kstring_set_size (self, self->size - (end - start), self->length - len);
   KLOG_OUT 
   }
 
@@ -281,7 +496,10 @@ BOOL kstring_ends_with (const KString *self,
                         const  KString *s)
   {
   KLOG_IN
-  BOOL ret = kstring_ends_with_utf32 (self, s->str); 
+  assert (self != NULL);
+  assert (s != NULL);
+  BOOL ret = (s->size <= self->size && memcmp (self->str + self->size 
+     - s->size, s->str, s->size) == 0);
   KLOG_OUT
   return ret;
   }
@@ -298,9 +516,9 @@ BOOL kstring_ends_with_utf8 (const KString *self,
   KLOG_IN
   assert (self != NULL);
   assert (s!= NULL);
-  KString *temp = kstring_new_from_utf8 (s);
-  BOOL ret = kstring_ends_with (self, temp);
-  kstring_destroy (temp);
+  size_t size = strlen ((const char *)s);
+  BOOL ret = (size <= self->size 
+     && memcmp (self->str + self->size - size, s, size) == 0);
   KLOG_OUT
   return ret;
   }
@@ -315,22 +533,39 @@ BOOL kstring_ends_with_utf32 (const KString *self,
                         const  UTF32 *s)
   {
   KLOG_IN
-  BOOL ret = TRUE;
   assert (self != NULL);
   assert (s!= NULL);
-  int l = self->length;
-  int l2 = kstring_length_utf32 (s);
-  if (l2 <= l)
+  KString *temp = kstring_new_from_utf32 (s);
+  BOOL ret = kstring_ends_with (self, temp);
+  kstring_destroy (temp);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  kstring_find_bytes
+
+  The character position of the first or last occurrence of size 
+  bytes of s, or -1
+
+  ==========================================================================*/
+static size_t kstring_find_bytes (const KString *self, const UTF8 *s,
+      size_t size, BOOL last)
+  {
+  if (size > self->size) return -1; // Can't find a long string in short one
+  const UTF8 *found = NULL;
+  if (last)
     {
-    for (int i = 0; i < l2 && ret; i++)
-      {
-      if (self->str[i + (l - l2)] != s[i]) ret = FALSE;
-      }
+    for (size_t i = self->size - size + 1; i-- > 0 && !found; )
+      if (memcmp (self->str + i, s, size) == 0) found = self->str + i;
     }
   else
-    ret = FALSE;
-  KLOG_OUT
-  return ret;
+    found = memmem (self->str, self->size, s, size);
+  if (!found) return -1;
+  size_t byte = found - self->str;
+  if (self->length == self->size) return byte;
+  return kstring_count (self->str, byte);
   }
 
 /*============================================================================
@@ -341,7 +576,7 @@ BOOL kstring_ends_with_utf32 (const KString *self,
 size_t kstring_find (const KString *self, const KString *s)
   {
   KLOG_IN
-  size_t ret = kstring_find_utf32 (self, s->str);
+  size_t ret = kstring_find_bytes (self, s->str, s->size, FALSE);
   KLOG_OUT
   return ret;
   }
@@ -354,9 +589,8 @@ size_t kstring_find (const KString *self, const KString *s)
 size_t kstring_find_utf8 (const KString *self, const UTF8 *s)
   {
   KLOG_IN
-  KString *temp = kstring_new_from_utf8 (s);
-  size_t ret = kstring_find (self, temp);
-  kstring_destroy (temp);
+  size_t ret = kstring_find_bytes (self, s, strlen ((const char *)s), 
+    FALSE);
   KLOG_OUT
   return ret;
   }
@@ -369,20 +603,9 @@ size_t kstring_find_utf8 (const KString *self, const UTF8 *s)
 size_t kstring_find_utf32 (const KString *self, const UTF32 *s)
   {
   KLOG_IN
-  size_t ret = -1;
-  int lsearch = kstring_length_utf32 (s);
-  int lself = self->length; 
-  if (lsearch > lself) return -1; // Can't find a long string in short one
-  for (int i = 0; i < lself - lsearch + 1 && ret == -1; i++)
-    {
-    BOOL diff = FALSE;
-    for (int j = 0; j < lsearch && !diff; j++)
-      {
-      if (s[j] != self->str[i + j]) diff = TRUE;
-      }
-    if (!diff) ret = i;
-    }
-
+  KString *temp = kstring_new_from_utf32 (s);
+  size_t ret = kstring_find (self, temp);
+  kstring_destroy (temp);
   KLOG_OUT
   return ret;
   }
@@ -395,7 +618,7 @@ size_t kstring_find_utf32 (const KString *self, const UTF32 *s)
 size_t kstring_find_last (const KString *self, const KString *s)
   {
   KLOG_IN
-  size_t ret = kstring_find_last_utf32 (self, s->str);
+  size_t ret = kstring_find_bytes (self, s->str, s->size, TRUE);
   KLOG_OUT
   return ret;
   }
@@ -408,9 +631,8 @@ size_t kstring_find_last (const KString *self, const KString *s)
 size_t kstring_find_last_utf8 (const KString *self, const UTF8 *s)
   {
   KLOG_IN
-  KString *temp = kstring_new_from_utf8 (s);
-  size_t ret = kstring_find_last (self, temp);
-  kstring_destroy (temp);
+  size_t ret = kstring_find_bytes (self, s, strlen ((const char *)s), 
+    TRUE);
   KLOG_OUT
   return ret;
   }
@@ -422,26 +644,12 @@ size_t kstring_find_last_utf8 (const KString *self, const UTF8 *s)
   ==========================================================================*/
 size_t kstring_find_last_utf32 (const KString *self, const UTF32 *search)
   {
-  int lsearch = kstring_length_utf32 (search);
-  int lself = self->length;
-  if (lsearch > lself) 
-    {
-    return -1; // Can't find a long string in short one
-    }
-  else
-    {
-    for (int i = lself - lsearch; i >= 0; i--)
-      {
-      BOOL diff = FALSE;
-      for (int j = 0; j < lsearch; j++)
-        {
-        if (search[j] != self->str[i + j]) diff = TRUE;
-        }
-      if (!diff) return i;
-      }
-    }
-
-  return -1;
+  KLOG_IN
+  KString *temp = kstring_new_from_utf32 (search);
+  size_t ret = kstring_find_last (self, temp);
+  kstring_destroy (temp);
+  KLOG_OUT
+  return ret;
   }
 
 /*============================================================================
@@ -451,11 +659,8 @@ size_t kstring_find_last_utf32 (const KString *self, const UTF32 *search)
   ==========================================================================*/
 size_t kstring_length (const KString *self)
   {
-  KLOG_IN
   assert (self != NULL);
-  size_t ret = self->length;
-  KLOG_OUT
-  return ret;
+  return self->length;
   }
 
 
@@ -485,7 +690,8 @@ UTF32 kstring_get (const KString *self, size_t i)
   KLOG_IN
   assert (self != NULL);
   assert (i < self->length);
-  UTF32 ret = self->str[i];
+  size_t p = kstring_offset (self, i);
+  UTF32 ret = kstring_decode (self->str, self->size, &p);
   KLOG_OUT
   return ret;
   }
@@ -494,45 +700,20 @@ UTF32 kstring_get (const KString *self, size_t i)
   
   kstring_get_utf8
 
+  A byte that is not valid UTF-8 is given back as it is
+
   ==========================================================================*/
 size_t kstring_get_utf8 (const KString *self, size_t i, UTF8 *u)
   {
   KLOG_IN
   assert (self != NULL);
   assert (i < self->length);
-  int ret = 0;
-  int c = self->str[i];
-
-  if (c < 0x80)
-    {
-    *u = (BYTE)c;
-    ret = 1;
-    }
-  else if (c < 0x0800)
-    {
-    *u = (BYTE)((c >> 6) | 0xC0); u++;
-    *u = (BYTE)((c & 0x3F) | 0x80);
-    ret = 2;
-    }
-   else if (c < 0x10000)
-    {
-    *u = (BYTE)((c >> 12) | 0xE0); u++;
-    *u = (BYTE)((c >> 6 & 0x3F) | 0x80); u++;
-    *u = (BYTE)((c & 0x3F) | 0x80);
-    ret = 3;
-    }
-   else
-    {
-    *u = (BYTE)((c >> 18) | 0xF0); u++;
-    *u = (BYTE)(((c >> 12) & 0x3F) | 0x80); u++;
-    *u = (BYTE)(((c >> 6) & 0x3F) | 0x80); u++;
-    *u = (BYTE)((c & 0x3F) | 0x80);
-    ret = 4;
-    }
-
-
+  size_t start = kstring_offset (self, i);
+  size_t end = start;
+  kstring_decode (self->str, self->size, &end);
+  memcpy (u, self->str + start, end - start);
   KLOG_OUT
-  return ret;
+  return end - start;
   }
 
 
@@ -540,10 +721,13 @@ size_t kstring_get_utf8 (const KString *self, size_t i, UTF8 *u)
   
   kstring_strcmp
 
+  Comparing UTF-8 byte by byte gives the same order as comparing the
+  characters 
+
   ==========================================================================*/
 int kstring_strcmp (const KString *s1, const KString *s2)
   {
-  return kstring_strcmp_utf32 (s1->str, s2->str);
+  return strcmp ((const char *)s1->str, (const char *)s2->str);
   }
 
 /*============================================================================
@@ -554,9 +738,7 @@ int kstring_strcmp (const KString *s1, const KString *s2)
 int kstring_strcmp_utf8 (const KString *s1, const UTF8 *s2)
   {
   KLOG_IN
-  KString *temp = kstring_new_from_utf8 (s2);
-  int ret = kstring_strcmp (s1, temp); 
-  kstring_destroy (temp);
+  int ret = strcmp ((const char *)s1->str, (const char *)s2); 
   KLOG_OUT
   return ret;
   }
@@ -588,14 +770,15 @@ int kstring_strcmp_utf32 (const UTF32 *s1, const UTF32 *s2)
 KString *kstring_strdup (const KString *self)
   {
   KLOG_IN
-  KString *ret = kstring_new_from_utf32 (self->str);
+  KString *ret = kstring_new_empty ();
+  kstring_append (ret, self);
   KLOG_OUT
   return ret;
   }
 
 /*============================================================================
   
-  kstring_to_utf8
+  kstring_substring
 
   ==========================================================================*/
 KString *kstring_substring (const KString *self, int start, int count)
@@ -603,15 +786,21 @@ KString *kstring_substring (const KString *self, int start, int count)
   KLOG_IN
   assert (self != NULL);
   assert (start >= 0);
+  if (start > self->length)
+    start = self->length;
   if (count == 0)
     count = self->length - start;
   if (count + start >= self->length) 
     count = self->length - start;
-  UTF32 *s = malloc ((count + 1) * sizeof (UTF32));
-  memcpy (s, self->str + start, count  * sizeof (UTF32));
-  s[count] = 0;
-  KString *ret = kstring_new_from_utf32 (s);
-  free (s);
+  size_t from = kstring_offset (self, start);
+  size_t to = from;
+  if (self->length == self->size)
+    to += count;
+  else
+    for (int i = 0; i < count; i++)
+      kstring_decode (self->str, self->size, &to);
+  KString *ret = kstring_new_empty ();
+  kstring_append_bytes (ret, self->str + from, to - from, count);
   KLOG_OUT
   return ret; 
   }
@@ -634,14 +823,17 @@ int kstring_char_to_number (char c)
 
 /*============================================================================
   
-  kstring_to_utf8
+  kstring_to_integer
+
+  Digits are all single bytes, so the string can be read byte by byte:
+  any byte of a longer character is not a digit
 
   ==========================================================================*/
 BOOL kstring_to_integer (const KString *self, int *value, int radix)
   {
   KLOG_IN
   int ret = TRUE;
-  if (self->length == 0)
+  if (self->size == 0)
     {
     ret = FALSE;
     }
@@ -663,11 +855,12 @@ BOOL kstring_to_integer (const KString *self, int *value, int radix)
       start++;
       }
 
-    if (self->length - start >= 1) 
+    if ((int)self->size - start >= 1) 
       {
-      for (int i = self->length - 1; i >= start && ret; i--)
+      for (int i = self->size - 1; i >= start && ret; i--)
 	{
-	int d = kstring_char_to_number (self->str[i]);
+	int d = self->str[i] < 0x80 ? kstring_char_to_number (self->str[i]) 
+          : -1;
 	if (d < 0) 
 	  ret = FALSE;
         else if (d >= radix)
@@ -697,21 +890,10 @@ UTF8 *kstring_to_utf8 (const KString *self)
   {
   KLOG_IN
   assert (self != NULL);
-  const UTF32 *in = self->str;
-
-  int max_out = self->length * 5 + 1; // This is an absolute maximum
-  UTF8 *out = malloc ((max_out + 1) * sizeof (UTF8));
-  memset (out, 0, max_out * sizeof (UTF8));
-  UTF8 *out_temp = out;
-
-  ConvertUTF32toUTF8 ((const UTF32 **)&in, (const UTF32 *)in+self->length,
-      &out_temp, out + max_out, 0);
-
-  int len = out_temp - out;
-  out[len] = 0;
-
+  UTF8 *out = malloc (self->size + 1);
+  memcpy (out, self->str, self->size + 1);
   KLOG_OUT
-  return (UTF8 *)out;
+  return out;
   }
 
 /*============================================================================
@@ -722,29 +904,20 @@ UTF8 *kstring_to_utf8 (const KString *self)
 void kstring_trim_left (KString *self)
   {
   KLOG_IN
-  const UTF32 *s = self->str;
-  int l = self->length; 
-  int i = 0;
-  int pos = 0;
-  BOOL stop = FALSE;
-  while (i < l && !stop)
+  size_t pos = 0;
+  while (pos < self->size)
     {
-    char c = s[i];
+    UTF8 c = self->str[pos];
     if (c == ' ' || c == '\n' || c == '\t')
-      {
       pos++;
-      }
     else
-      stop = TRUE;
-    i++;
+      break;
+    }
+  if (pos > 0)
+    {
+    memmove (self->str, self->str + pos, self->size - pos);
+    kstring_set_size (self, self->size - pos, self->length - pos);
     }
-
-  int new_len = l - pos;
-  UTF32 *s_new = malloc ((new_len + 1) * sizeof (UTF32));
-  memcpy (s_new, self->str + pos, (new_len + 1) * sizeof (UTF32));
-  free (self->str);
-  self->str = s_new;
-  self->length = new_len; 
   KLOG_OUT
   }
 
@@ -756,23 +929,16 @@ void kstring_trim_left (KString *self)
 void kstring_trim_right (KString *self)
   {
   KLOG_IN
-  UTF32 *s = self->str;
-  int l = self->length; 
-  int i = l - 1;
-  BOOL stop = FALSE;
-  while (i >= 0 && !stop)
+  size_t size = self->size;
+  while (size > 0)
     {
-    UTF32 c = s[i];
+    UTF8 c = self->str[size - 1];
     if (c == ' ' || c == '\n' || c == '\t')
-      {
-      s[i] = 0;
-      }
+      size--;
     else
-      stop = TRUE;
-    i--;
+      break;
     }
-  self->length = i + 2;
+  if (size < self->size)
+    kstring_set_size (self, size, self->length - (self->size - size));
   KLOG_OUT
   }
-
-
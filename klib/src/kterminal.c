@@ -22,6 +22,19 @@
 #define KLOG_CLASS "klib.kterminal"
 
 
+/*============================================================================
+  
+  kterminal_begin_frame
+
+  ==========================================================================*/
+void kterminal_begin_frame (KTerminal *self)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  self->begin_frame (self);
+  KLOG_OUT
+  }
+
 /*============================================================================
   
   kterminal_clear
@@ -90,6 +103,19 @@ BOOL kterminal_init (KTerminal *self, KString **error)
   }
 
 
+/*============================================================================
+  
+  kterminal_flush
+
+  ==========================================================================*/
+void kterminal_flush (KTerminal *self)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  self->flush (self);
+  KLOG_OUT
+  }
+
 /*============================================================================
   
   kterminal_get_size
@@ -105,6 +131,20 @@ BOOL kterminal_get_size (const KTerminal *self, int *rows,
   return ret;
   }
 
+/*============================================================================
+  
+  kterminal_key_available
+
+  ==========================================================================*/
+BOOL kterminal_key_available (const KTerminal *self)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  BOOL ret = self->key_available (self);
+  KLOG_OUT
+  return ret;
+  }
+
 /*============================================================================
   
   kterminal_read_key
@@ -159,6 +199,19 @@ void kterminal_set_raw_mode (KTerminal *self, BOOL raw)
   KLOG_OUT
   }
 
+/*============================================================================
+  
+  kterminal_scroll
+
+  ==========================================================================*/
+void kterminal_scroll (KTerminal *self, int top, int bottom, int n)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  self->scroll (self, top, bottom, n);
+  KLOG_OUT
+  }
+
 /*============================================================================
   
   kterminal_write_line
@@ -0,0 +1,212 @@
+/*============================================================================
+  
+  klib
+
+  ktrace.c
+
+  Spans are kept in a fixed array, and times are taken from the
+  monotonic clock, so that tracing itself allocates nothing, and makes
+  no system calls, until the trace is written.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <klib/ktrace.h>
+
+/*============================================================================
+  
+  KTraceSpan
+
+  Times are in nanoseconds from the start of the trace. end is -1 while
+  the span is open.
+
+  ==========================================================================*/
+typedef struct _KTraceSpan
+  {
+  const char *name;
+  int64_t start;
+  int64_t end;
+  } KTraceSpan;
+
+BOOL ktrace_on = FALSE;
+
+static KTraceSpan spans[KTRACE_MAX_SPANS];
+static int nspans = 0;
+static int dropped = 0;
+static int64_t trace_start = 0; // Monotonic clock at the start of the trace
+static char trace_file[PATH_MAX];
+static char trace_label[256];
+
+/*============================================================================
+  
+  ktrace_now
+
+  ==========================================================================*/
+static int64_t ktrace_now (clockid_t clock)
+  {
+  struct timespec ts;
+  clock_gettime (clock, &ts);
+  return ts.tv_sec * (int64_t)1000000000 + ts.tv_nsec;
+  }
+
+/*============================================================================
+  
+  ktrace_init
+
+  ==========================================================================*/
+void ktrace_init (const char *file, const char *label, double start)
+  {
+  snprintf (trace_file, sizeof (trace_file), "%s", file);
+  snprintf (trace_label, sizeof (trace_label), "%s", label);
+  nspans = 0;
+  dropped = 0;
+  trace_start = ktrace_now (CLOCK_MONOTONIC);
+  if (start > 0)
+    {
+    // The caller's clock is the wall clock, so the time before we
+    //   started is measured on that, and the trace is moved back
+    //   to begin when the caller did
+    int64_t before = ktrace_now (CLOCK_REALTIME) - (int64_t)(start * 1e9);
+    if (before > 0)
+      {
+      trace_start -= before;
+      spans[0].name = "exec";
+      spans[0].start = 0;
+      spans[0].end = before;
+      nspans = 1;
+      }
+    }
+  ktrace_on = TRUE;
+  }
+
+/*============================================================================
+  
+  ktrace_begin
+
+  ==========================================================================*/
+int ktrace_begin (const char *name)
+  {
+  if (!ktrace_on) return -1;
+  if (nspans == KTRACE_MAX_SPANS)
+    {
+    dropped++;
+    return -1;
+    }
+  spans[nspans].name = name;
+  spans[nspans].start = ktrace_now (CLOCK_MONOTONIC) - trace_start;
+  spans[nspans].end = -1;
+  return nspans++;
+  }
+
+/*============================================================================
+  
+  ktrace_end
+
+  ==========================================================================*/
+void ktrace_end (int span)
+  {
+  if (ktrace_on && span >= 0 && span < nspans)
+    spans[span].end = ktrace_now (CLOCK_MONOTONIC) - trace_start;
+  }
+
+/*============================================================================
+  
+  ktrace_write_json_string
+
+  ==========================================================================*/
+static void ktrace_write_json_string (FILE *f, const char *s)
+  {
+  fputc ('"', f);
+  for (; *s; s++)
+    {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf (f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf (f, "\\u%04x", c);
+    else
+      fputc (c, f);
+    }
+  fputc ('"', f);
+  }
+
+/*============================================================================
+  
+  ktrace_write_chrome
+
+  The Trace Event format that chrome://tracing and Perfetto read: an
+  array of 'complete' events, with times in microseconds
+
+  ==========================================================================*/
+static void ktrace_write_chrome (FILE *f)
+  {
+  int pid = getpid ();
+  fprintf (f, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+    "\"args\":{\"name\":", pid);
+  ktrace_write_json_string (f, trace_label);
+  fprintf (f, "}}");
+  for (int i = 0; i < nspans; i++)
+    {
+    fprintf (f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+      "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", spans[i].name,
+      spans[i].start / 1e3, (spans[i].end - spans[i].start) / 1e3,
+      pid, pid);
+    }
+  fprintf (f, "\n]\n");
+  }
+
+/*============================================================================
+  
+  ktrace_write_summary
+
+  One line per run: the time, the label, the total in milliseconds, and
+  then each span's name and duration, in the order they started
+
+  ==========================================================================*/
+static void ktrace_write_summary (FILE *f, int64_t total)
+  {
+  char stamp[32];
+  time_t now = time (NULL);
+  strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", localtime (&now));
+  fprintf (f, "%s %s: total %.3f ms;", stamp, trace_label, total / 1e6);
+  for (int i = 0; i < nspans; i++)
+    fprintf (f, " %s %.3f", spans[i].name,
+      (spans[i].end - spans[i].start) / 1e6);
+  if (dropped)
+    fprintf (f, " (%d spans dropped)", dropped);
+  fprintf (f, "\n");
+  }
+
+/*============================================================================
+  
+  ktrace_finish
+
+  ==========================================================================*/
+BOOL ktrace_finish (void)
+  {
+  if (!ktrace_on) return TRUE;
+  ktrace_on = FALSE;
+  int64_t total = ktrace_now (CLOCK_MONOTONIC) - trace_start;
+  for (int i = 0; i < nspans; i++)
+    if (spans[i].end < 0) spans[i].end = total;
+
+  int l = strlen (trace_file);
+  BOOL json = (l > 5 && strcmp (trace_file + l - 5, ".json") == 0);
+  FILE *f = fopen (trace_file, json ? "w" : "a");
+  if (!f) return FALSE;
+  if (json)
+    ktrace_write_chrome (f);
+  else
+    ktrace_write_summary (f, total);
+  return (fclose (f) == 0);
+  }
+
@@ -1,10 +1,21 @@
 #!/bin/bash
 # This file is part of qcd(1).
 #
-# Redefine the cd command to invoke qcd, and feed the output back to
-#  the built-in cd 
-cd()
-  {
-  CD=`qcd "$@"`
-  builtin cd "$CD" 
-  }
+# Redefine the cd command to invoke qcd. If the qcd bash builtin is 
+#  installed, it changes directory itself, with no subshell. Otherwise,
+#  run the qcd program, and feed its output back to the built-in cd 
+QCD_BUILTIN=${QCD_BUILTIN:-/usr/lib/qcd/qcd.so}
+if [ -f "$QCD_BUILTIN" ] && enable -f "$QCD_BUILTIN" qcd 2>/dev/null; then
+  cd()
+    {
+    qcd "$@"
+    }
+else
+  cd()
+    {
+    # When tracing, tell qcd when we started it, so that it can 
+    #   report how long it took to get going
+    CD=`QCD_TRACE_START=${QCD_TRACE:+$EPOCHREALTIME} qcd "$@"`
+    builtin cd "$CD" 
+    }
+fi
@@ -0,0 +1,1013 @@
+/*============================================================================
+  
+  qcd 
+  
+  qcd_daemon.c
+
+  The qcd daemon, which keeps the directory list in memory, and serves
+  requests from qcd over a Unix socket, so that a normal invocation
+  doesn't have to open the database at all. There is one daemon per user
+  and database file.
+
+  Each connection carries one request: a single byte that says what to
+  do, and a NUL-terminated argument. The reply to a match is the
+  matching directories, best first, each terminated by a NUL, and then
+  an empty string. The reply to anything else is 'K', or 'E' followed
+  by a NUL-terminated error message.
+
+  Changes are applied to the in-memory list at once, and written to the
+  database in batches, in a single transaction, when the daemon has been
+  idle for a while, or has a lot of changes queued. If some other
+  process writes the database while the daemon is running, the daemon
+  sees that the data_version has changed, and reloads the list.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <klib/klib.h>
+#include "qcd_db.h"
+#include "qcd_daemon.h"
+#include "qcd_pattern.h"
+
+#define KLOG_CLASS "qcd.daemon"
+
+// Write queued changes to the database after this long...
+#define QCD_DAEMON_FLUSH_MSEC 1000
+// ... or as soon as there are this many of them
+#define QCD_DAEMON_MAX_PENDING 100
+// How long either end waits for the other before giving up
+#define QCD_DAEMON_TIMEOUT_SEC 2
+#define QCD_DAEMON_MAX_REQUEST (PATH_MAX + 2)
+
+/*============================================================================
+  
+  QcdDaemonEntry
+
+  One directory. The folded copy of the name, which is what matching
+  is done against, is stored in the same block as the original.
+
+  ==========================================================================*/
+typedef struct _QcdDaemonEntry
+  {
+  double rank;
+  char *folded;
+  char dir[];
+  } QcdDaemonEntry;
+
+/*============================================================================
+  
+  QcdDaemonUpdate
+
+  A change that has been made in memory, but not yet in the database
+
+  ==========================================================================*/
+typedef struct _QcdDaemonUpdate
+  {
+  char op; // QCD_DAEMON_ADD or QCD_DAEMON_DEL
+  time_t when;
+  char *dir;
+  } QcdDaemonUpdate;
+
+/*============================================================================
+  
+  QcdDaemon
+
+  The entries are kept in an array in rank order, which is the order
+  they are matched and returned in, and in a hash table by name, so a
+  visit can find its entry without a scan.
+
+  ==========================================================================*/
+typedef struct _QcdDaemon
+  {
+  QcdDb *db;
+  int listen_fd;
+  QcdDaemonEntry **entries; // Highest rank first
+  int n_entries;
+  int entries_size;
+  QcdDaemonEntry **slots; // Open-addressed hash table
+  int n_slots; // Always a power of two
+  int n_used_slots; // Including slots of deleted entries
+  QcdDaemonUpdate *pending;
+  int n_pending;
+  int pending_size;
+  long flush_due; // msec, when n_pending > 0
+  int data_version;
+  } QcdDaemon;
+
+// Marks a hash slot whose entry has been deleted
+static char qcd_daemon_deleted;
+#define QCD_DAEMON_DELETED ((QcdDaemonEntry *)&qcd_daemon_deleted)
+
+static volatile sig_atomic_t qcd_daemon_signalled = 0;
+
+/*============================================================================
+  
+  qcd_daemon_hash
+
+  ==========================================================================*/
+static unsigned int qcd_daemon_hash (const char *s)
+  {
+  unsigned int h = 2166136261u; // FNV-1a
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_socket_path
+
+  The socket goes in the user's runtime directory, if there is one,
+  or in /tmp. Its name includes a hash of the database file name, so
+  a different $HOME gets a different daemon.
+
+  ==========================================================================*/
+static BOOL qcd_daemon_socket_path (const char *db_file,
+      struct sockaddr_un *addr)
+  {
+  KLOG_IN
+  unsigned int h = qcd_daemon_hash (db_file);
+  memset (addr, 0, sizeof (struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  const char *dir = getenv ("XDG_RUNTIME_DIR");
+  int l;
+  if (dir && dir[0])
+    l = snprintf (addr->sun_path, sizeof (addr->sun_path),
+      "%s/qcd-%08x.sock", dir, h);
+  else
+    l = snprintf (addr->sun_path, sizeof (addr->sun_path),
+      "/tmp/qcd-%d-%08x.sock", (int)getuid(), h);
+  KLOG_OUT
+  return l < sizeof (addr->sun_path);
+  }
+
+/*============================================================================
+  
+  qcd_daemon_check_peer
+
+  Only talk to processes owned by the same user. In /tmp, anybody could
+  have created the socket.
+
+  ==========================================================================*/
+static BOOL qcd_daemon_check_peer (int fd)
+  {
+  struct ucred cred;
+  socklen_t l = sizeof (cred);
+  return getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &l) == 0
+    && cred.uid == getuid();
+  }
+
+/*============================================================================
+  
+  qcd_daemon_set_timeouts
+
+  ==========================================================================*/
+static void qcd_daemon_set_timeouts (int fd)
+  {
+  struct timeval tv = { QCD_DAEMON_TIMEOUT_SEC, 0 };
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  }
+
+/*============================================================================
+  
+  qcd_daemon_write_all
+
+  MSG_NOSIGNAL stops a write to a closed connection from killing
+  the process
+
+  ==========================================================================*/
+static BOOL qcd_daemon_write_all (int fd, const char *buf, int l)
+  {
+  while (l > 0)
+    {
+    ssize_t n = send (fd, buf, l, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return FALSE;
+    buf += n;
+    l -= n;
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_connect
+
+  ==========================================================================*/
+int qcd_daemon_connect (const char *db_file)
+  {
+  KLOG_IN
+  assert (db_file != NULL);
+  int fd = -1;
+  struct sockaddr_un addr;
+  if (qcd_daemon_socket_path (db_file, &addr))
+    {
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0)
+      {
+      if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0
+           && qcd_daemon_check_peer (fd))
+        {
+        klog_debug (KLOG_CLASS, "Connected to daemon at %s", addr.sun_path);
+        qcd_daemon_set_timeouts (fd);
+        }
+      else
+        {
+        close (fd);
+        fd = -1;
+        }
+      }
+    }
+  KLOG_OUT
+  return fd;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_send_request
+
+  ==========================================================================*/
+BOOL qcd_daemon_send_request (int fd, char op, const char *arg)
+  {
+  KLOG_IN
+  int l = strlen (arg);
+  char *buf = malloc (l + 2);
+  buf[0] = op;
+  memcpy (buf + 1, arg, l + 1);
+  BOOL ret = qcd_daemon_write_all (fd, buf, l + 2);
+  free (buf);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_read_status
+
+  ==========================================================================*/
+BOOL qcd_daemon_read_status (int fd, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  char status = 0;
+  if (read (fd, &status, 1) == 1 && status == 'K')
+    ret = TRUE;
+  else if (status == 'E')
+    {
+    char msg[256];
+    int l = 0;
+    while (l < sizeof (msg) - 1 && read (fd, msg + l, 1) == 1 && msg[l])
+      l++;
+    msg[l] = 0;
+    if (error) *error = kstring_new_from_utf8 ((UTF8 *)msg);
+    }
+  else if (error)
+    *error = kstring_new_from_utf8 ((UTF8 *)"Lost connection to daemon");
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_now
+
+  Monotonic time in msec
+
+  ==========================================================================*/
+static long qcd_daemon_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_find_slot
+
+  Returns the hash slot that holds dir, or -1
+
+  ==========================================================================*/
+static int qcd_daemon_find_slot (const QcdDaemon *self, const char *dir)
+  {
+  unsigned int mask = self->n_slots - 1;
+  for (unsigned int i = qcd_daemon_hash (dir) & mask; self->slots[i];
+        i = (i + 1) & mask)
+    {
+    if (self->slots[i] != QCD_DAEMON_DELETED
+         && strcmp (self->slots[i]->dir, dir) == 0)
+      return i;
+    }
+  return -1;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_rehash
+
+  Rebuild the hash table from the entries, with room to grow. Deleted
+  slots are dropped.
+
+  ==========================================================================*/
+static void qcd_daemon_rehash (QcdDaemon *self)
+  {
+  KLOG_IN
+  int n = 64;
+  while (n < self->n_entries * 4) n *= 2;
+  free (self->slots);
+  self->slots = calloc (n, sizeof (QcdDaemonEntry *));
+  self->n_slots = n;
+  self->n_used_slots = self->n_entries;
+  unsigned int mask = n - 1;
+  for (int i = 0; i < self->n_entries; i++)
+    {
+    unsigned int j = qcd_daemon_hash (self->entries[i]->dir) & mask;
+    while (self->slots[j]) j = (j + 1) & mask;
+    self->slots[j] = self->entries[i];
+    }
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_daemon_hash_insert
+
+  Add an entry that is known not to be in the table already
+
+  ==========================================================================*/
+static void qcd_daemon_hash_insert (QcdDaemon *self, QcdDaemonEntry *e)
+  {
+  // Keep at least half the slots empty, so probes stay short
+  if ((self->n_used_slots + 1) * 2 > self->n_slots)
+    qcd_daemon_rehash (self); // Already includes e
+  else
+    {
+    unsigned int mask = self->n_slots - 1;
+    unsigned int i = qcd_daemon_hash (e->dir) & mask;
+    while (self->slots[i] && self->slots[i] != QCD_DAEMON_DELETED)
+      i = (i + 1) & mask;
+    if (!self->slots[i]) self->n_used_slots++;
+    self->slots[i] = e;
+    }
+  }
+
+/*============================================================================
+  
+  qcd_daemon_index_of
+
+  Find the position of an entry in the rank-ordered array, by binary
+  search on its rank
+
+  ==========================================================================*/
+static int qcd_daemon_index_of (const QcdDaemon *self,
+      const QcdDaemonEntry *e)
+  {
+  int lo = 0, hi = self->n_entries;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (self->entries[mid]->rank > e->rank) lo = mid + 1; else hi = mid;
+    }
+  while (lo < self->n_entries && self->entries[lo] != e) lo++;
+  return lo;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_remove_at
+
+  ==========================================================================*/
+static void qcd_daemon_remove_at (QcdDaemon *self, int i)
+  {
+  memmove (self->entries + i, self->entries + i + 1,
+    (self->n_entries - i - 1) * sizeof (QcdDaemonEntry *));
+  self->n_entries--;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_insert_sorted
+
+  Insert an entry in rank order. A visited directory usually has the
+  highest rank, so this is usually at the start.
+
+  ==========================================================================*/
+static void qcd_daemon_insert_sorted (QcdDaemon *self, QcdDaemonEntry *e)
+  {
+  if (self->n_entries == self->entries_size)
+    {
+    self->entries_size = self->entries_size ? self->entries_size * 2 : 256;
+    self->entries = realloc (self->entries,
+      self->entries_size * sizeof (QcdDaemonEntry *));
+    }
+  int lo = 0, hi = self->n_entries;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (self->entries[mid]->rank >= e->rank) lo = mid + 1; else hi = mid;
+    }
+  memmove (self->entries + lo + 1, self->entries + lo,
+    (self->n_entries - lo) * sizeof (QcdDaemonEntry *));
+  self->entries[lo] = e;
+  self->n_entries++;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_entry_new
+
+  ==========================================================================*/
+static QcdDaemonEntry *qcd_daemon_entry_new (const char *dir, double rank)
+  {
+  int l = strlen (dir);
+  QcdDaemonEntry *e = malloc (sizeof (QcdDaemonEntry) + 2 * (l + 1));
+  e->rank = rank;
+  memcpy (e->dir, dir, l + 1);
+  e->folded = e->dir + l + 1;
+  memcpy (e->folded, dir, l + 1);
+  qcd_pattern_fold (e->folded);
+  return e;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_clear
+
+  Forget all entries, and any changes not yet written
+
+  ==========================================================================*/
+static void qcd_daemon_clear (QcdDaemon *self)
+  {
+  KLOG_IN
+  for (int i = 0; i < self->n_entries; i++)
+    free (self->entries[i]);
+  self->n_entries = 0;
+  for (int i = 0; i < self->n_pending; i++)
+    free (self->pending[i].dir);
+  self->n_pending = 0;
+  qcd_daemon_rehash (self);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_daemon_load_fn
+
+  ==========================================================================*/
+static BOOL qcd_daemon_load_fn (const char *dir, double rank,
+      void *user_data)
+  {
+  QcdDaemon *self = user_data;
+  // The rows come in rank order, so they can just be appended
+  if (self->n_entries == self->entries_size)
+    {
+    self->entries_size = self->entries_size ? self->entries_size * 2 : 256;
+    self->entries = realloc (self->entries,
+      self->entries_size * sizeof (QcdDaemonEntry *));
+    }
+  self->entries[self->n_entries++] = qcd_daemon_entry_new (dir, rank);
+  return TRUE;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_load
+
+  Replace the in-memory list with the contents of the database
+
+  ==========================================================================*/
+static BOOL qcd_daemon_load (QcdDaemon *self, KString **error)
+  {
+  KLOG_IN
+  qcd_daemon_clear (self);
+  BOOL ret = qcd_db_foreach (self->db, qcd_daemon_load_fn, self, error)
+    && qcd_db_get_data_version (self->db, &self->data_version, error);
+  qcd_daemon_rehash (self);
+  klog_info (KLOG_CLASS, "Loaded %d directories", self->n_entries);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_flush
+
+  Write the queued changes to the database, in one transaction. If
+  that fails -- most likely because some other process has held the
+  database locked for longer than the busy timeout -- the changes stay
+  queued, and we try again later.
+
+  ==========================================================================*/
+static void qcd_daemon_flush (QcdDaemon *self)
+  {
+  KLOG_IN
+  if (self->n_pending > 0)
+    {
+    KString *error = NULL;
+    BOOL ret = qcd_db_begin (self->db, &error);
+    for (int i = 0; i < self->n_pending && ret; i++)
+      {
+      QcdDaemonUpdate *u = &self->pending[i];
+      if (u->op == QCD_DAEMON_ADD)
+        ret = qcd_db_add_dir_at (self->db, (UTF8 *)u->dir, u->when, &error);
+      else
+        ret = qcd_db_del_dir (self->db, (UTF8 *)u->dir, &error);
+      }
+    if (ret)
+      ret = qcd_db_commit (self->db, &error);
+    if (ret)
+      {
+      klog_debug (KLOG_CLASS, "Wrote %d changes", self->n_pending);
+      for (int i = 0; i < self->n_pending; i++)
+        free (self->pending[i].dir);
+      self->n_pending = 0;
+      }
+    else
+      {
+      qcd_db_rollback (self->db);
+      char *s = (char *)kstring_to_utf8 (error);
+      klog_warn (KLOG_CLASS, "Can't write database: %s", s);
+      free (s);
+      kstring_destroy (error);
+      self->flush_due = qcd_daemon_now() + QCD_DAEMON_FLUSH_MSEC;
+      }
+    }
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_daemon_queue
+
+  ==========================================================================*/
+static void qcd_daemon_queue (QcdDaemon *self, char op, const char *dir,
+      time_t when)
+  {
+  if (self->n_pending == self->pending_size)
+    {
+    self->pending_size = self->pending_size ? self->pending_size * 2 : 32;
+    self->pending = realloc (self->pending,
+      self->pending_size * sizeof (QcdDaemonUpdate));
+    }
+  if (self->n_pending == 0)
+    self->flush_due = qcd_daemon_now() + QCD_DAEMON_FLUSH_MSEC;
+  QcdDaemonUpdate *u = &self->pending[self->n_pending++];
+  u->op = op;
+  u->when = when;
+  u->dir = strdup (dir);
+  }
+
+/*============================================================================
+  
+  qcd_daemon_add
+
+  ==========================================================================*/
+static void qcd_daemon_add (QcdDaemon *self, const char *dir)
+  {
+  KLOG_IN
+  time_t now = time (NULL);
+  int slot = qcd_daemon_find_slot (self, dir);
+  if (slot >= 0)
+    {
+    QcdDaemonEntry *e = self->slots[slot];
+    qcd_daemon_remove_at (self, qcd_daemon_index_of (self, e));
+    e->rank = qcd_db_rank_after_visit (self->db, e->rank, now);
+    qcd_daemon_insert_sorted (self, e);
+    }
+  else
+    {
+    QcdDaemonEntry *e = qcd_daemon_entry_new (dir, now);
+    qcd_daemon_insert_sorted (self, e);
+    qcd_daemon_hash_insert (self, e);
+    }
+  qcd_daemon_queue (self, QCD_DAEMON_ADD, dir, now);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_daemon_del
+
+  ==========================================================================*/
+static void qcd_daemon_del (QcdDaemon *self, const char *dir)
+  {
+  KLOG_IN
+  int slot = qcd_daemon_find_slot (self, dir);
+  if (slot >= 0)
+    {
+    QcdDaemonEntry *e = self->slots[slot];
+    qcd_daemon_remove_at (self, qcd_daemon_index_of (self, e));
+    self->slots[slot] = QCD_DAEMON_DELETED;
+    free (e);
+    }
+  qcd_daemon_queue (self, QCD_DAEMON_DEL, dir, 0);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_daemon_match
+
+  Send every entry that matches the term, in rank order. Entries that
+  don't contain the longest wildcard-free run of the term are ruled out
+  with strstr(), which is much quicker than the full match. The output
+  is buffered, and we stop if the client goes away, which it will do as
+  soon as it has seen enough.
+
+  ==========================================================================*/
+static void qcd_daemon_match (QcdDaemon *self, int fd, const char *term)
+  {
+  KLOG_IN
+  int l = strlen (term);
+  char *pattern = malloc (l + 3);
+  pattern[0] = '%';
+  memcpy (pattern + 1, term, l);
+  strcpy (pattern + l + 1, "%");
+  qcd_pattern_fold (pattern);
+
+  char *literal = malloc (l + 1);
+  literal[0] = 0;
+  for (const char *p = pattern; *p; )
+    {
+    int run = strcspn (p, "%_");
+    if (run > strlen (literal))
+      {
+      memcpy (literal, p, run);
+      literal[run] = 0;
+      }
+    p += run;
+    if (*p) p++;
+    }
+
+  char buf[8192];
+  int used = 0;
+  BOOL ok = TRUE;
+  for (int i = 0; i < self->n_entries && ok; i++)
+    {
+    const QcdDaemonEntry *e = self->entries[i];
+    if (strstr (e->folded, literal) && qcd_pattern_like (pattern, e->folded))
+      {
+      int dl = strlen (e->dir) + 1;
+      if (used + dl >= sizeof (buf))
+        {
+        ok = qcd_daemon_write_all (fd, buf, used);
+        used = 0;
+        }
+      if (dl >= sizeof (buf))
+        ok = ok && qcd_daemon_write_all (fd, e->dir, dl);
+      else
+        {
+        memcpy (buf + used, e->dir, dl);
+        used += dl;
+        }
+      }
+    }
+  buf[used++] = 0; // The terminating empty string
+  if (ok) qcd_daemon_write_all (fd, buf, used);
+
+  free (literal);
+  free (pattern);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_daemon_sync
+
+  Reload the list if some other process has changed the database
+  behind our back. Our own changes are written first, so they aren't
+  lost.
+
+  ==========================================================================*/
+static void qcd_daemon_sync (QcdDaemon *self)
+  {
+  KLOG_IN
+  int version;
+  if (qcd_db_get_data_version (self->db, &version, NULL)
+       && version != self->data_version)
+    {
+    klog_info (KLOG_CLASS, "Database changed by another process");
+    qcd_daemon_flush (self);
+    qcd_daemon_load (self, NULL);
+    }
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_daemon_read_request
+
+  Read the request into buf, which must be QCD_DAEMON_MAX_REQUEST
+  bytes long.
+
+  ==========================================================================*/
+static BOOL qcd_daemon_read_request (int fd, char *buf)
+  {
+  int l = 0;
+  while (l < QCD_DAEMON_MAX_REQUEST)
+    {
+    ssize_t n = read (fd, buf + l, QCD_DAEMON_MAX_REQUEST - l);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return FALSE;
+    l += n;
+    if (l >= 2 && buf[l - 1] == 0) return TRUE;
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_handle
+
+  Handle one connection. Returns TRUE if the daemon should stop.
+
+  ==========================================================================*/
+static BOOL qcd_daemon_handle (QcdDaemon *self, int fd)
+  {
+  KLOG_IN
+  BOOL stop = FALSE;
+  char buf[QCD_DAEMON_MAX_REQUEST];
+  if (qcd_daemon_check_peer (fd) && qcd_daemon_read_request (fd, buf))
+    {
+    char op = buf[0];
+    const char *arg = buf + 1;
+    klog_debug (KLOG_CLASS, "Request %c %s", op, arg);
+    qcd_daemon_sync (self);
+    KString *error = NULL;
+    switch (op)
+      {
+      case QCD_DAEMON_MATCH:
+        qcd_daemon_match (self, fd, arg);
+        break;
+      case QCD_DAEMON_ADD:
+        qcd_daemon_add (self, arg);
+        break;
+      case QCD_DAEMON_DEL:
+        qcd_daemon_del (self, arg);
+        break;
+      case QCD_DAEMON_PURGE:
+        qcd_daemon_clear (self);
+        if (qcd_db_purge (self->db, &error))
+          qcd_daemon_load (self, &error);
+        break;
+      case QCD_DAEMON_STOP:
+        stop = TRUE;
+        break;
+      default:
+        error = kstring_new_from_utf8 ((UTF8 *)"Unknown request");
+      }
+    if (op != QCD_DAEMON_MATCH)
+      {
+      if (error)
+        {
+        char *s = (char *)kstring_to_utf8 (error);
+        qcd_daemon_write_all (fd, "E", 1);
+        qcd_daemon_write_all (fd, s, strlen (s) + 1);
+        free (s);
+        kstring_destroy (error);
+        }
+      else
+        qcd_daemon_write_all (fd, "K", 1);
+      }
+    }
+  KLOG_OUT
+  return stop;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_on_signal
+
+  ==========================================================================*/
+static void qcd_daemon_on_signal (int sig)
+  {
+  qcd_daemon_signalled = 1;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_run
+
+  The main loop. Requests are handled one at a time -- each takes
+  microseconds, so there's nothing to gain from doing more than one at
+  once. Queued changes are written when they fall due, and before
+  exiting.
+
+  ==========================================================================*/
+static void qcd_daemon_run (QcdDb *qcd_db, int listen_fd)
+  {
+  KLOG_IN
+  QcdDaemon *self = calloc (1, sizeof (QcdDaemon));
+  self->db = qcd_db;
+  self->listen_fd = listen_fd;
+
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = qcd_daemon_on_signal;
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGHUP, &sa, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  KString *error = NULL;
+  BOOL stop = !qcd_daemon_load (self, &error);
+  if (stop)
+    {
+    char *s = (char *)kstring_to_utf8 (error);
+    klog_error (KLOG_CLASS, "Can't load database: %s", s);
+    free (s);
+    kstring_destroy (error);
+    }
+
+  while (!stop && !qcd_daemon_signalled)
+    {
+    int timeout = -1;
+    if (self->n_pending > 0)
+      {
+      long wait = self->flush_due - qcd_daemon_now();
+      timeout = wait > 0 ? (int)wait : 0;
+      }
+    struct pollfd pfd = { listen_fd, POLLIN, 0 };
+    int n = poll (&pfd, 1, timeout);
+    if (n > 0)
+      {
+      int fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0)
+        {
+        qcd_daemon_set_timeouts (fd);
+        stop = qcd_daemon_handle (self, fd);
+        close (fd);
+        }
+      }
+    if (self->n_pending >= QCD_DAEMON_MAX_PENDING
+         || (self->n_pending > 0 && qcd_daemon_now() >= self->flush_due))
+      qcd_daemon_flush (self);
+    }
+
+  qcd_daemon_flush (self);
+  qcd_daemon_clear (self);
+  free (self->entries);
+  free (self->slots);
+  free (self->pending);
+  free (self);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_daemon_listen
+
+  Create the listening socket. A socket file that nobody is listening
+  on is left over from a daemon that crashed, and can be replaced.
+
+  ==========================================================================*/
+static int qcd_daemon_listen (const struct sockaddr_un *addr,
+      KString **error)
+  {
+  KLOG_IN
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0)
+    {
+    if (connect (fd, (struct sockaddr *)addr, sizeof (*addr)) == 0)
+      {
+      if (error) *error = kstring_new_from_utf8
+        ((UTF8 *)"The daemon is already running");
+      close (fd);
+      KLOG_OUT
+      return -1;
+      }
+    unlink (addr->sun_path);
+    mode_t old_mask = umask (077);
+    if (bind (fd, (struct sockaddr *)addr, sizeof (*addr)) != 0
+         || listen (fd, 64) != 0)
+      {
+      close (fd);
+      fd = -1;
+      }
+    umask (old_mask);
+    }
+  if (fd < 0 && error)
+    *error = kstring_new_from_utf8 ((UTF8 *)strerror (errno));
+  KLOG_OUT
+  return fd;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_start
+
+  The database is opened once before forking, so that any problem
+  with it is reported to the user, rather than lost.
+
+  ==========================================================================*/
+BOOL qcd_daemon_start (QcdDb *qcd_db, BOOL *is_daemon, KString **error)
+  {
+  KLOG_IN
+  assert (qcd_db != NULL);
+  *is_daemon = FALSE;
+  qcd_db_set_use_daemon (qcd_db, FALSE);
+  // The daemon runs indefinitely, and the arena is never freed
+  karena_stop ();
+  qcd_db_release_heap ();
+
+  struct sockaddr_un addr;
+  if (!qcd_daemon_socket_path (qcd_db_get_file (qcd_db), &addr))
+    {
+    if (error) *error = kstring_new_from_utf8
+      ((UTF8 *)"Socket path is too long");
+    KLOG_OUT
+    return FALSE;
+    }
+  if (!qcd_db_open (qcd_db, error))
+    {
+    KLOG_OUT
+    return FALSE;
+    }
+  qcd_db_close (qcd_db);
+
+  BOOL ret = FALSE;
+  int fd = qcd_daemon_listen (&addr, error);
+  if (fd >= 0)
+    {
+    pid_t pid = fork();
+    if (pid == 0)
+      {
+      setsid();
+      // A fork of an interactive shell inherits its signal dispositions,
+      //   which ignore SIGTERM, among others
+      sigset_t none;
+      sigemptyset (&none);
+      sigprocmask (SIG_SETMASK, &none, NULL);
+      signal (SIGTERM, SIG_DFL);
+      signal (SIGINT, SIG_DFL);
+      signal (SIGQUIT, SIG_DFL);
+      signal (SIGCHLD, SIG_DFL);
+      if (chdir ("/") != 0) {}
+      int null = open ("/dev/null", O_RDWR);
+      dup2 (null, 0);
+      dup2 (null, 1);
+      dup2 (null, 2);
+      if (null > 2) close (null);
+      *is_daemon = TRUE;
+      qcd_daemon_run (qcd_db, fd);
+      close (fd);
+      unlink (addr.sun_path);
+      ret = TRUE;
+      }
+    else
+      {
+      close (fd);
+      if (pid > 0)
+        ret = TRUE;
+      else
+        {
+        if (error) *error = kstring_new_from_utf8 ((UTF8 *)strerror (errno));
+        unlink (addr.sun_path);
+        }
+      }
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_daemon_stop
+
+  Ask the daemon to write out its changes and exit
+
+  ==========================================================================*/
+BOOL qcd_daemon_stop (const QcdDb *qcd_db, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  int fd = qcd_daemon_connect (qcd_db_get_file (qcd_db));
+  if (fd >= 0)
+    {
+    ret = qcd_daemon_send_request (fd, QCD_DAEMON_STOP, "")
+      && qcd_daemon_read_status (fd, error);
+    close (fd);
+    }
+  else if (error)
+    *error = kstring_new_from_utf8 ((UTF8 *)"The daemon is not running");
+  KLOG_OUT
+  return ret;
+  }
+
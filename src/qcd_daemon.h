@@ -0,0 +1,38 @@
+/*============================================================================
+  
+  qcd  
+  
+  qcd_daemon.h
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+
+#pragma once
+
+#include <klib/klib.h>
+#include "qcd_db.h"
+
+/** Requests to the daemon. Each request is one of these bytes, followed
+    by a NUL-terminated argument (a search term or a directory). */
+#define QCD_DAEMON_MATCH 'M'
+#define QCD_DAEMON_ADD   'A'
+#define QCD_DAEMON_DEL   'D'
+#define QCD_DAEMON_PURGE 'P'
+#define QCD_DAEMON_STOP  'S'
+
+/** Connect to the daemon serving the given database file. Returns -1
+    if there isn't one. */
+extern int       qcd_daemon_connect (const char *db_file);
+extern BOOL      qcd_daemon_send_request (int fd, char op, const char *arg);
+/** Read the reply to an add, delete, purge, or stop request */
+extern BOOL      qcd_daemon_read_status (int fd, KString **error);
+
+/** Start a daemon for qcd_db in the background. This returns in both the
+    parent and, when it has stopped, the daemon, which is told apart by
+    is_daemon. */
+extern BOOL      qcd_daemon_start (QcdDb *qcd_db, BOOL *is_daemon, 
+                   KString **error);
+extern BOOL      qcd_daemon_stop (const QcdDb *qcd_db, KString **error);
+
@@ -8,6 +8,7 @@
   GNU Public Licence, v3.0
 
   ==========================================================================*/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> 
@@ -15,17 +16,158 @@
 #include <getopt.h> 
 #include <unistd.h> 
 #include <assert.h> 
+#include <math.h> 
+#include <time.h> 
+#include <sys/stat.h> 
 #include <klib/klib.h> 
 #include "qcd_db.h" 
+#include "qcd_daemon.h" 
+#include "qcd_journal.h" 
+#include "qcd_hotset.h" 
 #include "sqlite3.h" 
 
 #define KLOG_CLASS "qcd.db"
 
 void qcd_db_close (QcdDb *self); // FWD
 static BOOL qcd_db_exec (QcdDb *self, UTF8 *sql, KString **error); // FWD
-static char *qcd_db_escape_sql (const char *sql);
-KList *qcd_db_query (QcdDb *self, const char *sql, BOOL include_empty,
-        int limit, KString **error); //FWD
+static BOOL qcd_db_prepare (QcdDb *self, sqlite3_stmt **stmt, 
+      const char *sql, KString **error); // FWD
+static void qcd_db_fold_before_read (QcdDb *self); // FWD
+
+/*============================================================================
+  
+  SQL for the prepared statements. These are compiled once, when the 
+  database is opened, and reused for every operation on it
+
+  ==========================================================================*/
+#define QCD_SQL_BEGIN "begin immediate"
+#define QCD_SQL_COMMIT "commit"
+#define QCD_SQL_ROLLBACK "rollback"
+// Recording a visit is a single atomic UPSERT, so two shells recording
+//   the same directory at the same time can't lose an update
+#define QCD_SQL_ADD "insert into dirs (dir, count, last_visit, rank) " \
+  "values (?1, 1, ?2, ?2) on conflict (dir) do update set " \
+  "count=count+1, last_visit=?2, rank=qcd_rank_add(rank, ?2, ?3)"
+#define QCD_SQL_DELETE "delete from dirs where dir=?1"
+#define QCD_SQL_GET_ID "select id from dirs where dir=?1"
+#define QCD_SQL_MATCH \
+  "select dir from dirs where dir like ?1 order by rank desc"
+#define QCD_SQL_ALL "select dir, rank from dirs order by rank desc"
+
+/*============================================================================
+  
+  Ranking. Each directory has a 'rank', which is the time of its last 
+  visit, in seconds, plus a bonus for earlier visits that decays 
+  with a half-life of half_life seconds. Two visits at the same time
+  are worth one visit half_life later, four are worth one visit 
+  2 * half_life later, and so on. Formally, 
+
+  rank = (h / ln 2) * ln (sum over visits of 2^(t / h))
+
+  Because every directory's score decays at the same rate, the order 
+  of the ranks never changes with the passage of time, so there's no 
+  need to rewrite the table to age the scores. Each new visit just 
+  updates one row, using qcd_rank_add(), and ranking is a walk down
+  the index on rank. 
+
+  ==========================================================================*/
+#define QCD_DB_DEFAULT_HALF_LIFE 14 // days
+#define QCD_SQL_CREATE_RANK_INDEX "create index dirrank on dirs(rank)"
+
+/*============================================================================
+  
+  Trigram index. A leading wildcard in a 'like' term means that SQLite has
+  to scan the whole dirs table, so the dirgrams table maps every 
+  three-byte substring of every stored directory, folded to lower case, 
+  to the ids of the directories that contain it. A match then only 
+  looks at the rows that contain all of the trigrams in the search 
+  term -- the 'like' 
+  comparison is still applied to these candidates, to check the order 
+  of the trigrams, and to handle wildcards. Terms with no three-byte 
+  run free of wildcards fall back to QCD_SQL_MATCH.
+
+  Statements that match on N trigrams are prepared when they are 
+  first needed, and cached. Only the first QCD_DB_MAX_GRAMS distinct 
+  trigrams of a term are used to select candidates.
+
+  ==========================================================================*/
+#define QCD_DB_MAX_GRAMS 8
+#define QCD_SQL_CREATE_GRAMS "create table dirgrams (gram varchar not null, " \
+  "dir_id integer not null, primary key (gram, dir_id)) without rowid"
+#define QCD_SQL_ADD_GRAM \
+  "insert or ignore into dirgrams (gram, dir_id) values (?2, ?1)"
+#define QCD_SQL_DELETE_GRAM "delete from dirgrams where gram=?2 and dir_id=?1"
+#define QCD_SQL_MATCH_GRAMS_HEAD "select dir from dirs where id in (" 
+#define QCD_SQL_MATCH_GRAMS_GRAM "select dir_id from dirgrams where gram=?%d" 
+#define QCD_SQL_MATCH_GRAMS_TAIL ") and dir like ?1 order by rank desc" 
+
+/*============================================================================
+  
+  Defaults for the settings that can be changed in the rc file. In 
+  WAL mode readers never block writers, or vice versa. Concurrent
+  writers wait for each other for up to busy_timeout milliseconds,
+  rather than failing immediately with SQLITE_BUSY.
+
+  ==========================================================================*/
+#define QCD_DB_DEFAULT_JOURNAL_MODE "wal"
+#define QCD_DB_DEFAULT_BUSY_TIMEOUT 2000 // msec
+#define QCD_DB_DEFAULT_AUTOCHECKPOINT 1000 // pages, as SQLite default 
+#define QCD_DB_DEFAULT_CHECKPOINT SQLITE_CHECKPOINT_PASSIVE
+#define QCD_DB_DEFAULT_VISIT_JOURNAL TRUE
+#define QCD_DB_DEFAULT_VISIT_JOURNAL_MAX 65536 // bytes
+
+/*============================================================================
+  
+  The visit journal (see qcd_journal.c) is a file beside the database. 
+  To fold it into the database, it is first renamed, so that new visits
+  start a new journal, and the renamed file is only removed once its 
+  contents have been committed. A renamed file that is still there 
+  when the next fold starts was left by a fold that failed, and is 
+  folded first.
+
+  ==========================================================================*/
+#define QCD_DB_JOURNAL_SUFFIX "-visits"
+#define QCD_DB_FOLD_SUFFIX "-visits.fold"
+
+/*============================================================================
+  
+  The hot set (see qcd_hotset.c) is a snapshot of the hot_set_size 
+  highest-ranked directories, which is rewritten just before every 
+  commit, while we still hold the write lock. The gramsketch table 
+  holds the sketch of the trigrams of all directories that goes into 
+  the snapshot: a single blob of QCD_HOTSET_BUCKETS 16-bit counts, 
+  which is updated in place when a directory is inserted or deleted.
+  A count that reaches QCD_DB_SKETCH_MAX stays there, because we can
+  no longer tell when it should go down.
+
+  ==========================================================================*/
+#define QCD_DB_HOT_SUFFIX "-hot"
+#define QCD_DB_DEFAULT_HOT_SET_SIZE 100
+#define QCD_DB_SKETCH_MAX 0xFFFF
+#define QCD_SQL_CREATE_SKETCH "create table gramsketch " \
+  "(id integer primary key, counts blob not null)"
+#define QCD_SQL_SET_SKETCH "insert into gramsketch (id, counts) values (1, ?1)"
+#define QCD_SQL_GET_SKETCH "select counts from gramsketch where id=1"
+#define QCD_SQL_HOT "select dir, rank from dirs order by rank desc limit ?1"
+
+/*============================================================================
+  
+  When klib objects come from the arena (see karena.h), which is only
+  so in a process that will exit in a moment, SQLite gets its memory 
+  in the same way: QCD_DB_HEAP_SIZE bytes, in one piece, which it 
+  manages itself, so that it makes no other calls to malloc(). The 
+  heap is not taken from the arena itself, because SQLite may still be
+  using it when the arena is released. This 
+  needs an SQLite built with SQLITE_ENABLE_MEMSYS5; with any other, the
+  system allocator is used as usual. SQLite rounds each request up to
+  a power of two, so the heap is set to several times the default 
+  page cache. Pages that are never touched cost nothing.
+
+  ==========================================================================*/
+#define QCD_DB_HEAP_SIZE (16 * 1024 * 1024)
+#define QCD_DB_HEAP_MIN_ALLOC 64
+
+static void *qcd_db_heap = NULL;
 
 /*============================================================================
   
@@ -36,6 +178,51 @@ struct _QcdDb
   {
   sqlite3 *sqlite;
   char *file;
+  sqlite3_stmt *stmt_begin;
+  sqlite3_stmt *stmt_commit;
+  sqlite3_stmt *stmt_rollback;
+  sqlite3_stmt *stmt_add;
+  sqlite3_stmt *stmt_delete;
+  sqlite3_stmt *stmt_get_id;
+  sqlite3_stmt *stmt_match;
+  sqlite3_stmt *stmt_add_gram;
+  sqlite3_stmt *stmt_delete_gram;
+  sqlite3_stmt *stmt_match_grams[QCD_DB_MAX_GRAMS]; // Indexed by N-1
+  char *journal_mode;
+  double half_life; // seconds
+  int busy_timeout;
+  int wal_autocheckpoint;
+  int checkpoint_mode; // SQLITE_CHECKPOINT_XXX, or -1 for none
+  BOOL written; // Set when this session has committed a change
+  BOOL in_transaction; // Set between qcd_db_begin() and commit/rollback
+  BOOL use_daemon; // Cleared once we know there's no daemon to talk to
+  KList *deferred; // Visits waiting for qcd_db_write_deferred(), or NULL
+  BOOL visit_journal; // Whether to record visits in the journal
+  off_t visit_journal_max; // Fold the journal when it gets this big
+  char *journal_file;
+  char *fold_file;
+  int hot_set_size; // Directories in the hot set; zero for no hot set
+  char *hot_file;
+  };
+
+/*============================================================================
+  
+  QcdDbCursor 
+
+  ==========================================================================*/
+struct _QcdDbCursor
+  {
+  QcdDb *db;
+  sqlite3_stmt *stmt; // One of the db's cached statements
+  char *pattern; // Bound to stmt, so must outlive it
+  int limit;
+  int count; // Rows returned so far
+  FILE *in; // Results from the daemon, when stmt is NULL
+  char *line; // The last row read from 'in'
+  size_t line_size;
+  BOOL at_end; // Set when the daemon has sent its last row
+  BOOL from_hot_set; // Set when the hot set gave the answer
+  char *hot; // The hot set's match, if it found one
   };
 
 /*============================================================================
@@ -49,6 +236,31 @@ QcdDb *qcd_db_new (const KPath *file)
   QcdDb *self = malloc (sizeof (QcdDb));
   self->file = (char *) kstring_to_utf8 ((KString *)file); 
   self->sqlite = NULL;
+  self->stmt_begin = NULL;
+  self->stmt_commit = NULL;
+  self->stmt_rollback = NULL;
+  self->stmt_add = NULL;
+  self->stmt_delete = NULL;
+  self->stmt_match = NULL;
+  self->stmt_add_gram = NULL;
+  self->stmt_delete_gram = NULL;
+  for (int i = 0; i < QCD_DB_MAX_GRAMS; i++)
+    self->stmt_match_grams[i] = NULL;
+  self->journal_mode = strdup (QCD_DB_DEFAULT_JOURNAL_MODE);
+  self->busy_timeout = QCD_DB_DEFAULT_BUSY_TIMEOUT;
+  self->half_life = QCD_DB_DEFAULT_HALF_LIFE * 86400.0;
+  self->wal_autocheckpoint = QCD_DB_DEFAULT_AUTOCHECKPOINT;
+  self->checkpoint_mode = QCD_DB_DEFAULT_CHECKPOINT;
+  self->written = FALSE;
+  self->in_transaction = FALSE;
+  self->use_daemon = TRUE;
+  self->deferred = NULL;
+  self->visit_journal = QCD_DB_DEFAULT_VISIT_JOURNAL;
+  self->visit_journal_max = QCD_DB_DEFAULT_VISIT_JOURNAL_MAX;
+  asprintf (&self->journal_file, "%s" QCD_DB_JOURNAL_SUFFIX, self->file);
+  asprintf (&self->fold_file, "%s" QCD_DB_FOLD_SUFFIX, self->file);
+  self->hot_set_size = QCD_DB_DEFAULT_HOT_SET_SIZE;
+  asprintf (&self->hot_file, "%s" QCD_DB_HOT_SUFFIX, self->file);
   KLOG_OUT
   return self;
   }
@@ -65,6 +277,11 @@ void qcd_db_destroy (QcdDb *self)
     {
     qcd_db_close (self);
     if (self->file) free (self->file);
+    if (self->journal_mode) free (self->journal_mode);
+    if (self->deferred) klist_destroy (self->deferred);
+    free (self->journal_file);
+    free (self->fold_file);
+    free (self->hot_file);
     free (self);
     }
   KLOG_OUT
@@ -72,349 +289,1784 @@ void qcd_db_destroy (QcdDb *self)
 
 /*============================================================================
   
-  qcd_db_get_count
+  qcd_db_configure
+
+  Apply settings from the rc file. This must be called before the 
+  database is opened, to have any effect. Unknown or invalid values 
+  are logged, and the defaults kept.
 
   ==========================================================================*/
-BOOL qcd_db_get_count (QcdDb *self, const UTF8 *dir, int *count, 
-      KString **error)
+void qcd_db_configure (QcdDb *self, const KProps *props)
   {
   KLOG_IN
   assert (self != NULL);
-  assert (dir != NULL);
-  assert (self->sqlite != NULL);
-
-  *count = 0;  
-  char *escaped_dir = qcd_db_escape_sql ((char *)dir); 
+  assert (props != NULL);
 
-  KString *sql = kstring_new_empty();
-  kstring_append_printf (sql, 
-      "select count from dirs where dir='%s'", escaped_dir);
-  UTF8 *_sql = kstring_to_utf8 (sql);
-
-  BOOL ret = FALSE;
-  KList *results = qcd_db_query (self, (char*)_sql, FALSE,
-        1, error); 
-  
-  if (results)
+  const KString *v = kprops_get_utf8 (props, (UTF8 *)"journal_mode");
+  if (v)
     {
-    if (klist_length (results) == 1)
+    char *mode = (char *)kstring_to_utf8 (v);
+    if (strcasecmp (mode, "wal") == 0 || strcasecmp (mode, "delete") == 0
+         || strcasecmp (mode, "truncate") == 0 
+         || strcasecmp (mode, "persist") == 0)
       {
-      const char *s = klist_get (results, 0);
-      *count = atoi (s);
+      free (self->journal_mode);
+      self->journal_mode = mode;
+      }
+    else
+      {
+      klog_warn (KLOG_CLASS, "Ignoring unknown journal_mode '%s'", mode);
+      free (mode);
       }
-    klist_destroy (results);
-    ret = TRUE;
     }
 
-  free (_sql);
-  kstring_destroy (sql);
+  self->busy_timeout = kprops_get_integer_utf8 (props, 
+     (UTF8 *)"busy_timeout", self->busy_timeout);
+  if (self->busy_timeout < 0) self->busy_timeout = 0;
+
+  int half_life = kprops_get_integer_utf8 (props, 
+     (UTF8 *)"half_life_days", QCD_DB_DEFAULT_HALF_LIFE);
+  if (half_life > 0) 
+    self->half_life = half_life * 86400.0;
+  else
+    klog_warn (KLOG_CLASS, "Ignoring half_life_days %d", half_life);
+
+  self->wal_autocheckpoint = kprops_get_integer_utf8 (props, 
+     (UTF8 *)"wal_autocheckpoint", self->wal_autocheckpoint);
+
+  self->visit_journal = kprops_get_boolean_utf8 (props, 
+     (UTF8 *)"visit_journal", self->visit_journal);
+  int journal_max = kprops_get_integer_utf8 (props, 
+     (UTF8 *)"visit_journal_max", self->visit_journal_max);
+  if (journal_max >= 0) 
+    self->visit_journal_max = journal_max;
+
+  int hot_set_size = kprops_get_integer_utf8 (props, 
+     (UTF8 *)"hot_set_size", self->hot_set_size);
+  if (hot_set_size >= 0) 
+    self->hot_set_size = hot_set_size;
+
+  v = kprops_get_utf8 (props, (UTF8 *)"checkpoint");
+  if (v)
+    {
+    char *mode = (char *)kstring_to_utf8 (v);
+    if (strcasecmp (mode, "passive") == 0) 
+      self->checkpoint_mode = SQLITE_CHECKPOINT_PASSIVE;
+    else if (strcasecmp (mode, "truncate") == 0) 
+      self->checkpoint_mode = SQLITE_CHECKPOINT_TRUNCATE;
+    else if (strcasecmp (mode, "none") == 0) 
+      self->checkpoint_mode = -1;
+    else
+      klog_warn (KLOG_CLASS, "Ignoring unknown checkpoint mode '%s'", mode);
+    free (mode);
+    }
 
-  free (escaped_dir);
   KLOG_OUT
-  return ret;
   }
 
 /*============================================================================
   
-  qcd_db_del_dir
+  qcd_db_set_use_daemon
 
   ==========================================================================*/
-BOOL qcd_db_del_dir (QcdDb *self, const UTF8 *dir, KString **error)
+void qcd_db_set_use_daemon (QcdDb *self, BOOL use_daemon)
   {
-  KLOG_IN
   assert (self != NULL);
-  assert (dir != NULL);
-  assert (self->sqlite != NULL);
-  BOOL ret = TRUE;
-  char *escaped_dir = qcd_db_escape_sql ((char *)dir); 
+  self->use_daemon = use_daemon;
+  }
+
+/*============================================================================
+  
+  qcd_db_get_file
+
+  ==========================================================================*/
+const char *qcd_db_get_file (const QcdDb *self)
+  {
+  assert (self != NULL);
+  return self->file;
+  }
+
+/*============================================================================
+  
+  qcd_db_set_error
+
+  Set the error argument, if it was supplied, from the last SQLite error
+
+  ==========================================================================*/
+static void qcd_db_set_error (const QcdDb *self, KString **error)
+  {
+  if (error) 
+    (*error) = kstring_new_from_utf8 ((UTF8 *)sqlite3_errmsg (self->sqlite));
+  }
+
+/*============================================================================
+  
+  qcd_db_done
+
+  Reset a prepared statement after use, so it can be reused, and so
+  that it does not hold a read lock on the database
+
+  ==========================================================================*/
+static void qcd_db_done (sqlite3_stmt *stmt)
+  {
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+  }
+
+/*============================================================================
+  
+  qcd_db_step_once
 
-  KString *sql = kstring_new_empty();
-  kstring_append_printf (sql, 
-      "delete from dirs where dir='%s'", escaped_dir);
-  UTF8 *_sql = kstring_to_utf8 (sql);
-  ret = qcd_db_exec (self, _sql, error);
-  free (_sql);
-  kstring_destroy (sql);
+  Run a prepared statement that returns no rows, with the directory,
+  if there is one, bound to the first parameter
 
-  free (escaped_dir);
+  ==========================================================================*/
+static BOOL qcd_db_step_once (QcdDb *self, sqlite3_stmt *stmt, 
+      const UTF8 *dir, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  if (dir) sqlite3_bind_text (stmt, 1, (char *)dir, -1, SQLITE_STATIC);
+  if (sqlite3_step (stmt) == SQLITE_DONE)
+    ret = TRUE;
+  else
+    qcd_db_set_error (self, error);
+  qcd_db_done (stmt);
   KLOG_OUT
   return ret;
   }
 
 /*============================================================================
   
-  qcd_db_add_dir
+  qcd_db_get_id
+
+  Look up the id of a directory. id is set to zero if the directory is
+  not in the database.
 
   ==========================================================================*/
-BOOL qcd_db_add_dir (QcdDb *self, const UTF8 *dir, KString **error)
+static BOOL qcd_db_get_id (QcdDb *self, const UTF8 *dir, 
+      sqlite3_int64 *id, KString **error)
   {
   KLOG_IN
-  assert (self != NULL);
-  assert (dir != NULL);
-  assert (self->sqlite != NULL);
   BOOL ret = TRUE;
-  char *escaped_dir = qcd_db_escape_sql ((char *)dir); 
-
-  int count = 0;
-  if (qcd_db_get_count (self, dir, &count, error))
-    {
-    if (count < 1)
-      { 
-      KString *sql = kstring_new_empty();
-      kstring_append_printf (sql, 
-      "insert into dirs (dir, count) values ('%s',1)", escaped_dir);
-      UTF8 *_sql = kstring_to_utf8 (sql);
-      ret = qcd_db_exec (self, _sql, error);
-      free (_sql);
-      kstring_destroy (sql);
-      }
-    else
-      {
-      // Increment dir count
-      KString *sql = kstring_new_empty();
-      kstring_append_printf (sql, 
-      "update dirs set count=%d where dir='%s'", count+1, escaped_dir);
-      UTF8 *_sql = kstring_to_utf8 (sql);
-      ret = qcd_db_exec (self, _sql, error);
-      free (_sql);
-      kstring_destroy (sql);
-      }
-    }
-  else
+  *id = 0;
+  sqlite3_bind_text (self->stmt_get_id, 1, (char *)dir, -1, SQLITE_STATIC);
+  int err = sqlite3_step (self->stmt_get_id);
+  if (err == SQLITE_ROW)
+    *id = sqlite3_column_int64 (self->stmt_get_id, 0);
+  else if (err != SQLITE_DONE)
     {
+    qcd_db_set_error (self, error);
     ret = FALSE;
     }
-
-  free (escaped_dir);
+  qcd_db_done (self->stmt_get_id);
   KLOG_OUT
   return ret;
   }
 
 /*============================================================================
   
-  qcd_db_close
+  qcd_db_fold_gram
+
+  Copy three bytes from s to gram, folding ASCII characters to lower
+  case, the same way that 'like' does
 
   ==========================================================================*/
-void qcd_db_close (QcdDb *self)
+static void qcd_db_fold_gram (const char *s, char *gram)
   {
-  KLOG_IN
-  assert (self != NULL);
-  if (self->sqlite) sqlite3_close (self->sqlite);
-  self->sqlite = NULL;
-  KLOG_OUT
-  // TODO
+  for (int i = 0; i < 3; i++)
+    {
+    char c = s[i];
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    gram[i] = c;
+    }
+  gram[3] = 0;
   }
 
 /*============================================================================
   
-  qcd_db_create_tables
+  qcd_db_index_dir
+
+  Add all the trigrams of dir, whose id is id, to the dirgrams table, 
+  or remove them, using the stmt_add_gram or stmt_delete_gram 
+  statement. This should be called inside a transaction.
 
   ==========================================================================*/
-static BOOL qcd_db_exec (QcdDb *self, UTF8 *sql, KString **error)
+static BOOL qcd_db_index_dir (QcdDb *self, sqlite3_stmt *stmt, 
+      sqlite3_int64 id, const UTF8 *dir, KString **error)
   {
   KLOG_IN
-  BOOL ret = FALSE;
-  assert (self != NULL);
-  assert (sql != NULL);
-
-  char *e = NULL;
-  klog_debug (KLOG_CLASS, "%s: executing SQL %s", __PRETTY_FUNCTION__, sql);
-  sqlite3_exec (self->sqlite, (char *)sql, NULL, 0, &e);
-  if (e)
+  BOOL ret = TRUE;
+  int l = strlen ((char *)dir);
+  for (int i = 0; i + 3 <= l && ret; i++)
     {
-    if (error) (*error) = kstring_new_from_utf8 ((UTF8 *)e); 
-    sqlite3_free (e);
-    ret = FALSE;
+    char gram[4];
+    qcd_db_fold_gram ((char *)dir + i, gram);
+    sqlite3_bind_int64 (stmt, 1, id);
+    sqlite3_bind_text (stmt, 2, gram, 3, SQLITE_STATIC);
+    ret = qcd_db_step_once (self, stmt, NULL, error);
     }
-  else
-    ret = TRUE;
-
   KLOG_OUT
   return ret;
   }
 
-
 /*============================================================================
   
-  qcd_db_create_tables
+  qcd_db_sketch_dir
+
+  Add delta to the sketch count of each bucket that the trigrams of 
+  dir fall into. This should be called inside a transaction, when a
+  directory is inserted or deleted.
 
   ==========================================================================*/
-static BOOL qcd_db_create_tables (QcdDb *self, KString **error)
+static BOOL qcd_db_sketch_dir (QcdDb *self, const UTF8 *dir, int delta,
+      KString **error)
   {
   KLOG_IN
-  BOOL ret = FALSE;
-  assert (self != NULL);
-  ret = qcd_db_exec (self, (UTF8 *)"create table dirs "
-       "(dir varchar not null primary key, count integer)",
-        error);
-
+  sqlite3_blob *blob = NULL;
+  BOOL ret = (sqlite3_blob_open (self->sqlite, "main", "gramsketch", 
+    "counts", 1, 1, &blob) == SQLITE_OK);
   if (ret)
-    ret = qcd_db_exec (self, (UTF8*)"create index dirindex on dirs(dir)",
-       error);
-
+    {
+    uint32_t *buckets = malloc (strlen ((char *)dir) * sizeof (uint32_t));
+    int n = qcd_hotset_dir_buckets ((char *)dir, buckets);
+    for (int i = 0; i < n && ret; i++)
+      {
+      unsigned char c[2];
+      ret = (sqlite3_blob_read (blob, c, 2, 2 * buckets[i]) == SQLITE_OK);
+      int count = c[0] | (c[1] << 8);
+      if (ret && count != QCD_DB_SKETCH_MAX && count + delta >= 0)
+        {
+        count += delta;
+        c[0] = count & 0xFF;
+        c[1] = count >> 8;
+        ret = (sqlite3_blob_write (blob, c, 2, 2 * buckets[i]) == SQLITE_OK);
+        }
+      }
+    free (buckets);
+    }
+  if (!ret) 
+    qcd_db_set_error (self, error);
+  sqlite3_blob_close (blob);
   KLOG_OUT
   return ret;
   }
 
 /*============================================================================
   
-  qcd_db_escape_sql
+  qcd_db_write_hot_set
+
+  Write the hot set snapshot, from the current state of the database,
+  or remove it if there shouldn't be one. This is called with the 
+  write lock held, so no other process can change the database 
+  until the snapshot is in place.
 
   ==========================================================================*/
-static char *qcd_db_escape_sql (const char *sql)
+static BOOL qcd_db_write_hot_set (QcdDb *self, KString **error)
   {
   KLOG_IN
-  char *ret;
-  if (strchr (sql, '\''))
+  if (self->hot_set_size == 0)
     {
-    int l = strlen (sql);
-    int newlen = l;
-    ret = malloc (newlen + 1);
-    int p = 0;
+    unlink (self->hot_file);
+    KLOG_OUT
+    return TRUE;
+    }
 
-    for (int i = 0; i < l; i++)
+  BOOL ret = FALSE;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_stmt *stmt_sketch = NULL;
+  if (qcd_db_prepare (self, &stmt, QCD_SQL_HOT, error)
+       && qcd_db_prepare (self, &stmt_sketch, QCD_SQL_GET_SKETCH, error))
+    {
+    // Ask for one more than we want, to find out if there are others
+    int max = self->hot_set_size;
+    sqlite3_bind_int (stmt, 1, max + 1);
+    char **dirs = malloc ((max + 1) * sizeof (char *));
+    double *ranks = malloc ((max + 1) * sizeof (double));
+    int n = 0;
+    int err;
+    while ((err = sqlite3_step (stmt)) == SQLITE_ROW)
       {
-      char c = sql[i];
-      if (c == '\'')
-        {
-        newlen+=2;
-        ret = realloc (ret, newlen + 1);
-        ret[p++] = '\'';
-        ret[p++] = '\'';
-        }
-      else
+      const char *dir = (const char *)sqlite3_column_text (stmt, 0);
+      if (dir && dir[0])
         {
-        ret[p++] = c;
+        dirs[n] = strdup (dir);
+        ranks[n] = sqlite3_column_double (stmt, 1);
+        n++;
         }
       }
-    ret[p] = 0;
-    }
-  else
-    {
-    ret = strdup (sql);
+    if (err == SQLITE_DONE && sqlite3_step (stmt_sketch) == SQLITE_ROW
+         && sqlite3_column_bytes (stmt_sketch, 0) == QCD_HOTSET_SKETCH_SIZE)
+      {
+      ret = qcd_hotset_write (self->hot_file, dirs, ranks, 
+        n > max ? max : n, n > max, 
+        sqlite3_column_blob (stmt_sketch, 0), error);
+      }
+    else
+      qcd_db_set_error (self, error);
+    for (int i = 0; i < n; i++)
+      free (dirs[i]);
+    free (dirs);
+    free (ranks);
     }
+  sqlite3_finalize (stmt);
+  sqlite3_finalize (stmt_sketch);
   KLOG_OUT
   return ret;
   }
 
 /*============================================================================
   
-  qcd_db_match_dir
+  qcd_db_daemon_request
+
+  Send a request to the qcd daemon, if one is running for this database.
+  Returns the connection, or -1 if the request should be handled 
+  directly. Once a connection has failed, or the database has been
+  opened directly, we don't try the daemon again.
 
   ==========================================================================*/
-KList *qcd_db_match_dir (QcdDb *self, const char *term, KString **error)
+static int qcd_db_daemon_request (QcdDb *self, char op, const char *arg)
   {
   KLOG_IN
-  assert (self != NULL);
-  assert (term != NULL);
+  int fd = -1;
+  if (self->use_daemon && !self->sqlite)
+    {
+    fd = qcd_daemon_connect (self->file);
+    if (fd >= 0 && !qcd_daemon_send_request (fd, op, arg))
+      {
+      close (fd);
+      fd = -1;
+      }
+    if (fd < 0) self->use_daemon = FALSE;
+    }
+  KLOG_OUT
+  return fd;
+  }
+
+/*============================================================================
+  
+  qcd_db_daemon_update
 
-  char *escaped_term = qcd_db_escape_sql ((char *)term); 
-  KString *sql = kstring_new_empty();
-  kstring_append_printf (sql, 
-      "select dir from dirs where dir like '%%%s%%' order by count desc", 
-      escaped_term);
+  Pass an add, delete, or purge to the daemon. Returns -1 if there is 
+  no daemon, so the caller should do the update itself; otherwise 
+  TRUE or FALSE according to what the daemon said. 
 
-  UTF8 *_sql = kstring_to_utf8 (sql);
-  KList *results = qcd_db_query (self, (char*)_sql, FALSE, 0, error); 
+  ==========================================================================*/
+static int qcd_db_daemon_update (QcdDb *self, char op, const char *arg, 
+      KString **error)
+  {
+  KLOG_IN
+  int ret = -1;
+  int fd = qcd_db_daemon_request (self, op, arg);
+  if (fd >= 0)
+    {
+    ret = qcd_daemon_read_status (fd, error);
+    close (fd);
+    }
+  KLOG_OUT
+  return ret;
+  }
 
-  free (_sql);
-  kstring_destroy (sql);
+/*============================================================================
+  
+  qcd_db_begin
 
-  free (escaped_term);
+  Start a write transaction. The add and delete operations normally 
+  commit one at a time, but between qcd_db_begin() and qcd_db_commit() 
+  they all go into the same transaction, which costs one journal 
+  commit in total. 
 
+  ==========================================================================*/
+BOOL qcd_db_begin (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  assert (!self->in_transaction);
+  BOOL ret = qcd_db_open (self, error) 
+    && qcd_db_step_once (self, self->stmt_begin, NULL, error);
+  if (ret) self->in_transaction = TRUE;
   KLOG_OUT
-  return results;
+  return ret;
   }
 
 /*============================================================================
   
-  qcd_db_open
+  qcd_db_commit
 
   ==========================================================================*/
-extern BOOL qcd_db_open (QcdDb *self, KString **error)
+BOOL qcd_db_commit (QcdDb *self, KString **error)
   {
   KLOG_IN
   assert (self != NULL);
-  klog_debug (KLOG_CLASS, "Opening database file %s", self->file);
-  BOOL ret = FALSE;
-  BOOL create_tables = FALSE;
- 
-  if (access (self->file, F_OK) != 0)
-    {
-    // DB files does not yet exist -- we will need to create tables.
-    create_tables = TRUE;
-    }
-
-  int err = sqlite3_open (self->file, &self->sqlite);
-  if (err == 0)
+  assert (self->in_transaction);
+  BOOL ret = qcd_db_write_hot_set (self, error)
+    && qcd_db_step_once (self, self->stmt_commit, NULL, error);
+  if (ret) 
     {
-    if (create_tables)
-      {
-      if (qcd_db_create_tables (self, error))
-        ret = TRUE;
-      }
-    else
-      ret = TRUE;
+    self->in_transaction = FALSE;
+    self->written = TRUE;
     }
   else
     {
-    // TODO -- better error message
-    if (error)
-      *error = kstring_new_from_utf8 ((UTF8 *)"Can't open database");
+    // A snapshot that doesn't match the database is worse than none
+    unlink (self->hot_file);
     }
-
   KLOG_OUT
   return ret;
   }
 
-/*==========================================================================
-
-  qcd_db_query 
-
-  Returns a List of char *, which may be empty. The list returns includes
-  all rows and columns in row order, all concetenated into one long list.
-  If the query selects a single column, then the list returned will be
-  the same length as the number of matches, or 'limit' if that is
-  smaller. If limit == 0, then no limit is applied
+/*============================================================================
+  
+  qcd_db_rollback
 
-==========================================================================*/
-KList *qcd_db_query (QcdDb *self, const char *sql, BOOL include_empty,
-        int limit, KString **error)
+  ==========================================================================*/
+void qcd_db_rollback (QcdDb *self)
   {
   KLOG_IN
-  KList *ret = NULL;
-  char *e = NULL;
-  char **result = NULL;
-  int hits;
-  int cols;
-  klog_debug (KLOG_CLASS, "%s: executing SQL %s", __PRETTY_FUNCTION__, sql);
-  sqlite3_get_table (self->sqlite, sql, &result, &hits, &cols, &e); 
-  if (e)
+  assert (self != NULL);
+  if (self->in_transaction)
     {
-    if (error) (*error) = kstring_new_from_utf8 ((UTF8 *)e);
-    sqlite3_free (e);
-    ret = NULL;
+    qcd_db_step_once (self, self->stmt_rollback, NULL, NULL);
+    self->in_transaction = FALSE;
     }
-  else
-    {
-    ret = klist_new_empty (free); 
+  KLOG_OUT
+  }
 
-    for (int i = 0; i < hits && ((i < limit) || (limit == 0)); i++)
+/*============================================================================
+  
+  qcd_db_del_dir
+
+  ==========================================================================*/
+BOOL qcd_db_del_dir (QcdDb *self, const UTF8 *dir, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  assert (dir != NULL);
+  int ret = qcd_db_daemon_update (self, QCD_DAEMON_DEL, (char *)dir, error);
+  if (ret < 0)
+    {
+    BOOL own = !self->in_transaction;
+    // A visit still in the journal would bring the directory back
+    if (own) qcd_db_fold_before_read (self);
+    ret = own ? qcd_db_begin (self, error) : TRUE;
+    if (ret)
       {
-      for (int j = 0; j < cols ; j++)
-        {
-        char *res = result[(i + 1) * cols + j];
-        if (res[0] != 0 || include_empty)
-          {
-          klist_append (ret, strdup (res));
-          }
-        }
+      sqlite3_int64 id;
+      ret = qcd_db_get_id (self, dir, &id, error)
+        && qcd_db_step_once (self, self->stmt_delete, dir, error);
+      if (ret && id != 0)
+        ret = qcd_db_index_dir (self, self->stmt_delete_gram, id, dir, error)
+          && qcd_db_sketch_dir (self, dir, -1, error);
+      if (ret && own) 
+        ret = qcd_db_commit (self, error);
+      if (!ret && own)
+        qcd_db_rollback (self);
       }
-    sqlite3_free_table (result);
     }
   KLOG_OUT
   return ret;
   }
 
+/*============================================================================
+  
+  qcd_db_add_dir_at
+
+  Record a visit to a directory at a particular time. Unless the caller
+  has started a transaction, the upsert runs in a transaction of its
+  own that takes the write lock up front, so the whole operation costs 
+  one journal commit. The trigram index and the sketch only need 
+  updating when the upsert inserts a new row, which is the only case 
+  in which it sets the last insert rowid.
 
+  ==========================================================================*/
+BOOL qcd_db_add_dir_at (QcdDb *self, const UTF8 *dir, time_t when, 
+      KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  assert (dir != NULL);
+  BOOL own = !self->in_transaction;
+  BOOL ret = own ? qcd_db_begin (self, error) : TRUE;
+
+  if (ret)
+    {
+    sqlite3_bind_int64 (self->stmt_add, 2, when);
+    sqlite3_bind_double (self->stmt_add, 3, self->half_life);
+    sqlite3_set_last_insert_rowid (self->sqlite, 0);
+    ret = qcd_db_step_once (self, self->stmt_add, dir, error);
+    sqlite3_int64 id = sqlite3_last_insert_rowid (self->sqlite);
+    if (ret && id != 0)
+      ret = qcd_db_index_dir (self, self->stmt_add_gram, id, dir, error)
+        && qcd_db_sketch_dir (self, dir, 1, error);
+    if (ret && own)
+      ret = qcd_db_commit (self, error);
+    if (!ret && own)
+      qcd_db_rollback (self);
+    }
+
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  QcdDbFold
+
+  State for qcd_db_fold_fn()
+
+  ==========================================================================*/
+typedef struct _QcdDbFold
+  {
+  QcdDb *db;
+  KString **error;
+  BOOL ok;
+  int count;
+  } QcdDbFold;
+
+/*============================================================================
+  
+  qcd_db_fold_fn
+
+  ==========================================================================*/
+static BOOL qcd_db_fold_fn (const char *dir, time_t when, void *user_data)
+  {
+  QcdDbFold *fold = user_data;
+  fold->ok = qcd_db_add_dir_at (fold->db, (UTF8 *)dir, when, fold->error);
+  fold->count++;
+  return fold->ok;
+  }
+
+/*============================================================================
+  
+  qcd_db_fold_journal
+
+  Move the visits in the journal into the database, in one transaction.
+  When there is no journal, which is the usual case, this costs two 
+  stat() calls. Holding the write lock makes sure that only one 
+  process is folding at a time.
+
+  ==========================================================================*/
+BOOL qcd_db_fold_journal (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  assert (!self->in_transaction);
+  struct stat sb;
+  if (stat (self->fold_file, &sb) != 0 
+       && (stat (self->journal_file, &sb) != 0 || sb.st_size == 0))
+    {
+    KLOG_OUT
+    return TRUE;
+    }
+
+  BOOL ret = TRUE;
+  BOOL leftover = TRUE;
+  int span = KTRACE_BEGIN ("fold");
+  // A leftover fold file takes one pass, and the journal another
+  for (int pass = 0; pass < 2 && leftover && ret; pass++)
+    {
+    if (!qcd_db_begin (self, error)) 
+      {
+      ret = FALSE;
+      break;
+      }
+    leftover = (access (self->fold_file, F_OK) == 0);
+    if (!leftover && !qcd_journal_detach (self->journal_file, 
+          self->fold_file))
+      {
+      // Most likely, somebody else folded it while we waited for the lock
+      qcd_db_rollback (self);
+      break;
+      }
+    QcdDbFold fold = { self, error, TRUE, 0 };
+    ret = qcd_journal_read (self->fold_file, qcd_db_fold_fn, &fold, error)
+      && fold.ok && qcd_db_commit (self, error);
+    if (ret)
+      {
+      klog_debug (KLOG_CLASS, "Folded %d visits from journal", fold.count);
+      unlink (self->fold_file);
+      }
+    else
+      qcd_db_rollback (self);
+    }
+  KTRACE_END (span);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_fold_before_read
+
+  Fold the journal, so that a read sees the visits in it. A failure 
+  isn't fatal to the read -- the visits stay in the journal, for 
+  next time.
+
+  ==========================================================================*/
+static void qcd_db_fold_before_read (QcdDb *self)
+  {
+  KLOG_IN
+  KString *error = NULL;
+  if (!qcd_db_fold_journal (self, &error))
+    {
+    char *s = (char *)kstring_to_utf8 (error);
+    klog_warn (KLOG_CLASS, "Can't fold visit journal: %s", s);
+    free (s);
+    kstring_destroy (error);
+    }
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_db_add_dir
+
+  Record a visit to a directory now, through the daemon if there is one,
+  or later, if visits are being deferred. Otherwise the visit goes in the
+  journal, if it is enabled, and the journal is folded into the database
+  when it gets big. If the journal can't be written, the visit goes 
+  straight into the database.
+
+  ==========================================================================*/
+BOOL qcd_db_add_dir (QcdDb *self, const UTF8 *dir, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  assert (dir != NULL);
+  int ret;
+  if (self->deferred)
+    {
+    klist_append (self->deferred, kstrdup ((char *)dir));
+    ret = TRUE;
+    }
+  else
+    {
+    ret = qcd_db_daemon_update (self, QCD_DAEMON_ADD, (char *)dir, error);
+    off_t size;
+    if (ret < 0 && self->visit_journal && qcd_journal_append 
+          (self->journal_file, (char *)dir, time (NULL), &size, NULL))
+      {
+      ret = TRUE;
+      if (size >= self->visit_journal_max)
+        qcd_db_fold_before_read (self);
+      }
+    if (ret < 0)
+      ret = qcd_db_add_dir_at (self, dir, time (NULL), error);
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_defer_visits
+
+  ==========================================================================*/
+void qcd_db_defer_visits (QcdDb *self)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  if (!self->deferred)
+    self->deferred = klist_new_empty (kfree);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_db_has_deferred
+
+  ==========================================================================*/
+BOOL qcd_db_has_deferred (const QcdDb *self)
+  {
+  assert (self != NULL);
+  return self->deferred && klist_length (self->deferred) > 0;
+  }
+
+/*============================================================================
+  
+  qcd_db_write_deferred
+
+  Record the visits that qcd_db_add_dir() has been holding back, and
+  stop deferring them. 
+
+  ==========================================================================*/
+BOOL qcd_db_write_deferred (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  BOOL ret = TRUE;
+  KList *deferred = self->deferred;
+  self->deferred = NULL;
+  if (deferred)
+    {
+    int l = klist_length (deferred);
+    for (int i = 0; i < l && ret; i++)
+      ret = qcd_db_add_dir (self, klist_get (deferred, i), error);
+    klist_destroy (deferred);
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_purge
+
+  Remove all stored directories, by deleting the database file, along 
+  with any WAL and shared-memory files that SQLite has left beside it,
+  the visit journal, and the hot set.
+  A new database is created when one is next needed.
+
+  ==========================================================================*/
+BOOL qcd_db_purge (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  int ret = qcd_db_daemon_update (self, QCD_DAEMON_PURGE, "", error);
+  if (ret < 0)
+    {
+    ret = TRUE;
+    qcd_db_close (self);
+    static const char *suffixes[] = { "", "-wal", "-shm", 
+      QCD_DB_JOURNAL_SUFFIX, QCD_DB_FOLD_SUFFIX, QCD_DB_HOT_SUFFIX };
+    for (int i = 0; i < 6 && ret; i++)
+      {
+      char *file;
+      asprintf (&file, "%s%s", self->file, suffixes[i]);
+      if (unlink (file) != 0 && errno != ENOENT)
+        {
+        if (error) *error = kstring_new_from_utf8 ((UTF8 *)strerror (errno));
+        ret = FALSE;
+        }
+      free (file);
+      }
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_foreach
+
+  Call fn for every stored directory, with its rank, highest rank first,
+  until fn returns FALSE.
+
+  ==========================================================================*/
+BOOL qcd_db_foreach (QcdDb *self, QcdDbForeachFn fn, void *user_data, 
+      KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  BOOL ret = FALSE;
+  sqlite3_stmt *stmt = NULL;
+  qcd_db_fold_before_read (self);
+  if (qcd_db_open (self, error) 
+       && qcd_db_prepare (self, &stmt, QCD_SQL_ALL, error))
+    {
+    int err;
+    BOOL more = TRUE;
+    while (more && (err = sqlite3_step (stmt)) == SQLITE_ROW)
+      {
+      const char *dir = (const char *)sqlite3_column_text (stmt, 0);
+      if (dir && dir[0])
+        more = fn (dir, sqlite3_column_double (stmt, 1), user_data);
+      }
+    if (!more || err == SQLITE_DONE)
+      ret = TRUE;
+    else
+      qcd_db_set_error (self, error);
+    }
+  sqlite3_finalize (stmt);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_get_data_version
+
+  Get SQLite's data_version, which changes whenever some other 
+  connection commits a change to the database
+
+  ==========================================================================*/
+BOOL qcd_db_get_data_version (QcdDb *self, int *version, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  BOOL ret = FALSE;
+  sqlite3_stmt *stmt = NULL;
+  if (qcd_db_open (self, error) 
+       && qcd_db_prepare (self, &stmt, "pragma data_version", error))
+    {
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+      {
+      *version = sqlite3_column_int (stmt, 0);
+      ret = TRUE;
+      }
+    else
+      qcd_db_set_error (self, error);
+    }
+  sqlite3_finalize (stmt);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_close
+
+  ==========================================================================*/
+void qcd_db_close (QcdDb *self)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  // sqlite3_finalize() is a no-op on a NULL statement
+  sqlite3_finalize (self->stmt_begin);
+  sqlite3_finalize (self->stmt_commit);
+  sqlite3_finalize (self->stmt_rollback);
+  sqlite3_finalize (self->stmt_add);
+  sqlite3_finalize (self->stmt_delete);
+  sqlite3_finalize (self->stmt_get_id);
+  sqlite3_finalize (self->stmt_match);
+  sqlite3_finalize (self->stmt_add_gram);
+  sqlite3_finalize (self->stmt_delete_gram);
+  for (int i = 0; i < QCD_DB_MAX_GRAMS; i++)
+    {
+    sqlite3_finalize (self->stmt_match_grams[i]);
+    self->stmt_match_grams[i] = NULL;
+    }
+  self->stmt_begin = NULL;
+  self->stmt_commit = NULL;
+  self->stmt_rollback = NULL;
+  self->stmt_add = NULL;
+  self->stmt_delete = NULL;
+  self->stmt_get_id = NULL;
+  self->stmt_match = NULL;
+  self->stmt_add_gram = NULL;
+  self->stmt_delete_gram = NULL;
+  if (self->sqlite) 
+    {
+    if (self->written && self->checkpoint_mode >= 0
+         && strcasecmp (self->journal_mode, "wal") == 0)
+      {
+      // Fold the WAL back into the database after we have written to
+      //   it, so it doesn't grow without limit when there is always 
+      //   some other shell holding the database open. A passive 
+      //   checkpoint does as much as it can without waiting for anybody
+      sqlite3_wal_checkpoint_v2 (self->sqlite, NULL, self->checkpoint_mode,
+        NULL, NULL);
+      }
+    sqlite3_close (self->sqlite);
+    }
+  self->written = FALSE;
+  self->in_transaction = FALSE;
+  self->sqlite = NULL;
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_db_exec
+
+  ==========================================================================*/
+static BOOL qcd_db_exec (QcdDb *self, UTF8 *sql, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  assert (self != NULL);
+  assert (sql != NULL);
+
+  char *e = NULL;
+  klog_debug (KLOG_CLASS, "%s: executing SQL %s", __PRETTY_FUNCTION__, sql);
+  sqlite3_exec (self->sqlite, (char *)sql, NULL, 0, &e);
+  if (e)
+    {
+    if (error) (*error) = kstring_new_from_utf8 ((UTF8 *)e); 
+    sqlite3_free (e);
+    ret = FALSE;
+    }
+  else
+    ret = TRUE;
+
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_prepare
+
+  ==========================================================================*/
+static BOOL qcd_db_prepare (QcdDb *self, sqlite3_stmt **stmt, 
+      const char *sql, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  klog_debug (KLOG_CLASS, "%s: preparing SQL %s", __PRETTY_FUNCTION__, sql);
+  if (sqlite3_prepare_v2 (self->sqlite, sql, -1, stmt, NULL) == SQLITE_OK)
+    ret = TRUE;
+  else
+    qcd_db_set_error (self, error);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_prepare_all
+
+  ==========================================================================*/
+static BOOL qcd_db_prepare_all (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = 
+    qcd_db_prepare (self, &self->stmt_begin, QCD_SQL_BEGIN, error)
+    && qcd_db_prepare (self, &self->stmt_commit, QCD_SQL_COMMIT, error)
+    && qcd_db_prepare (self, &self->stmt_rollback, QCD_SQL_ROLLBACK, error)
+    && qcd_db_prepare (self, &self->stmt_add, QCD_SQL_ADD, error)
+    && qcd_db_prepare (self, &self->stmt_delete, QCD_SQL_DELETE, error)
+    && qcd_db_prepare (self, &self->stmt_get_id, QCD_SQL_GET_ID, error)
+    && qcd_db_prepare (self, &self->stmt_match, QCD_SQL_MATCH, error)
+    && qcd_db_prepare (self, &self->stmt_add_gram, QCD_SQL_ADD_GRAM, error)
+    && qcd_db_prepare (self, &self->stmt_delete_gram, 
+         QCD_SQL_DELETE_GRAM, error);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_rank_add
+
+  Returns the rank of a directory after a visit at time t, with 
+  half-life h. This is the usual "log-sum-exp" calculation, arranged 
+  so that it can't overflow.
+
+  ==========================================================================*/
+static double qcd_db_rank_add (double rank, double t, double h)
+  {
+  double hi = rank > t ? rank : t;
+  double lo = rank > t ? t : rank;
+  return hi + h * log2 (1 + exp2 ((lo - hi) / h));
+  }
+
+/*============================================================================
+  
+  qcd_db_rank_after_visit
+
+  ==========================================================================*/
+double qcd_db_rank_after_visit (const QcdDb *self, double rank, time_t when)
+  {
+  return qcd_db_rank_add (rank, when, self->half_life);
+  }
+
+/*============================================================================
+  
+  qcd_db_rank_add_fn
+
+  SQL function qcd_rank_add (rank, t, half_life)
+
+  ==========================================================================*/
+static void qcd_db_rank_add_fn (sqlite3_context *context, int argc, 
+      sqlite3_value **argv)
+  {
+  double t = sqlite3_value_double (argv[1]);
+  if (sqlite3_value_type (argv[0]) == SQLITE_NULL)
+    {
+    sqlite3_result_double (context, t);
+    return;
+    }
+  sqlite3_result_double (context, qcd_db_rank_add 
+    (sqlite3_value_double (argv[0]), t, sqlite3_value_double (argv[2])));
+  }
+
+/*============================================================================
+  
+  qcd_db_rank_from_count_fn
+
+  SQL function qcd_rank_from_count (count, t, half_life), which gives 
+  the rank of a directory whose only history is a visit count,
+  treating all the visits as being at time t. This is only used to 
+  give a starting rank to directories recorded by earlier versions
+  of qcd. 
+
+  ==========================================================================*/
+static void qcd_db_rank_from_count_fn (sqlite3_context *context, int argc, 
+      sqlite3_value **argv)
+  {
+  int count = sqlite3_value_int (argv[0]);
+  double t = sqlite3_value_double (argv[1]);
+  double h = sqlite3_value_double (argv[2]);
+  if (count < 1) count = 1;
+  sqlite3_result_double (context, t + h * log2 (count));
+  }
+
+/*============================================================================
+  
+  qcd_db_create_functions
+
+  ==========================================================================*/
+static BOOL qcd_db_create_functions (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+  if (sqlite3_create_function (self->sqlite, "qcd_rank_add", 3, flags, 
+         NULL, qcd_db_rank_add_fn, NULL, NULL) == SQLITE_OK
+      && sqlite3_create_function (self->sqlite, "qcd_rank_from_count", 3, 
+         flags, NULL, qcd_db_rank_from_count_fn, NULL, NULL) == SQLITE_OK)
+    ret = TRUE;
+  else
+    qcd_db_set_error (self, error);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_migrate_1
+
+  The original schema. 
+
+  ==========================================================================*/
+static BOOL qcd_db_migrate_1 (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = qcd_db_exec (self, (UTF8 *)"create table if not exists dirs "
+       "(dir varchar not null primary key, count integer)", error)
+    && qcd_db_exec (self, 
+       (UTF8 *)"create index if not exists dirindex on dirs(dir)", error);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_migrate_2
+
+  Add the rank and last_visit columns, and give existing directories a 
+  rank based on their visit counts. 
+
+  ==========================================================================*/
+static BOOL qcd_db_migrate_2 (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  char sql[200];
+  long now = (long)time (NULL);
+  snprintf (sql, sizeof (sql), "update dirs set last_visit=%ld, "
+    "rank=qcd_rank_from_count(count, %ld, %f)", now, now, self->half_life);
+  BOOL ret = qcd_db_exec (self, 
+       (UTF8 *)"alter table dirs add column last_visit integer", error)
+    && qcd_db_exec (self, 
+       (UTF8 *)"alter table dirs add column rank real", error)
+    && qcd_db_exec (self, (UTF8 *)sql, error)
+    && qcd_db_exec (self, (UTF8 *)QCD_SQL_CREATE_RANK_INDEX, error);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_migrate_3
+
+  This used to create a trigram index keyed on the directory name, 
+  which made the database many times larger. It now only drops any 
+  such table; migration 6 creates the index keyed on directory ids, so
+  databases on every version end up with the same one, and none
+  builds it twice.
+
+  ==========================================================================*/
+static BOOL qcd_db_migrate_3 (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = qcd_db_exec (self, (UTF8 *)"drop table if exists dirgrams", 
+       error);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_migrate_4
+
+  Drop the index on dir, which duplicates the primary key index, and 
+  only added to the cost of every insert.
+
+  ==========================================================================*/
+static BOOL qcd_db_migrate_4 (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = qcd_db_exec (self, (UTF8 *)"drop index if exists dirindex", 
+     error);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_migrate_5
+
+  Create the trigram sketch for the hot set, and fill it in from the 
+  existing directories. 
+
+  ==========================================================================*/
+static BOOL qcd_db_migrate_5 (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = qcd_db_exec (self, (UTF8 *)"drop table if exists gramsketch", 
+       error) 
+    && qcd_db_exec (self, (UTF8 *)QCD_SQL_CREATE_SKETCH, error);
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_stmt *stmt_set = NULL;
+  if (ret)
+    ret = qcd_db_prepare (self, &stmt, "select dir from dirs", error)
+      && qcd_db_prepare (self, &stmt_set, QCD_SQL_SET_SKETCH, error);
+  if (ret)
+    {
+    int *counts = calloc (QCD_HOTSET_BUCKETS, sizeof (int));
+    uint32_t *buckets = NULL;
+    size_t size = 0;
+    int err;
+    while ((err = sqlite3_step (stmt)) == SQLITE_ROW)
+      {
+      const char *dir = (const char *)sqlite3_column_text (stmt, 0);
+      if (!dir) continue;
+      size_t l = strlen (dir);
+      if (l > size)
+        {
+        buckets = realloc (buckets, l * sizeof (uint32_t));
+        size = l;
+        }
+      int n = qcd_hotset_dir_buckets (dir, buckets);
+      for (int i = 0; i < n; i++)
+        counts[buckets[i]]++;
+      }
+    // A sketch that has missed some directories would rule out matches
+    if (err != SQLITE_DONE)
+      {
+      qcd_db_set_error (self, error);
+      ret = FALSE;
+      }
+    if (ret)
+      {
+      unsigned char *sketch = malloc (QCD_HOTSET_SKETCH_SIZE);
+      for (int i = 0; i < QCD_HOTSET_BUCKETS; i++)
+        {
+        int count = counts[i] > QCD_DB_SKETCH_MAX 
+          ? QCD_DB_SKETCH_MAX : counts[i];
+        sketch[2 * i] = count & 0xFF;
+        sketch[2 * i + 1] = count >> 8;
+        }
+      sqlite3_bind_blob (stmt_set, 1, sketch, QCD_HOTSET_SKETCH_SIZE, 
+        SQLITE_STATIC);
+      ret = qcd_db_step_once (self, stmt_set, NULL, error);
+      free (sketch);
+      }
+    free (buckets);
+    free (counts);
+    }
+  sqlite3_finalize (stmt);
+  sqlite3_finalize (stmt_set);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_migrate_6
+
+  Give each directory a stable integer id, and create the trigram 
+  index keyed on it, populated from the existing directories. The dirs
+  table is rebuilt, because the implicit rowid may change on a vacuum. 
+  Any existing dirgrams table is replaced, so setting user_version back
+  to 2 is a way to rebuild the index.
+
+  ==========================================================================*/
+static BOOL qcd_db_migrate_6 (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = qcd_db_exec (self, (UTF8 *)"create table dirs_new "
+       "(id integer primary key, dir varchar not null unique, "
+       "count integer, last_visit integer, rank real)", error)
+    && qcd_db_exec (self, (UTF8 *)"insert into dirs_new "
+       "(dir, count, last_visit, rank) "
+       "select dir, count, last_visit, rank from dirs", error)
+    && qcd_db_exec (self, (UTF8 *)"drop table dirs", error)
+    && qcd_db_exec (self, (UTF8 *)"alter table dirs_new rename to dirs", 
+       error)
+    && qcd_db_exec (self, (UTF8 *)QCD_SQL_CREATE_RANK_INDEX, error)
+    && qcd_db_exec (self, (UTF8 *)"drop table if exists dirgrams", error) 
+    && qcd_db_exec (self, (UTF8 *)QCD_SQL_CREATE_GRAMS, error)
+    && qcd_db_exec (self, (UTF8 *)"create temp table newgrams "
+       "(gram varchar, dir_id integer)", error);
+  // Inserting the trigrams in dirgrams key order is much faster than 
+  //  inserting them directory by directory, so collect them first
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_stmt *stmt_add_gram = NULL;
+  if (ret)
+    ret = qcd_db_prepare (self, &stmt, "select id, dir from dirs", error)
+      && qcd_db_prepare (self, &stmt_add_gram, "insert into newgrams "
+         "(gram, dir_id) values (?2, ?1)", error);
+  int err = SQLITE_DONE;
+  while (ret && (err = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+    const UTF8 *dir = sqlite3_column_text (stmt, 1);
+    if (dir) 
+      ret = qcd_db_index_dir (self, stmt_add_gram, 
+        sqlite3_column_int64 (stmt, 0), dir, error);
+    }
+  if (ret && err != SQLITE_DONE)
+    {
+    qcd_db_set_error (self, error);
+    ret = FALSE;
+    }
+  sqlite3_finalize (stmt);
+  sqlite3_finalize (stmt_add_gram);
+  ret = ret && qcd_db_exec (self, (UTF8 *)"insert or ignore into dirgrams "
+       "select gram, dir_id from newgrams order by gram, dir_id", error)
+    && qcd_db_exec (self, (UTF8 *)"drop table newgrams", error);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  Schema migrations. The schema version is stored in the database's 
+  user_version, which is zero in a new database, or in one created 
+  before versioning was introduced. Migration N takes the schema from 
+  version N-1 to version N. To change the schema, add a new function 
+  to the end of this list -- never change an existing one, because 
+  databases in the wild have already been through it.
+
+  ==========================================================================*/
+typedef BOOL (*QcdDbMigrateFn) (QcdDb *self, KString **error);
+
+static const QcdDbMigrateFn qcd_db_migrations[] = 
+  {
+  qcd_db_migrate_1,
+  qcd_db_migrate_2,
+  qcd_db_migrate_3,
+  qcd_db_migrate_4,
+  qcd_db_migrate_5,
+  qcd_db_migrate_6,
+  };
+
+#define QCD_DB_SCHEMA_VERSION \
+  (int)(sizeof (qcd_db_migrations) / sizeof (qcd_db_migrations[0]))
+
+/*============================================================================
+  
+  qcd_db_get_version
+
+  ==========================================================================*/
+static int qcd_db_get_version (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  int ret = -1;
+  sqlite3_stmt *stmt = NULL;
+  if (qcd_db_prepare (self, &stmt, "pragma user_version", error))
+    {
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+      ret = sqlite3_column_int (stmt, 0);
+    else
+      qcd_db_set_error (self, error);
+    }
+  sqlite3_finalize (stmt);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_migrate
+
+  Bring the schema up to date. This costs one read of the user_version 
+  when there is nothing to do. Otherwise, all the outstanding migrations
+  run in a single transaction, so an interrupted upgrade leaves the
+  database as it was. The version is checked again once the write lock
+  is held, in case another shell has upgraded the database in the 
+  meantime.
+
+  ==========================================================================*/
+static BOOL qcd_db_migrate (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  int version = qcd_db_get_version (self, error);
+  if (version >= QCD_DB_SCHEMA_VERSION)
+    {
+    if (version > QCD_DB_SCHEMA_VERSION)
+      klog_warn (KLOG_CLASS, "Database schema version %d is newer than "
+        "this version of qcd (%d)", version, QCD_DB_SCHEMA_VERSION);
+    ret = TRUE;
+    }
+  else if (version >= 0 && qcd_db_exec (self, (UTF8 *)"begin immediate", 
+             error))
+    {
+    ret = TRUE;
+    version = qcd_db_get_version (self, error);
+    if (version < 0) ret = FALSE;
+    for (int v = version; ret && v < QCD_DB_SCHEMA_VERSION; v++)
+      {
+      klog_info (KLOG_CLASS, "Upgrading database schema to version %d", 
+        v + 1);
+      ret = qcd_db_migrations[v] (self, error);
+      }
+    if (ret && version < QCD_DB_SCHEMA_VERSION)
+      {
+      char sql[50];
+      snprintf (sql, sizeof (sql), "pragma user_version=%d", 
+        QCD_DB_SCHEMA_VERSION);
+      ret = qcd_db_exec (self, (UTF8 *)sql, error);
+      }
+    // A new or upgraded database gets its hot set straight away, 
+    //   rather than at its first change
+    if (ret && version < QCD_DB_SCHEMA_VERSION)
+      ret = qcd_db_write_hot_set (self, error);
+    if (ret)
+      ret = qcd_db_exec (self, (UTF8 *)"commit", error);
+    if (!ret)
+      qcd_db_exec (self, (UTF8 *)"rollback", NULL);
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_set_pragmas
+
+  Set up locking and journalling on a newly-opened connection. The busy
+  timeout is set first, because changing the journal mode itself 
+  may have to wait for other connections. Failing to change the journal
+  mode is not fatal -- SQLite just carries on in whatever mode the
+  database was already in.
+
+  ==========================================================================*/
+static void qcd_db_set_pragmas (QcdDb *self)
+  {
+  KLOG_IN
+  sqlite3_busy_timeout (self->sqlite, self->busy_timeout);
+
+  char sql[100];
+  KString *error = NULL;
+  snprintf (sql, sizeof (sql), "pragma journal_mode=%s", self->journal_mode);
+  if (!qcd_db_exec (self, (UTF8 *)sql, &error))
+    {
+    char *s = (char *)kstring_to_utf8 (error);
+    klog_warn (KLOG_CLASS, "Can't set journal mode: %s", s);
+    free (s);
+    kstring_destroy (error);
+    }
+
+  sqlite3_wal_autocheckpoint (self->sqlite, self->wal_autocheckpoint);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_db_term_grams
+
+  Find the distinct trigrams in a search term that contain no wildcards,
+  up to QCD_DB_MAX_GRAMS of them. Returns the number found.
+
+  ==========================================================================*/
+static int qcd_db_term_grams (const char *term, 
+      char grams[QCD_DB_MAX_GRAMS][4])
+  {
+  KLOG_IN
+  int n = 0;
+  int run = 0; // Length of the current run of non-wildcard characters
+  for (const char *p = term; *p && n < QCD_DB_MAX_GRAMS; p++)
+    {
+    if (*p == '%' || *p == '_')
+      run = 0;
+    else if (++run >= 3)
+      {
+      char gram[4];
+      qcd_db_fold_gram (p - 2, gram);
+      BOOL dup = FALSE;
+      for (int i = 0; i < n && !dup; i++)
+        if (memcmp (grams[i], gram, 4) == 0) dup = TRUE;
+      if (!dup)
+        memcpy (grams[n++], gram, 4);
+      }
+    }
+  KLOG_OUT
+  return n;
+  }
+
+/*============================================================================
+  
+  qcd_db_get_match_stmt
+
+  Get the statement that selects matching directories using n trigrams, 
+  preparing it if this is the first time it has been used
+
+  ==========================================================================*/
+static sqlite3_stmt *qcd_db_get_match_stmt (QcdDb *self, int n, 
+      KString **error)
+  {
+  KLOG_IN
+  sqlite3_stmt **stmt = &self->stmt_match_grams[n - 1];
+  if (*stmt == NULL)
+    {
+    KString *sql = kstring_new_from_utf8 ((UTF8 *)QCD_SQL_MATCH_GRAMS_HEAD);
+    for (int i = 0; i < n; i++)
+      {
+      if (i > 0) kstring_append_utf8 (sql, (UTF8 *)" intersect ");
+      kstring_append_printf (sql, QCD_SQL_MATCH_GRAMS_GRAM, i + 2);
+      }
+    kstring_append_utf8 (sql, (UTF8 *)QCD_SQL_MATCH_GRAMS_TAIL);
+    qcd_db_prepare (self, stmt, (const char *)kstring_cstr_utf8 (sql), 
+      error);
+    kstring_destroy (sql);
+    }
+  KLOG_OUT
+  return *stmt;
+  }
+
+/*============================================================================
+  
+  qcd_db_cursor_new
+
+  ==========================================================================*/
+static QcdDbCursor *qcd_db_cursor_new (QcdDb *self, int limit)
+  {
+  QcdDbCursor *ret = malloc (sizeof (QcdDbCursor));
+  ret->db = self;
+  ret->stmt = NULL;
+  ret->pattern = NULL;
+  ret->limit = limit;
+  ret->count = 0;
+  ret->in = NULL;
+  ret->line = NULL;
+  ret->line_size = 0;
+  ret->at_end = FALSE;
+  ret->from_hot_set = FALSE;
+  ret->hot = NULL;
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_match_dir_cursor
+
+  The daemon, if there is one, answers first. Otherwise the hot set
+  can often say that there is exactly one match, or none, without 
+  opening the database. It can't be used in a transaction, which might 
+  have changed the database since the snapshot was written, or while a 
+  fold file is waiting, because the visits in that are in neither the 
+  snapshot nor the journal. 
+
+  ==========================================================================*/
+QcdDbCursor *qcd_db_match_dir_cursor (QcdDb *self, const char *term, 
+      int limit, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  assert (term != NULL);
+
+  int fd = qcd_db_daemon_request (self, QCD_DAEMON_MATCH, term);
+  if (fd >= 0)
+    {
+    QcdDbCursor *ret = qcd_db_cursor_new (self, limit);
+    ret->in = fdopen (fd, "r");
+    KLOG_OUT
+    return ret;
+    }
+
+  char *hot = NULL;
+  int span = KTRACE_BEGIN ("hot_set");
+  int hot_result = -1;
+  struct stat hot_sb, sb;
+  if (self->hot_set_size > 0 && !self->in_transaction 
+       && stat (self->hot_file, &hot_sb) == 0
+       && access (self->fold_file, F_OK) != 0)
+    {
+    hot_result = qcd_hotset_match (self->hot_file, self->journal_file, 
+      term, &hot);
+    // If a fold started while we were reading, the journal we read may
+    //   already have been moved aside, and its visits would be missing.
+    //   The fold file is there until the fold commits, and the commit 
+    //   replaces the snapshot
+    if (hot_result >= 0 && (access (self->fold_file, F_OK) == 0
+         || stat (self->hot_file, &sb) != 0 || sb.st_ino != hot_sb.st_ino
+         || sb.st_dev != hot_sb.st_dev))
+      {
+      free (hot);
+      hot = NULL;
+      hot_result = -1;
+      }
+    }
+  KTRACE_END (span);
+  if (hot_result >= 0)
+    {
+    QcdDbCursor *ret = qcd_db_cursor_new (self, limit);
+    ret->from_hot_set = TRUE;
+    ret->hot = hot;
+    KLOG_OUT
+    return ret;
+    }
+
+  qcd_db_fold_before_read (self);
+  if (!qcd_db_open (self, error)) 
+    {
+    KLOG_OUT
+    return NULL;
+    }
+
+  char grams[QCD_DB_MAX_GRAMS][4];
+  int ngrams = qcd_db_term_grams (term, grams);
+  sqlite3_stmt *stmt = self->stmt_match;
+  if (ngrams > 0)
+    {
+    stmt = qcd_db_get_match_stmt (self, ngrams, error);
+    if (!stmt)
+      {
+      KLOG_OUT
+      return NULL;
+      }
+    for (int i = 0; i < ngrams; i++)
+      sqlite3_bind_text (stmt, i + 2, grams[i], 3, SQLITE_TRANSIENT);
+    }
+
+  QcdDbCursor *ret = qcd_db_cursor_new (self, limit);
+  ret->stmt = stmt;
+
+  int l = strlen (term);
+  ret->pattern = malloc (l + 3);
+  ret->pattern[0] = '%';
+  memcpy (ret->pattern + 1, term, l);
+  ret->pattern[l + 1] = '%';
+  ret->pattern[l + 2] = 0;
+  sqlite3_bind_text (stmt, 1, ret->pattern, l + 2, SQLITE_STATIC);
+
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_cursor_next_from_daemon
+
+  The daemon sends each directory terminated by a NUL, and an empty 
+  string after the last one. Anything else means that it has gone away.
+
+  ==========================================================================*/
+static const char *qcd_db_cursor_next_from_daemon (QcdDbCursor *self, 
+      KString **error)
+  {
+  KLOG_IN
+  const char *ret = NULL;
+  if (!self->at_end && (self->limit == 0 || self->count < self->limit))
+    {
+    if (getdelim (&self->line, &self->line_size, 0, self->in) > 0)
+      {
+      if (self->line[0])
+        {
+        ret = self->line;
+        self->count++;
+        }
+      else
+        self->at_end = TRUE;
+      }
+    else
+      {
+      self->at_end = TRUE;
+      if (error)
+        *error = kstring_new_from_utf8 ((UTF8 *)"Lost connection to daemon");
+      }
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_cursor_next
+
+  ==========================================================================*/
+const char *qcd_db_cursor_next (QcdDbCursor *self, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  if (self->in)
+    {
+    KLOG_OUT
+    return qcd_db_cursor_next_from_daemon (self, error);
+    }
+  const char *ret = NULL;
+  if (self->from_hot_set)
+    {
+    if (self->hot && self->count == 0)
+      {
+      ret = self->hot;
+      self->count++;
+      }
+    KLOG_OUT
+    return ret;
+    }
+  while (ret == NULL && (self->limit == 0 || self->count < self->limit))
+    {
+    int err = sqlite3_step (self->stmt);
+    if (err == SQLITE_ROW)
+      {
+      const char *dir = (const char *)sqlite3_column_text (self->stmt, 0);
+      if (dir && dir[0])
+        {
+        ret = dir;
+        self->count++;
+        }
+      }
+    else
+      {
+      if (err != SQLITE_DONE)
+        qcd_db_set_error (self->db, error);
+      break;
+      }
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_cursor_destroy
+
+  ==========================================================================*/
+void qcd_db_cursor_destroy (QcdDbCursor *self)
+  {
+  KLOG_IN
+  if (self)
+    {
+    if (self->stmt) qcd_db_done (self->stmt);
+    if (self->in) fclose (self->in);
+    free (self->line);
+    free (self->pattern);
+    free (self->hot);
+    free (self);
+    }
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_db_match_dir
+
+  ==========================================================================*/
+KList *qcd_db_match_dir (QcdDb *self, const char *term, int limit, 
+      KString **error)
+  {
+  KLOG_IN
+  KList *ret = NULL;
+  QcdDbCursor *cursor = qcd_db_match_dir_cursor (self, term, limit, error);
+  if (cursor)
+    {
+    ret = klist_new_empty (kfree); 
+    KString *e = NULL;
+    const char *dir;
+    while ((dir = qcd_db_cursor_next (cursor, &e)))
+      klist_append (ret, kstrdup (dir));
+    if (e)
+      {
+      if (error) *error = e; else kstring_destroy (e);
+      klist_destroy (ret);
+      ret = NULL;
+      }
+    qcd_db_cursor_destroy (cursor);
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_db_init_heap
+
+  This must be done before SQLite is first used
+
+  ==========================================================================*/
+static void qcd_db_init_heap (void)
+  {
+  static BOOL tried = FALSE;
+  if (tried || !karena_active ()) return;
+  tried = TRUE;
+  if (!sqlite3_compileoption_used ("ENABLE_MEMSYS5")) return;
+  void *heap = malloc (QCD_DB_HEAP_SIZE);
+  if (heap && sqlite3_config (SQLITE_CONFIG_HEAP, heap, QCD_DB_HEAP_SIZE, 
+        QCD_DB_HEAP_MIN_ALLOC) == SQLITE_OK)
+    qcd_db_heap = heap;
+  else
+    free (heap);
+  }
+
+/*============================================================================
+  
+  qcd_db_release_heap
+
+  ==========================================================================*/
+void qcd_db_release_heap (void)
+  {
+  KLOG_IN
+  // SQLite can only be reconfigured when it holds no memory at all.
+  //   Otherwise, it keeps the heap, which is never freed
+  if (qcd_db_heap && sqlite3_memory_used () == 0)
+    {
+    sqlite3_shutdown ();
+    sqlite3_config (SQLITE_CONFIG_HEAP, NULL, 0, 0);
+    free (qcd_db_heap);
+    qcd_db_heap = NULL;
+    }
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_db_open
+
+  The database is opened at most once in the lifetime of the QcdDb 
+  object. The operations that need it call this function themselves, so
+  the file is not touched at all by an invocation that doesn't 
+  use it. Calling this function when the database is already open
+  does nothing.
+
+  ==========================================================================*/
+extern BOOL qcd_db_open (QcdDb *self, KString **error)
+  {
+  KLOG_IN
+  assert (self != NULL);
+  if (self->sqlite)
+    {
+    KLOG_OUT
+    return TRUE;
+    }
+  klog_debug (KLOG_CLASS, "Opening database file %s", self->file);
+  BOOL ret = FALSE;
+  int span = KTRACE_BEGIN ("db_open");
+
+  qcd_db_init_heap ();
+  int err = sqlite3_open (self->file, &self->sqlite);
+  if (err == 0)
+    {
+    qcd_db_set_pragmas (self);
+    ret = qcd_db_create_functions (self, error)
+      && qcd_db_migrate (self, error)
+      && qcd_db_prepare_all (self, error);
+    }
+  else
+    {
+    // TODO -- better error message
+    if (error)
+      *error = kstring_new_from_utf8 ((UTF8 *)"Can't open database");
+    }
+
+  if (!ret)
+    qcd_db_close (self);
+  KTRACE_END (span);
+
+  KLOG_OUT
+  return ret;
+  }
 
@@ -9,19 +9,88 @@
 
   ==========================================================================*/
 
+#pragma once
+
+#include <time.h>
 #include <klib/klib.h>
 
 struct _QcdDb;
 typedef struct _QcdDb QcdDb;
 
+struct _QcdDbCursor;
+typedef struct _QcdDbCursor QcdDbCursor;
+
 extern QcdDb    *qcd_db_new (const KPath *file);
 extern void      qcd_db_destroy (QcdDb *self);
 
+/** Apply database settings (journal_mode, busy_timeout, etc) from the 
+    rc file. Call this before the database is first used. */
+extern void      qcd_db_configure (QcdDb *self, const KProps *props);
+
+/** Whether to pass requests to the qcd daemon, when one is running. The
+    default is TRUE; the daemon itself turns this off. */
+extern void      qcd_db_set_use_daemon (QcdDb *self, BOOL use_daemon);
+extern const char *qcd_db_get_file (const QcdDb *self);
+
+/** Returns a list of at most 'limit' matching directories, as char *, 
+    most popular first. If limit == 0, then no limit is applied. */
 extern KList    *qcd_db_match_dir (QcdDb *self, const char *term, 
-                    KString **error);
+                    int limit, KString **error);
+
+/** Start a query for matching directories, most popular first. Rows are 
+    read from the database only as qcd_db_cursor_next() asks for them, so
+    the caller can stop as soon as it has seen enough. Only one cursor can
+    be open on a QcdDb at a time, and it must be destroyed before the
+    QcdDb is used for anything else. */
+extern QcdDbCursor *qcd_db_match_dir_cursor (QcdDb *self, const char *term, 
+                    int limit, KString **error);
+/** Returns the next directory, or NULL at the end of the results, or
+    on error. The string belongs to the cursor, and is valid only until
+    the next call. */
+extern const char *qcd_db_cursor_next (QcdDbCursor *self, KString **error);
+extern void      qcd_db_cursor_destroy (QcdDbCursor *self);
+
+/** Called for each directory by qcd_db_foreach(). Return FALSE to 
+    stop early. */
+typedef BOOL (*QcdDbForeachFn) (const char *dir, double rank, 
+                    void *user_data);
+
 extern BOOL      qcd_db_open (QcdDb *self, KString **error);
+extern void      qcd_db_close (QcdDb *self);
+/** Stop SQLite using the heap that it is given while the arena is 
+    active, before a process that has been using it becomes long-lived,
+    or the arena is released. No database may be open. */
+extern void      qcd_db_release_heap (void);
 extern BOOL      qcd_db_add_dir (QcdDb *self, const UTF8 *dir, 
                     KString **error);
 extern BOOL      qcd_db_del_dir (QcdDb *self, const UTF8 *dir, 
                     KString **error);
+extern BOOL      qcd_db_purge (QcdDb *self, KString **error);
+/** Move visits from the journal into the database. Reads do this
+    themselves, so this is only needed to force it. */
+extern BOOL      qcd_db_fold_journal (QcdDb *self, KString **error);
+
+/** After qcd_db_defer_visits(), qcd_db_add_dir() just remembers the 
+    directories, and qcd_db_write_deferred() records them all later. This
+    lets the caller answer the user before it touches the database. */
+extern void      qcd_db_defer_visits (QcdDb *self);
+extern BOOL      qcd_db_has_deferred (const QcdDb *self);
+extern BOOL      qcd_db_write_deferred (QcdDb *self, KString **error);
+
+/** The following always work on the database file directly, and are 
+    for use by the daemon. Add and delete operations between 
+    qcd_db_begin() and qcd_db_commit() share a single transaction. */
+extern BOOL      qcd_db_begin (QcdDb *self, KString **error);
+extern BOOL      qcd_db_commit (QcdDb *self, KString **error);
+extern void      qcd_db_rollback (QcdDb *self);
+extern BOOL      qcd_db_add_dir_at (QcdDb *self, const UTF8 *dir, 
+                    time_t when, KString **error);
+extern BOOL      qcd_db_foreach (QcdDb *self, QcdDbForeachFn fn, 
+                    void *user_data, KString **error);
+extern BOOL      qcd_db_get_data_version (QcdDb *self, int *version, 
+                    KString **error);
+/** The rank that a directory with the given rank will have after a 
+    visit at time 'when' */
+extern double    qcd_db_rank_after_visit (const QcdDb *self, double rank, 
+                    time_t when);
 
@@ -0,0 +1,359 @@
+/*============================================================================
+  
+  qcd
+
+  qcd_hotset.c
+
+  The hot set: a snapshot of the highest-ranked directories, in a file
+  beside the database, which can be mapped into memory and searched
+  without loading SQLite at all. Most searches have a single match,
+  which is nearly always one of these directories.
+
+  The snapshot can only be trusted if no other directory matches as
+  well, so it includes a sketch of the trigrams of every directory in
+  the database: for each of QCD_HOTSET_BUCKETS buckets, the number of
+  directories that have a trigram that hashes into it. If the count for
+  any of the trigrams of the search term, less the number of hot
+  directories that contribute to it, is zero, then no other directory
+  can possibly match. The database keeps the sketch up to date as
+  directories are added and removed, so the snapshot can be written
+  without scanning the whole table.
+
+  The snapshot is written by whoever changes the database, before the
+  change is committed, so it is always consistent with it. It is
+  written to a temporary file, which is then renamed, so a reader
+  never sees a partial snapshot.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <klib/klib.h>
+#include "qcd_hotset.h"
+#include "qcd_journal.h"
+#include "qcd_pattern.h"
+
+#define KLOG_CLASS "qcd.hotset"
+
+#define QCD_HOTSET_MAGIC 0x48444351 // "QCDH"
+#define QCD_HOTSET_VERSION 1
+// Sketch counts stop at this value, because we can no longer tell
+//   whether they should go down
+#define QCD_HOTSET_SATURATED 0xFFFF
+
+/*============================================================================
+  
+  QcdHotsetHeader
+
+  The file starts with this header, followed by the entries, the
+  sketch, and the strings that the entries point to. All offsets are
+  from the start of the file.
+
+  ==========================================================================*/
+typedef struct _QcdHotsetHeader
+  {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; // Of the whole file
+  uint32_t n_entries;
+  uint32_t has_cold; // Whether the database has other directories
+  uint32_t entries;
+  uint32_t sketch;
+  uint32_t strings;
+  } QcdHotsetHeader;
+
+/*============================================================================
+  
+  QcdHotsetEntry
+
+  ==========================================================================*/
+typedef struct _QcdHotsetEntry
+  {
+  double rank;
+  uint32_t dir;
+  uint32_t folded;
+  } QcdHotsetEntry;
+
+/*============================================================================
+  
+  QcdHotsetMatch
+
+  The distinct matches found so far. We only care whether there are
+  none, one, or more than one.
+
+  ==========================================================================*/
+typedef struct _QcdHotsetMatch
+  {
+  const char *pattern;
+  char *first;
+  int count;
+  } QcdHotsetMatch;
+
+/*============================================================================
+  
+  qcd_hotset_gram_bucket
+
+  ==========================================================================*/
+uint32_t qcd_hotset_gram_bucket (const char *s)
+  {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (int i = 0; i < 3; i++)
+    {
+    char c = s[i];
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    h = (h ^ (unsigned char)c) * 16777619u;
+    }
+  return h & (QCD_HOTSET_BUCKETS - 1);
+  }
+
+/*============================================================================
+  
+  qcd_hotset_compare_buckets
+
+  ==========================================================================*/
+static int qcd_hotset_compare_buckets (const void *a, const void *b)
+  {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+  }
+
+/*============================================================================
+  
+  qcd_hotset_dir_buckets
+
+  ==========================================================================*/
+int qcd_hotset_dir_buckets (const char *dir, uint32_t *buckets)
+  {
+  int l = strlen (dir);
+  int n = 0;
+  for (int i = 0; i + 3 <= l; i++)
+    buckets[n++] = qcd_hotset_gram_bucket (dir + i);
+  qsort (buckets, n, sizeof (uint32_t), qcd_hotset_compare_buckets);
+  int distinct = 0;
+  for (int i = 0; i < n; i++)
+    if (distinct == 0 || buckets[i] != buckets[distinct - 1])
+      buckets[distinct++] = buckets[i];
+  return distinct;
+  }
+
+/*============================================================================
+  
+  qcd_hotset_write
+
+  ==========================================================================*/
+BOOL qcd_hotset_write (const char *file, char * const *dirs,
+      const double *ranks, int n, BOOL has_cold,
+      const unsigned char *sketch, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  uint32_t strings_size = 0;
+  for (int i = 0; i < n; i++)
+    strings_size += 2 * (strlen (dirs[i]) + 1);
+
+  QcdHotsetHeader h;
+  h.magic = QCD_HOTSET_MAGIC;
+  h.version = QCD_HOTSET_VERSION;
+  h.n_entries = n;
+  h.has_cold = has_cold;
+  h.entries = sizeof (QcdHotsetHeader);
+  h.sketch = h.entries + n * sizeof (QcdHotsetEntry);
+  h.strings = h.sketch + QCD_HOTSET_SKETCH_SIZE;
+  h.size = h.strings + strings_size;
+
+  char *buf = malloc (h.size);
+  memcpy (buf, &h, sizeof (h));
+  memcpy (buf + h.sketch, sketch, QCD_HOTSET_SKETCH_SIZE);
+  QcdHotsetEntry *entries = (QcdHotsetEntry *)(buf + h.entries);
+  uint32_t p = h.strings;
+  for (int i = 0; i < n; i++)
+    {
+    int l = strlen (dirs[i]) + 1;
+    entries[i].rank = ranks[i];
+    entries[i].dir = p;
+    memcpy (buf + p, dirs[i], l);
+    p += l;
+    entries[i].folded = p;
+    memcpy (buf + p, dirs[i], l);
+    qcd_pattern_fold (buf + p);
+    p += l;
+    }
+
+  char *temp;
+  asprintf (&temp, "%s.%d", file, (int)getpid());
+  int fd = open (temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    {
+    ret = (write (fd, buf, h.size) == h.size);
+    close (fd);
+    if (ret)
+      ret = (rename (temp, file) == 0);
+    if (!ret)
+      unlink (temp);
+    }
+  if (!ret && error)
+    *error = kstring_new_from_utf8 ((UTF8 *)strerror (errno));
+  free (temp);
+  free (buf);
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_hotset_add_match
+
+  ==========================================================================*/
+static void qcd_hotset_add_match (QcdHotsetMatch *m, const char *dir)
+  {
+  if (m->count == 0)
+    {
+    m->first = strdup (dir);
+    m->count = 1;
+    }
+  else if (strcmp (m->first, dir) != 0)
+    m->count = 2;
+  }
+
+/*============================================================================
+  
+  qcd_hotset_journal_fn
+
+  ==========================================================================*/
+static BOOL qcd_hotset_journal_fn (const char *dir, time_t when,
+      void *user_data)
+  {
+  QcdHotsetMatch *m = user_data;
+  char *folded = strdup (dir);
+  qcd_pattern_fold (folded);
+  if (qcd_pattern_like (m->pattern, folded))
+    qcd_hotset_add_match (m, dir);
+  free (folded);
+  return m->count < 2;
+  }
+
+/*============================================================================
+  
+  qcd_hotset_has_bucket
+
+  Whether any trigram of s is in bucket b
+
+  ==========================================================================*/
+static BOOL qcd_hotset_has_bucket (const char *s, uint32_t b)
+  {
+  for (; s[0] && s[1] && s[2]; s++)
+    if (qcd_hotset_gram_bucket (s) == b) return TRUE;
+  return FALSE;
+  }
+
+/*============================================================================
+  
+  qcd_hotset_may_match_cold
+
+  Whether any directory outside the snapshot might match the term
+
+  ==========================================================================*/
+static BOOL qcd_hotset_may_match_cold (const char *map, const char *term)
+  {
+  const QcdHotsetHeader *h = (const QcdHotsetHeader *)map;
+  const QcdHotsetEntry *entries = (const QcdHotsetEntry *)(map + h->entries);
+  const unsigned char *sketch = (const unsigned char *)map + h->sketch;
+  if (!h->has_cold) return FALSE;
+
+  BOOL ret = TRUE;
+  int run = 0; // Length of the current run of non-wildcard characters
+  for (const char *p = term; *p && ret; p++)
+    {
+    if (*p == '%' || *p == '_')
+      run = 0;
+    else if (++run >= 3)
+      {
+      uint32_t b = qcd_hotset_gram_bucket (p - 2);
+      int count = sketch[2 * b] | (sketch[2 * b + 1] << 8);
+      if (count == QCD_HOTSET_SATURATED) continue;
+      for (int i = 0; i < h->n_entries && count > 0; i++)
+        if (qcd_hotset_has_bucket (map + entries[i].folded, b)) count--;
+      if (count == 0) ret = FALSE;
+      }
+    }
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_hotset_match
+
+  ==========================================================================*/
+int qcd_hotset_match (const char *file, const char *journal_file,
+      const char *term, char **result)
+  {
+  KLOG_IN
+  int ret = -1;
+  int fd = open (file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+    KLOG_OUT
+    return -1;
+    }
+  struct stat sb;
+  char *map = MAP_FAILED;
+  if (fstat (fd, &sb) == 0 && sb.st_size >= sizeof (QcdHotsetHeader))
+    map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    {
+    KLOG_OUT
+    return -1;
+    }
+
+  const QcdHotsetHeader *h = (const QcdHotsetHeader *)map;
+  if (h->magic == QCD_HOTSET_MAGIC && h->version == QCD_HOTSET_VERSION
+       && h->size == sb.st_size && h->strings <= h->size
+       && h->sketch + QCD_HOTSET_SKETCH_SIZE == h->strings
+       && h->entries + h->n_entries * sizeof (QcdHotsetEntry) == h->sketch
+       && map[h->size - 1] == 0
+       && !qcd_hotset_may_match_cold (map, term))
+    {
+    int l = strlen (term);
+    char *pattern = malloc (l + 3);
+    pattern[0] = '%';
+    memcpy (pattern + 1, term, l);
+    strcpy (pattern + l + 1, "%");
+    qcd_pattern_fold (pattern);
+
+    QcdHotsetMatch m = { pattern, NULL, 0 };
+    const QcdHotsetEntry *entries = (const QcdHotsetEntry *)(map + h->entries);
+    for (int i = 0; i < h->n_entries && m.count < 2; i++)
+      if (qcd_pattern_like (pattern, map + entries[i].folded))
+        qcd_hotset_add_match (&m, map + entries[i].dir);
+    // Visits not yet in the database may be to new directories
+    if (m.count < 2 && !qcd_journal_read (journal_file,
+          qcd_hotset_journal_fn, &m, NULL))
+      m.count = 2;
+
+    if (m.count < 2)
+      {
+      ret = m.count;
+      if (m.count == 1) *result = m.first;
+      }
+    else
+      free (m.first);
+    klog_debug (KLOG_CLASS, "Hot set result for %s: %d", term, ret);
+    free (pattern);
+    }
+
+  munmap (map, sb.st_size);
+  KLOG_OUT
+  return ret;
+  }
+
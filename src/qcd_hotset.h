@@ -0,0 +1,44 @@
+/*============================================================================
+  
+  qcd  
+  
+  qcd_hotset.h
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include <klib/klib.h>
+
+/** The number of buckets in the trigram sketch, and so the size, in 
+    16-bit little-endian counts, of the sketch that the database keeps */
+#define QCD_HOTSET_BUCKETS 32768
+#define QCD_HOTSET_SKETCH_SIZE (QCD_HOTSET_BUCKETS * 2)
+
+/** The sketch bucket for the three bytes at s, folded to lower case */
+extern uint32_t  qcd_hotset_gram_bucket (const char *s);
+
+/** Fill buckets with the distinct sketch buckets of the trigrams of dir,
+    in ascending order, and return how many there are. buckets must 
+    have room for strlen (dir) entries. */
+extern int       qcd_hotset_dir_buckets (const char *dir, uint32_t *buckets);
+
+/** Write a snapshot of the n highest-ranked directories, and the sketch
+    of all directories. has_cold says whether there are any directories
+    other than these n. */
+extern BOOL      qcd_hotset_write (const char *file, char * const *dirs, 
+                   const double *ranks, int n, BOOL has_cold, 
+                   const unsigned char *sketch, KString **error);
+
+/** Try to match term using only the snapshot, and the visits in the 
+    journal. Returns 1 and sets *result if there is certainly exactly 
+    one match, 0 if there is certainly no match, and -1 if only the 
+    database can say. */
+extern int       qcd_hotset_match (const char *file, 
+                   const char *journal_file, const char *term, 
+                   char **result);
+
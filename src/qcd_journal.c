@@ -0,0 +1,214 @@
+/*============================================================================
+  
+  qcd 
+  
+  qcd_journal.c
+
+  The visit journal. Recording a visit in the database costs a 
+  transaction, so instead visits can be appended to a journal file 
+  beside the database, which is folded into the database, in a single
+  transaction, before it is next read.
+
+  Each record is a fixed header followed by the directory name, without
+  a terminator, and is written with a single write() to a file opened
+  with O_APPEND. On a local filesystem, that means that records from 
+  different shells can't be interleaved. The check field detects a 
+  record that was only partly written, because the writer was killed, 
+  or the disk filled up.
+
+  The journal is folded by renaming it, and reading the renamed file. 
+  A writer that opened the journal just before the rename would write
+  to the renamed file, perhaps after it had been read, so writers hold
+  a shared flock() while they write, and the rename is done under an
+  exclusive one. A writer that gets its lock after the rename finds 
+  that its file is no longer the journal, and opens the new one.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> 
+#include <errno.h> 
+#include <unistd.h> 
+#include <fcntl.h> 
+#include <limits.h> 
+#include <stdint.h> 
+#include <sys/stat.h> 
+#include <sys/file.h> 
+#include <klib/klib.h> 
+#include "qcd_journal.h" 
+
+#define KLOG_CLASS "qcd.journal"
+
+#define QCD_JOURNAL_MAGIC 0x51434431 // "QCD1"
+
+/*============================================================================
+  
+  QcdJournalRecord
+
+  ==========================================================================*/
+typedef struct _QcdJournalRecord
+  {
+  uint32_t length; // Of the directory name that follows
+  uint32_t check;
+  int64_t when;
+  } QcdJournalRecord;
+
+/*============================================================================
+  
+  qcd_journal_check
+
+  ==========================================================================*/
+static uint32_t qcd_journal_check (const char *dir, uint32_t length, 
+      int64_t when)
+  {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (uint32_t i = 0; i < length; i++)
+    h = (h ^ (unsigned char)dir[i]) * 16777619u;
+  return h ^ length ^ (uint32_t)when ^ QCD_JOURNAL_MAGIC;
+  }
+
+/*============================================================================
+  
+  qcd_journal_append
+
+  ==========================================================================*/
+BOOL qcd_journal_append (const char *file, const char *dir, time_t when, 
+      off_t *size, KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  uint32_t l = strlen (dir);
+  if (l > PATH_MAX)
+    {
+    if (error) *error = kstring_new_from_utf8 ((UTF8 *)"Path too long");
+    KLOG_OUT
+    return FALSE;
+    }
+
+  char buf[sizeof (QcdJournalRecord) + PATH_MAX];
+  QcdJournalRecord *r = (QcdJournalRecord *)buf;
+  r->length = l;
+  r->when = when;
+  r->check = qcd_journal_check (dir, l, when);
+  memcpy (buf + sizeof (QcdJournalRecord), dir, l);
+
+  // Try again only if the journal was folded while we waited for the
+  //   lock. Any other failure -- flock() is not supported everywhere --
+  //   is an error, and the caller records the visit some other way
+  BOOL retry = TRUE;
+  while (retry)
+    {
+    retry = FALSE;
+    int fd = open (file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) break;
+    struct stat sb, file_sb;
+    if (flock (fd, LOCK_SH) == 0 && fstat (fd, &sb) == 0)
+      {
+      if (stat (file, &file_sb) != 0)
+        retry = (errno == ENOENT); // Renamed, and not yet replaced
+      else if (sb.st_ino != file_sb.st_ino || sb.st_dev != file_sb.st_dev)
+        retry = TRUE;
+      else
+        {
+        int n = sizeof (QcdJournalRecord) + l;
+        if (write (fd, buf, n) == n)
+          {
+          ret = TRUE;
+          if (size) *size = fstat (fd, &sb) == 0 ? sb.st_size : 0;
+          }
+        }
+      }
+    int saved = errno;
+    close (fd);
+    errno = saved;
+    }
+  if (!ret && error)
+    *error = kstring_new_from_utf8 ((UTF8 *)strerror (errno));
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_journal_detach
+
+  ==========================================================================*/
+BOOL qcd_journal_detach (const char *file, const char *to)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  int fd = open (file, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+    {
+    if (flock (fd, LOCK_EX) == 0)
+      ret = (rename (file, to) == 0);
+    close (fd);
+    }
+  KLOG_OUT
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_journal_read
+
+  ==========================================================================*/
+BOOL qcd_journal_read (const char *file, QcdJournalFn fn, void *user_data,
+      KString **error)
+  {
+  KLOG_IN
+  BOOL ret = FALSE;
+  int fd = open (file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+    ret = (errno == ENOENT);
+    if (!ret && error)
+      *error = kstring_new_from_utf8 ((UTF8 *)strerror (errno));
+    KLOG_OUT
+    return ret;
+    }
+
+  struct stat sb;
+  char *buf = NULL;
+  ssize_t n = 0;
+  if (fstat (fd, &sb) == 0)
+    {
+    buf = malloc (sb.st_size + 1);
+    n = read (fd, buf, sb.st_size);
+    }
+  close (fd);
+
+  if (buf && n >= 0)
+    {
+    ret = TRUE;
+    char dir[PATH_MAX + 1];
+    BOOL more = TRUE;
+    ssize_t p = 0;
+    while (more && p + (ssize_t)sizeof (QcdJournalRecord) <= n)
+      {
+      QcdJournalRecord r;
+      memcpy (&r, buf + p, sizeof (r));
+      p += sizeof (r);
+      if (r.length > PATH_MAX || p + r.length > n
+           || r.check != qcd_journal_check (buf + p, r.length, r.when))
+        {
+        klog_warn (KLOG_CLASS, "Ignoring damaged journal record in %s", 
+          file);
+        break;
+        }
+      memcpy (dir, buf + p, r.length);
+      dir[r.length] = 0;
+      p += r.length;
+      more = fn (dir, r.when, user_data);
+      }
+    }
+  else if (error)
+    *error = kstring_new_from_utf8 ((UTF8 *)strerror (errno));
+  free (buf);
+  KLOG_OUT
+  return ret;
+  }
+
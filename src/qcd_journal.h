@@ -0,0 +1,38 @@
+/*============================================================================
+  
+  qcd  
+  
+  qcd_journal.h
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+
+#pragma once
+
+#include <sys/types.h>
+#include <time.h>
+#include <klib/klib.h>
+
+/** Called by qcd_journal_read() for each visit. Return FALSE to stop. */
+typedef BOOL (*QcdJournalFn) (const char *dir, time_t when, 
+                    void *user_data);
+
+/** Append a visit to the journal file, creating it if necessary. If size
+    is not NULL, it is set to the size of the file after the append. */
+extern BOOL      qcd_journal_append (const char *file, const char *dir, 
+                    time_t when, off_t *size, KString **error);
+
+/** Rename the journal file to to, waiting for any appends in progress
+    to finish. No more visits will be added to the renamed file, so it 
+    can be read, and then removed, without losing any. Returns FALSE if
+    there is no journal. */
+extern BOOL      qcd_journal_detach (const char *file, const char *to);
+
+/** Call fn for each visit in the journal file, oldest first. A missing 
+    file is the same as an empty one. Reading stops quietly at a record
+    that is incomplete or damaged, which can only be at the end. */
+extern BOOL      qcd_journal_read (const char *file, QcdJournalFn fn, 
+                    void *user_data, KString **error);
+
@@ -4,6 +4,14 @@
   
   qcd_list_sel.c
 
+  The full-screen selector. Typing narrows the list to the directories
+  that contain what has been typed, matched in the same way as a search
+  term. Each character filters the previous generation of matches, 
+  since nothing that it excluded can match a longer filter, and all the
+  generations are kept, so that Backspace costs nothing. The directory
+  names are folded once, when the selector starts, and the database is
+  not consulted again.
+
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
 
@@ -19,9 +27,27 @@
 #include "qcd_list_sel.h" 
 #include "qcd_db.h" 
 #include "qcd_ops.h" 
+#include "qcd_pattern.h" 
 
 #define KLOG_CLASS "qcd.term"
 
+#define QCD_LIST_SEL_HELP "Select(Enter)/Quit(Esc)/Up/Down/PgUp/PgDn/Type to filter"
+
+/*============================================================================
+  
+  QcdListSelGen
+
+  One generation of the filter: the directories that match the first
+  n bytes of it, where n is the generation's position in the stack
+
+  ==========================================================================*/
+typedef struct _QcdListSelGen
+  {
+  int *matches; // Indices into dirs, in order
+  int *offsets; // Where the filter first occurs in each, if it is literal
+  int n_matches;
+  } QcdListSelGen;
+
 /*============================================================================
   
   QcdListSel
@@ -32,8 +58,22 @@ struct _QcdListSel
   {
   KTerminal *term;
   const KList *dirs; // A list of char *
-  int top_row_file; // The index into files that is shown in the top line 
-  int current_file; // Currently-selected index into files
+  char **folded; // Each of dirs, folded for matching
+  char *folded_text; // Where the folded names are, one after another
+  int n_dirs;
+  char *filter; // What has been typed, in UTF-8
+  int filter_len; // In bytes
+  QcdListSelGen *gens; // filter_len + 1 generations are valid
+  int gens_size; // Allocated length of gens, and of filter
+  int top_row_file; // The index into matches that is shown in the top line 
+  int current_file; // Currently-selected index into matches
+  // What is on the screen now, so that only what changes is redrawn
+  const char **shown; // The directory on each row, or NULL 
+  int shown_top; // top_row_file when the screen was drawn
+  int shown_current; // The row that is highlighted
+  int shown_rows; // Terminal size, or zero if nothing has been drawn
+  int shown_cols;
+  BOOL filter_changed; // Since the screen was drawn
   };
 
 
@@ -48,6 +88,16 @@ QcdListSel  *qcd_list_sel_new (const KList *dirs)
   QcdListSel *self = malloc (sizeof (QcdListSel));
   self->top_row_file = 0;
   self->dirs = dirs;
+  self->folded = NULL;
+  self->folded_text = NULL;
+  self->n_dirs = 0;
+  self->filter = NULL;
+  self->filter_len = 0;
+  self->gens = NULL;
+  self->gens_size = 0;
+  self->shown = NULL;
+  self->shown_rows = 0;
+  self->shown_cols = 0;
   KLOG_OUT
   return self;
   }
@@ -61,6 +111,16 @@ void qcd_list_sel_destroy (QcdListSel *self)
   {
   if (self)
     {
+    free (self->folded);
+    free (self->folded_text);
+    for (int i = 0; i < self->gens_size && self->gens; i++)
+      {
+      free (self->gens[i].matches);
+      free (self->gens[i].offsets);
+      }
+    free (self->gens);
+    free (self->filter);
+    free (self->shown);
     free (self);
     }
   }
@@ -98,6 +158,164 @@ BOOL qcd_list_sel_init (QcdListSel *self, KTerminal *terminal, KString **error)
   return ret;
   }
 
+/*============================================================================
+  
+  qcd_list_sel_matches
+
+  The current generation of the filter
+
+  ==========================================================================*/
+static const QcdListSelGen *qcd_list_sel_matches (const QcdListSel *self)
+  {
+  return &self->gens[self->filter_len];
+  }
+
+/*============================================================================
+  
+  qcd_list_sel_dir
+
+  The directory at index i of the current matches
+
+  ==========================================================================*/
+static const char *qcd_list_sel_dir (const QcdListSel *self, int i)
+  {
+  return klist_get (self->dirs, qcd_list_sel_matches (self)->matches[i]);
+  }
+
+/*============================================================================
+  
+  qcd_list_sel_start_filter
+
+  Fold the directory names, and make the first generation, which is 
+  all of them
+
+  ==========================================================================*/
+static void qcd_list_sel_start_filter (QcdListSel *self)
+  {
+  KLOG_IN
+  if (!self->folded)
+    {
+    // The names are copied into one block, in the order they are 
+    //   searched, rather than each being allocated separately
+    self->n_dirs = klist_length (self->dirs);
+    // One more than needed, so that none of these is empty
+    size_t n = self->n_dirs + 1;
+    self->folded = malloc (n * sizeof (char *));
+    size_t size = 0;
+    for (int i = 0; i < self->n_dirs; i++)
+      size += strlen (klist_get (self->dirs, i)) + 1;
+    self->folded_text = malloc (size ? size : 1);
+    char *p = self->folded_text;
+    for (int i = 0; i < self->n_dirs; i++)
+      {
+      const char *dir = klist_get (self->dirs, i);
+      int l = strlen (dir) + 1;
+      memcpy (p, dir, l);
+      qcd_pattern_fold (p);
+      self->folded[i] = p;
+      p += l;
+      }
+    self->gens_size = 16;
+    self->gens = calloc (self->gens_size, sizeof (QcdListSelGen));
+    self->filter = malloc (self->gens_size);
+    self->gens[0].matches = malloc (n * sizeof (int));
+    self->gens[0].offsets = calloc (n, sizeof (int));
+    for (int i = 0; i < self->n_dirs; i++)
+      self->gens[0].matches[i] = i;
+    self->gens[0].n_matches = self->n_dirs;
+    }
+  self->filter_len = 0;
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_list_sel_push_filter
+
+  Add a byte to the filter, and make the generation of matches for it
+  from the one before
+
+  ==========================================================================*/
+static void qcd_list_sel_push_filter (QcdListSel *self, char c)
+  {
+  KLOG_IN
+  if (self->filter_len + 2 > self->gens_size)
+    {
+    int size = self->gens_size * 2;
+    self->gens = realloc (self->gens, size * sizeof (QcdListSelGen));
+    memset (self->gens + self->gens_size, 0, 
+      (size - self->gens_size) * sizeof (QcdListSelGen));
+    self->filter = realloc (self->filter, size);
+    self->gens_size = size;
+    }
+  self->filter[self->filter_len++] = c;
+
+  // The pattern for a search term, %term%, folded
+  int len = self->filter_len;
+  char *pattern = malloc (len + 3);
+  pattern[0] = '%';
+  memcpy (pattern + 1, self->filter, len);
+  strcpy (pattern + len + 1, "%");
+  qcd_pattern_fold (pattern);
+  // Without wildcards, that is a plain substring search. The first 
+  //   occurrence can't be earlier than that of the filter before this 
+  //   byte, and usually it is the same one, so only one byte need be 
+  //   checked
+  BOOL literal = !memchr (self->filter, '%', len) 
+    && !memchr (self->filter, '_', len);
+  const char *literal_pattern = pattern + 1;
+  pattern[len + 1] = literal ? 0 : '%';
+
+  const QcdListSelGen *from = &self->gens[len - 1];
+  QcdListSelGen *to = &self->gens[len];
+  size_t size = (from->n_matches + 1) * sizeof (int);
+  to->matches = realloc (to->matches, size);
+  to->offsets = realloc (to->offsets, size);
+  to->n_matches = 0;
+  for (int i = 0; i < from->n_matches; i++)
+    {
+    int m = from->matches[i];
+    const char *dir = self->folded[m];
+    if (literal)
+      {
+      int offset = from->offsets[i];
+      const char *hit = dir + offset;
+      if (hit[len - 1] != literal_pattern[len - 1])
+        hit = hit[0] ? strstr (hit + 1, literal_pattern) : NULL;
+      if (hit)
+        {
+        to->matches[to->n_matches] = m;
+        to->offsets[to->n_matches++] = hit - dir;
+        }
+      }
+    else if (qcd_pattern_like (pattern, dir))
+      to->matches[to->n_matches++] = m;
+    }
+  free (pattern);
+  klog_debug (KLOG_CLASS, "Filter %.*s matches %d", self->filter_len, 
+    self->filter, to->n_matches);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_list_sel_pop_filter
+
+  Remove the last character from the filter, which may be several 
+  bytes. The earlier generation is still there.
+
+  ==========================================================================*/
+static void qcd_list_sel_pop_filter (QcdListSel *self)
+  {
+  KLOG_IN
+  while (self->filter_len > 0)
+    {
+    char c = self->filter[--self->filter_len];
+    if ((c & 0xC0) != 0x80) break;
+    }
+  KLOG_OUT
+  }
+
 /*============================================================================
   
   qcd_make_line
@@ -111,40 +329,115 @@ KString *qcd_make_line (const QcdListSel *self, const char *dir)
   return ret;
   }
 
+/*============================================================================
+  
+  qcd_draw_row
+
+  Draw one row of the list, which must be blank already
+
+  ==========================================================================*/
+static void qcd_draw_row (QcdListSel *self, int row, const char *dir, 
+      BOOL current)
+  {
+  KLOG_IN
+  KString *line = qcd_make_line (self, dir);
+  if (current)
+    kterminal_set_attributes (self->term, KTATTR_REVERSE, KTATTR_ON);
+  kterminal_write_at (self->term, row, 0, line, TRUE);
+  if (current)
+    kterminal_set_attributes (self->term, KTATTR_REVERSE, KTATTR_OFF);
+  kstring_destroy (line);
+  KLOG_OUT
+  }
+
 /*============================================================================
   
   qcd_refresh_display
 
+  Only the rows that differ from what is on the screen are drawn. If 
+  the list has moved by less than a screenful, the rows that are 
+  still wanted are scrolled into place first. The whole screen is only
+  drawn at the start, or when the terminal changes size.
+
   ==========================================================================*/
 void qcd_refresh_display (QcdListSel *self)
   {
   KLOG_IN
-  kterminal_clear (self->term);
+  kterminal_begin_frame (self->term);
   int rows = 25; int cols = 80;
-  int nfiles = klist_length (self->dirs);
+  int nfiles = qcd_list_sel_matches (self)->n_matches;
   kterminal_get_size (self->term, &rows, &cols, NULL);
-  for (int i = 0; i < rows - 1 && i + self->top_row_file < nfiles; i++)
+  int lines = rows > 1 ? rows - 1 : 0; // The last row is the status bar
+
+  BOOL full = (rows != self->shown_rows || cols != self->shown_cols);
+  if (full)
     {
-    KString *line = qcd_make_line (self, klist_get (self->dirs, 
-        i + self->top_row_file));
-    if (i + self->top_row_file == self->current_file)
-      {
-      kterminal_set_attributes (self->term, KTATTR_REVERSE, KTATTR_ON);
-      kterminal_write_at (self->term, i, 0, line, TRUE);
-      kterminal_set_attributes (self->term, KTATTR_REVERSE, KTATTR_OFF);
-      }
+    kterminal_clear (self->term);
+    self->shown = realloc (self->shown, (lines + 1) * sizeof (char *));
+    for (int i = 0; i < lines; i++)
+      self->shown[i] = NULL;
+    self->shown_rows = rows;
+    self->shown_cols = cols;
+    }
+
+  if (full || self->filter_changed)
+    {
+    KString *bar = kstring_new_empty ();
+    if (self->filter_len > 0)
+      kstring_append_printf (bar, "Filter: %.*s  (%d of %d)", 
+        self->filter_len, self->filter, nfiles, self->n_dirs);
     else
+      kstring_append_utf8 (bar, (UTF8 *)QCD_LIST_SEL_HELP);
+    if (!full)
+      kterminal_erase_line (self->term, rows - 1);
+    kterminal_write_at (self->term, rows - 1, 0, bar, TRUE);
+    kstring_destroy (bar);
+    }
+
+  // Scrolling only helps if the list is the same one
+  if (!full && !self->filter_changed)
+    {
+    int shift = self->top_row_file - self->shown_top;
+    if (shift != 0 && abs (shift) < lines)
       {
-      kterminal_write_at (self->term, i, 0, line, TRUE);
+      kterminal_scroll (self->term, 0, lines - 1, shift);
+      if (shift > 0)
+        {
+        memmove (self->shown, self->shown + shift, 
+          (lines - shift) * sizeof (char *));
+        for (int i = lines - shift; i < lines; i++)
+          self->shown[i] = NULL;
+        }
+      else
+        {
+        memmove (self->shown - shift, self->shown, 
+          (lines + shift) * sizeof (char *));
+        for (int i = 0; i < -shift; i++)
+          self->shown[i] = NULL;
+        }
+      self->shown_current -= shift;
       }
-    kstring_destroy (line);
     }
+  self->shown_top = self->top_row_file;
+
+  for (int i = 0; i < lines; i++)
+    {
+    int file = i + self->top_row_file;
+    const char *dir = file < nfiles ? qcd_list_sel_dir (self, file) : NULL;
+    BOOL current = (file == self->current_file);
+    if (!full && dir == self->shown[i] && current == (i == self->shown_current))
+      continue;
+    if (!full) 
+      kterminal_erase_line (self->term, i);
+    if (dir) 
+      qcd_draw_row (self, i, dir, current);
+    self->shown[i] = dir;
+    }
+  self->shown_current = self->current_file - self->top_row_file;
+  self->filter_changed = FALSE;
 
-  KString *bar = kstring_new_from_utf8((UTF8 *)
-    "Select(Enter)/Quit(Q)/Up/Down/PgUp/PgDn");
-  kterminal_write_at (self->term, rows - 1, 0, bar, TRUE);
-  kstring_destroy (bar);
   kterminal_set_cursor (self->term, rows, 39); 
+  kterminal_flush (self->term);
   KLOG_OUT
   }
 
@@ -153,19 +446,22 @@ void qcd_refresh_display (QcdListSel *self)
   qcd_list_sel_del
 
   ==========================================================================*/
-void qcd_list_sel_del (QcdListSel *self, const KPath *db_path, char *dir)
+void qcd_list_sel_del (QcdListSel *self, QcdDb *qcd_db, const char *dir)
   {
   int rows = 25; int cols;
+  kterminal_begin_frame (self->term);
   kterminal_get_size (self->term, &rows, &cols, NULL);
   KString *s = kstring_new_empty();
   kstring_append_printf (s, "Remove %s? (y/n)", dir);
   kterminal_erase_line (self->term, rows - 1);
   kterminal_write_at (self->term, rows - 1, 0, s, TRUE);
   kstring_destroy (s);
-  int key = kterminal_read_key (self->term);
+  kterminal_flush (self->term);
+  int key;
+  while ((key = kterminal_read_key (self->term)) == VK_RESIZE) {}
   if (key == 'y' || key == 'Y')
     {
-    qcd_ops_del (db_path, dir);
+    qcd_ops_del (qcd_db, dir);
     }
   }
 
@@ -174,32 +470,53 @@ void qcd_list_sel_del (QcdListSel *self, const KPath *db_path, char *dir)
   qcd_list_sel_loop
 
   ==========================================================================*/
-BOOL qcd_list_sel_loop (QcdListSel *self, const KPath *db_path, char **dir)
+BOOL qcd_list_sel_loop (QcdListSel *self, QcdDb *qcd_db, char **dir)
   {
   KLOG_IN
   qcd_refresh_display (self);
   kterminal_set_raw_mode (self->term, TRUE);
   BOOL ret = FALSE;
+  // Set when the display is out of date. It is not redrawn while more
+  //   keys are waiting, so that a burst of arrow keys typed ahead makes
+  //   one movement on the screen, not one for each key
+  BOOL redraw = FALSE;
 
   BOOL quit = FALSE;
   do
     {
     int rows = 25; int cols = 80;
-    int nfiles = klist_length (self->dirs);
-    kterminal_get_size (self->term, &rows, &cols, NULL);
+    int nfiles = qcd_list_sel_matches (self)->n_matches;
     int key = kterminal_read_key (self->term);
+    // After the key, which may be a change of size
+    kterminal_get_size (self->term, &rows, &cols, NULL);
     switch (key)
       {
       case VK_DEL:
-        qcd_list_sel_del (self, db_path, 
-            klist_get (self->dirs, self->current_file));
-        quit = TRUE;
+        if (nfiles > 0)
+          {
+          qcd_list_sel_del (self, qcd_db, 
+              qcd_list_sel_dir (self, self->current_file));
+          quit = TRUE;
+          }
 	break;
 
-      case 'q': case 'Q':
+      case '\x1b': 
+      case 3: // Ctrl+C, which is just a key in raw mode
+      case VK_EOF:
         quit = TRUE;
 	break;
 
+      case VK_BACK:
+        if (self->filter_len > 0)
+          {
+          qcd_list_sel_pop_filter (self);
+          self->current_file = 0;
+          self->top_row_file = 0;
+          self->filter_changed = TRUE;
+          redraw = TRUE;
+          }
+        break;
+
       case VK_PGUP:
         if (self->current_file > 0)
           {
@@ -215,7 +532,7 @@ BOOL qcd_list_sel_loop (QcdListSel *self, const KPath *db_path, char **dir)
 	  if (self->top_row_file > self->current_file)
 	    self->top_row_file = self->current_file;
 
-	  qcd_refresh_display (self);
+	  redraw = TRUE;
           }
         break;
 
@@ -229,7 +546,7 @@ BOOL qcd_list_sel_loop (QcdListSel *self, const KPath *db_path, char **dir)
 	    self->current_file = nfiles - 1;
 	  // TODO 
 
-	  qcd_refresh_display (self);
+	  redraw = TRUE;
           }
         break;
 
@@ -240,16 +557,26 @@ BOOL qcd_list_sel_loop (QcdListSel *self, const KPath *db_path, char **dir)
 	  if (self->current_file - self->top_row_file  >= rows - 2)
 	    self->top_row_file = self->current_file - (rows - 2);
 
-	  qcd_refresh_display (self);
+	  redraw = TRUE;
           }
         break;
 
       case 10:
-        {
-        *dir = strdup (klist_get (self->dirs, self->current_file));
-        quit = TRUE;
-        ret = TRUE;
-	}
+        if (nfiles > 0)
+          {
+          *dir = strdup (qcd_list_sel_dir (self, self->current_file));
+          quit = TRUE;
+          ret = TRUE;
+	  }
+        break;
+
+      case VK_RESIZE:
+        // Keep the selection on the screen, which may now be shorter
+        if (self->current_file - self->top_row_file >= rows - 2)
+          self->top_row_file = self->current_file - (rows - 2);
+        if (self->top_row_file < 0)
+          self->top_row_file = 0;
+        redraw = TRUE;
         break;
 
       case VK_UP:
@@ -259,11 +586,28 @@ BOOL qcd_list_sel_loop (QcdListSel *self, const KPath *db_path, char **dir)
 	  if (self->current_file < self->top_row_file)
 	    self->top_row_file = self->current_file;
 
-	  qcd_refresh_display (self);
+	  redraw = TRUE;
           }
         break;
+
+      default:
+        // Anything printable, including each byte of a UTF-8 
+        //   character, is added to the filter
+        if (key >= ' ' && key < 256)
+          {
+          qcd_list_sel_push_filter (self, key);
+          self->current_file = 0;
+          self->top_row_file = 0;
+          self->filter_changed = TRUE;
+          redraw = TRUE;
+          }
+      }
+
+    if (redraw && !quit && !kterminal_key_available (self->term))
+      {
+      qcd_refresh_display (self);
+      redraw = FALSE;
       }
-    
     } while (!quit);
 
   kterminal_set_raw_mode (self->term, FALSE);
@@ -276,12 +620,15 @@ BOOL qcd_list_sel_loop (QcdListSel *self, const KPath *db_path, char **dir)
   qcd_list_sel_run
 
   ==========================================================================*/
-BOOL qcd_list_sel_run (QcdListSel *self, const KPath *db_path, char **dir)
+BOOL qcd_list_sel_run (QcdListSel *self, QcdDb *qcd_db, char **dir)
   {
   KLOG_IN
   self->top_row_file = 0;
   self->current_file = 0;
-  BOOL ret = qcd_list_sel_loop (self, db_path, dir);
+  self->shown_rows = 0;
+  self->filter_changed = FALSE;
+  qcd_list_sel_start_filter (self);
+  BOOL ret = qcd_list_sel_loop (self, qcd_db, dir);
   KLOG_OUT
   return ret;
   }
@@ -9,7 +9,10 @@
 
   ==========================================================================*/
 
+#pragma once
+
 #include <klib/klib.h>
+#include "qcd_db.h"
 
 struct _QcdListSel;
 typedef struct _QcdListSel QcdListSel;
@@ -19,7 +22,7 @@ extern void      qcd_list_sel_destroy (QcdListSel *self);
 
 extern BOOL      qcd_list_sel_init (QcdListSel *self, KTerminal *terminal, 
                    KString **error);
-extern BOOL      qcd_list_sel_run (QcdListSel *self, const KPath *db_path, 
+extern BOOL      qcd_list_sel_run (QcdListSel *self, QcdDb *qcd_db, 
                    char **dir);
 extern void      qcd_list_sel_deinit (QcdListSel *self);
 
@@ -16,8 +16,14 @@
 #include <errno.h> 
 #include <getopt.h> 
 #include <unistd.h> 
+#include <fcntl.h> 
+#include <sys/wait.h> 
+#include <sys/stat.h> 
+#include <sys/uio.h> 
 #include <klib/klib.h> 
+#include "qcd_main.h" 
 #include "qcd_db.h" 
+#include "qcd_daemon.h" 
 #include "qcd_list_sel.h" 
 #include "qcd_ops.h" 
 
@@ -26,15 +32,17 @@
 
 #define KLOG_CLASS "qcd.main"
 
-void qcd_check_and_add (const KPath *db_path, const char *dir); // FWD
+void qcd_check_and_add (QcdDb *qcd_db, const char *dir); // FWD
+static void qcd_dispatch (int argc, char **argv, QcdResultFn result_fn, 
+      void *user_data); // FWD
 
 /*============================================================================
   
   qcd_log_handler
 
   Note that logging, in the broadest sense, is unhelpful when the program
-  is in full-screen mode. It will probably be necessary to implement
-  a logfile if detailed debugging is necessary
+  is in full-screen mode. For detailed debugging, use --log-file, 
+  which bypasses this handler
 
   ==========================================================================*/
 void qcd_log_handler (KLogLevel level, const char *cls, 
@@ -43,6 +51,29 @@ void qcd_log_handler (KLogLevel level, const char *cls,
   fprintf (stderr, "%s %s: %s\n", klog_level_to_utf8 (level), cls, msg);
   }
 
+/*============================================================================
+  
+  qcd_read_rc
+
+  Read the user's rc file, if there is one. The result is never NULL, 
+  but will be empty if there is no rc file
+
+  ==========================================================================*/
+KProps *qcd_read_rc (void)
+  {
+  KLOG_IN
+  KProps *props = kprops_new_empty();
+  KPath *user_rc_path = kpath_new_home();
+  kpath_append_utf8 (user_rc_path, (UTF8 *)QCD_RC_FILE);
+  UTF8 *s = kpath_to_utf8 (user_rc_path);
+  if (access ((char *)s, R_OK) == 0)
+    kprops_from_file (props, user_rc_path);
+  free (s);
+  kpath_destroy (user_rc_path);
+  KLOG_OUT
+  return props;
+  }
+
 /*============================================================================
   
   qcd_show_usage 
@@ -57,6 +88,11 @@ void qcd_show_usage (const char *argv0, FILE *f)
     (f, "    -d, --delete   Delete the current directory from the list\n");
   fprintf (f, "    -l, --list     Show/edit the complete directory list\n");
   fprintf (f, "        --purge    Remove all stored directories\n");
+  fprintf (f, "        --daemon   Start the qcd daemon\n");
+  fprintf (f, "        --stop-daemon  Stop the qcd daemon\n");
+  fprintf (f, "        --trace FILE   Write the time taken by each phase to FILE\n");
+  fprintf (f, "        --log-level N  Log level, 0 (errors) to 4 (trace)\n");
+  fprintf (f, "        --log-file FILE  Append log messages to FILE\n");
   }
 
 /*============================================================================
@@ -76,13 +112,13 @@ void qcd_show_version (void)
   
   qcd_select_from_list
 
-  This function must output a single string to stdout if a match is found,
-  or the user selects one. Otherwise, it must return FALSE to indicate
-  no match. There is no error return from this function, whether there
-  are matches or not
+  This function must set *result to the selected directory if the user 
+  selects one. Otherwise, it must return FALSE to indicate no match. 
+  There is no error return from this function, whether there are 
+  matches or not
 
   ==========================================================================*/
-BOOL qcd_select_from_list (const KPath *db_path, const KList *list)
+BOOL qcd_select_from_list (QcdDb *qcd_db, const KList *list, char **result)
   {
   BOOL ret = FALSE;
   QcdListSel *qcd_list_sel = qcd_list_sel_new (list);
@@ -92,15 +128,18 @@ BOOL qcd_select_from_list (const KPath *db_path, const KList *list)
   if (qcd_list_sel_init (qcd_list_sel, terminal, &error))
     {
     char *dir = NULL;
-    ret = qcd_list_sel_run (qcd_list_sel, db_path, &dir);
+    int span = KTRACE_BEGIN ("select");
+    ret = qcd_list_sel_run (qcd_list_sel, qcd_db, &dir);
+    KTRACE_END (span);
     if (dir)
       {
-      printf ("%s\n", dir); 
-      qcd_check_and_add (db_path, dir);
-      free (dir);
+      qcd_check_and_add (qcd_db, dir);
+      *result = dir;
       }
     qcd_list_sel_deinit (qcd_list_sel);
     }
+  else
+    kstring_destroy (error);
 
   kterminal_destroy (terminal);
   qcd_list_sel_destroy (qcd_list_sel);
@@ -111,58 +150,74 @@ BOOL qcd_select_from_list (const KPath *db_path, const KList *list)
   
   qcd_match
 
-  This function must output a single string to stdout if a match is found,
+  This function must set *result to a directory if a match is found,
   or the user selects one. Otherwise, it must return FALSE to indicate
   no match. There is no error return from this function, whether there
   are matches or not
 
+  The matches are read from a cursor. If there is no second row,
+  we have a unique match, and we don't need to read any further. 
+  Only if there is more than one match do we need the whole list, to
+  show the selector.
+
   ==========================================================================*/
-BOOL qcd_match (const KPath *db_path, const char *term)
+BOOL qcd_match (QcdDb *qcd_db, const char *term, char **result)
   {
   KLOG_IN
   BOOL ret = FALSE;
-  QcdDb *qcd_db = qcd_db_new (db_path);
   KString *error = NULL;
-  if (qcd_db_open (qcd_db, &error))
+  int span = KTRACE_BEGIN ("match");
+  QcdDbCursor *cursor = qcd_db_match_dir_cursor (qcd_db, term, 0, &error);
+  if (cursor)
     {
-    KList *matches = qcd_db_match_dir (qcd_db, term, &error);
-    if (matches)
+    KList *matches = klist_new_empty (kfree);
+    const char *dir;
+    while (klist_length (matches) < 2 
+          && (dir = qcd_db_cursor_next (cursor, &error)))
+      klist_append (matches, kstrdup (dir));
+
+    if (klist_length (matches) > 1)
       {
-      int l = klist_length (matches);
-    
-      if (l == 1)
-        {
-        char *dir = klist_get (matches, 0);
-	qcd_check_and_add (db_path, dir);
-        printf ("%s\n", dir);
-        ret = TRUE;
-        }
-      else if (l > 1)
-        {
-        ret = qcd_select_from_list (db_path, matches);
-        }
-      else
-        ret = FALSE;
-
-      klist_destroy (matches);
+      while ((dir = qcd_db_cursor_next (cursor, &error)))
+        klist_append (matches, kstrdup (dir));
       }
-    else
+    // The cursor must be closed before the database can be written
+    qcd_db_cursor_destroy (cursor);
+    KTRACE_END (span);
+
+    int l = klist_length (matches);
+    if (error)
       {
       char *s = (char *)kstring_to_utf8 (error);
       klog_error (KLOG_CLASS, "Can't query database: %s", s); 
       free (s);
       kstring_destroy (error);
       }
+    else if (l == 1)
+      {
+      char *dir = klist_get (matches, 0);
+      qcd_check_and_add (qcd_db, dir);
+      *result = strdup (dir);
+      ret = TRUE;
+      }
+    else if (l > 1)
+      {
+      ret = qcd_select_from_list (qcd_db, matches, result);
+      }
+    else
+      ret = FALSE;
+
+    klist_destroy (matches);
     }
   else
     {
+    KTRACE_END (span);
     char *s = (char *)kstring_to_utf8 (error);
-    klog_error (KLOG_CLASS, "Can't open database: %s", s);
+    klog_error (KLOG_CLASS, "Can't query database: %s", s); 
     free (s);
     kstring_destroy (error);
     }
 
-  qcd_db_destroy (qcd_db);
   KLOG_OUT
   return ret;
   }
@@ -172,10 +227,17 @@ BOOL qcd_match (const KPath *db_path, const char *term)
   qcd_check_and_add
 
   ==========================================================================*/
-void qcd_check_and_add (const KPath *db_path, const char *dir)
+void qcd_check_and_add (QcdDb *qcd_db, const char *dir)
   {
-  if (access (dir, X_OK) == 0)
-    qcd_ops_add (db_path, dir);
+  int span = KTRACE_BEGIN ("access");
+  BOOL ok = (access (dir, X_OK) == 0);
+  KTRACE_END (span);
+  if (ok)
+    {
+    span = KTRACE_BEGIN ("record");
+    qcd_ops_add (qcd_db, dir);
+    KTRACE_END (span);
+    }
   }
 
 /*============================================================================
@@ -184,14 +246,15 @@ void qcd_check_and_add (const KPath *db_path, const char *dir)
 
   Returns TRUE if the directory is complete, that is, something that
   should not be subject to matching. If it's a full pathname, add
-  it to the database
+  it to the database. If not_dir is set, the term is already known 
+  not to be a directory, and is not looked at again.
 
   ==========================================================================*/
-BOOL qcd_is_complete (const KPath *db_path, const char *term)
+BOOL qcd_is_complete (QcdDb *qcd_db, const char *term, BOOL not_dir)
   {
   if (term[0] == '/') 
     {
-    qcd_check_and_add (db_path, term);
+    qcd_check_and_add (qcd_db, term);
     // We don't try to match full pathnames
     return TRUE;
     }
@@ -208,28 +271,195 @@ BOOL qcd_is_complete (const KPath *db_path, const char *term)
   // TODO should we canonicalize relative directories and add them? It 
   //   might be helpful, but we run the risk of ending up with 
   //   every directory in the filesystem in the list.
+  if (not_dir) return FALSE;
   struct stat sb;
-  if (stat (term, &sb) == 0)
+  int span = KTRACE_BEGIN ("stat");
+  BOOL ret = (stat (term, &sb) == 0 && S_ISDIR (sb.st_mode));
+  KTRACE_END (span);
+  return ret;
+  }
+
+/*============================================================================
+  
+  qcd_write_deferred
+
+  ==========================================================================*/
+static void qcd_write_deferred (QcdDb *qcd_db)
+  {
+  KLOG_IN
+  KString *error = NULL;
+  if (!qcd_db_write_deferred (qcd_db, &error))
     {
-    if (S_ISDIR (sb.st_mode))
-      return TRUE;
+    char *s = (char *)kstring_to_utf8 (error);
+    klog_error (KLOG_CLASS, "Can't add directory to database: %s", s); 
+    free (s);
+    kstring_destroy (error);
     }
-  return FALSE;
+  KLOG_OUT
   }
 
 /*============================================================================
   
-  qcd_main 
+  qcd_write_deferred_in_background
+
+  Record deferred visits in a detached process, so that neither the 
+  program's caller, nor the shell that has loaded the builtin, waits for
+  the database. The child forks again and exits at once, so the process
+  that does the work is not left as a child of the shell. It doesn't 
+  keep any of the caller's files open either, because the shell may be
+  waiting for EOF on one of them. If we can't fork, we just do the work
+  here.
 
   ==========================================================================*/
-int qcd_main (int argc, char **argv)
+static void qcd_write_deferred_in_background (QcdDb *qcd_db)
   {
-  // Note that this function _must_ print a directory name to stdout,
-  //  whatever else it does. stdout from this program becomes stdin
-  //  for the shell built-in cd, so it can't just stop with no output.
-  // If the effect of the program is that the current directory should
-  //   not change, or there is an error, then the program should print
-  //   ".", so that the built-in cd changes to the current directory.
+  KLOG_IN
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+    if (fork() == 0)
+      {
+      setsid();
+      int null = open ("/dev/null", O_RDWR);
+      dup2 (null, 0);
+      dup2 (null, 1);
+      dup2 (null, 2);
+      if (null > 2) close (null);
+      qcd_write_deferred (qcd_db);
+      // Don't run the parent's exit handlers, which might be the shell's
+      qcd_db_close (qcd_db);
+      _exit (0);
+      }
+    _exit (0);
+    }
+  else if (pid > 0)
+    waitpid (pid, NULL, 0);
+  else
+    qcd_write_deferred (qcd_db);
+  KLOG_OUT
+  }
+
+/*============================================================================
+  
+  qcd_fast_path
+
+  Most invocations are a bare 'cd', 'cd ..', 'cd .', or 'cd' to a 
+  subdirectory of the current one, none of which involve the database.
+  These are answered here, before anything else is set up -- no 
+  logging, no option parsing, no rc file, and no allocation. Returns 
+  the directory to give to the shell, or NULL if the full machinery
+  is needed. Anything that looks like an option, or an absolute path, 
+  which has to be recorded, goes the slow way. If the argument is 
+  looked up, and is not a directory, *not_dir is set to it, so that
+  the slow way need not look it up again.
+
+  ==========================================================================*/
+static const char *qcd_fast_path (int argc, char **argv, 
+      const char **not_dir)
+  {
+  if (argc == 1) 
+    return getenv ("HOME");
+  if (argc != 2) 
+    return NULL;
+  const char *dir = argv[1];
+  if (dir[0] == '-' || dir[0] == '/' || dir[0] == 0) 
+    return NULL;
+  if (strcmp (dir, "..") == 0 || strcmp (dir, ".") == 0) 
+    return dir;
+  struct stat sb;
+  if (stat (dir, &sb) == 0 && S_ISDIR (sb.st_mode)) 
+    return dir;
+  *not_dir = dir;
+  return NULL;
+  }
+
+/*============================================================================
+  
+  qcd_trace_init
+
+  Start tracing to file. The shell function in qcd_init.sh sets 
+  QCD_TRACE_START to the shell's $EPOCHREALTIME, so that the time 
+  to start the program can be traced as well. That is printed with 
+  the locale's decimal separator, which may not be ours.
+
+  ==========================================================================*/
+static void qcd_trace_init (const char *file, int argc, char **argv)
+  {
+  char label[256];
+  int l = 0;
+  for (int i = 0; i < argc && l < sizeof (label); i++)
+    l += snprintf (label + l, sizeof (label) - l, i ? " %s" : "%s", argv[i]);
+
+  double start = 0;
+  const char *s = getenv ("QCD_TRACE_START");
+  if (s && s[0] && strlen (s) < 64)
+    {
+    char t[64];
+    strcpy (t, s);
+    char *comma = strchr (t, ',');
+    if (comma) *comma = '.';
+    start = strtod (t, NULL);
+    }
+  ktrace_init (file, label, start);
+  }
+
+/*============================================================================
+  
+  qcd_run
+
+  Work out the directory that cd should change to, and do whatever
+  else the command line asks for, passing the directory to result_fn.
+  This is never NULL: if the current directory should not change, or 
+  there is an error, then it is ".", so that the built-in cd changes 
+  to the current directory.
+
+  With async_record set in the rc file, visits to directories are not
+  recorded until after result_fn has been called, and then in the 
+  background, so the user doesn't wait for the database write.
+
+  This function may be called more than once in the same process, by 
+  the bash builtin, so it must not exit, and must leave no state 
+  behind.
+
+  If QCD_TRACE is set in the environment, or the --trace option is 
+  given, the time taken by each phase of the run is written to the 
+  file that it names (see ktrace.h). 
+
+  ==========================================================================*/
+void qcd_run (int argc, char **argv, QcdResultFn result_fn, void *user_data)
+  {
+  const char *trace = getenv ("QCD_TRACE");
+  if (trace && trace[0])
+    qcd_trace_init (trace, argc, argv);
+  int span = KTRACE_BEGIN ("run");
+  qcd_dispatch (argc, argv, result_fn, user_data);
+  KTRACE_END (span);
+  klog_close_file ();
+  if (!ktrace_finish ())
+    fprintf (stderr, "qcd: Can't write trace: %s\n", strerror (errno));
+  }
+
+/*============================================================================
+  
+  qcd_dispatch
+
+  The body of qcd_run()
+
+  ==========================================================================*/
+static void qcd_dispatch (int argc, char **argv, QcdResultFn result_fn, 
+      void *user_data)
+  {
+  int span = KTRACE_BEGIN ("fast_path");
+  const char *not_dir = NULL;
+  const char *fast = qcd_fast_path (argc, argv, &not_dir);
+  KTRACE_END (span);
+  if (fast)
+    {
+    span = KTRACE_BEGIN ("result");
+    result_fn (fast, user_data);
+    KTRACE_END (span);
+    return;
+    }
 
   klog_init (KLOG_ERROR, NULL, NULL);
 
@@ -239,14 +469,11 @@ int qcd_main (int argc, char **argv)
   BOOL add_cwd = FALSE;
   BOOL del_cwd = FALSE;
   BOOL purge = FALSE;
+  BOOL start_daemon = FALSE;
+  BOOL stop_daemon = FALSE;
 
   int log_level = KLOG_ERROR;
 
-  // TODO process RC file -- it is not used yet
-  KPath *user_rc_path = kpath_new_home();
-  kpath_append_utf8 (user_rc_path, (UTF8 *)QCD_RC_FILE);
-  kpath_destroy (user_rc_path);
-
   static struct option long_options[] =
     {
       {"help", no_argument, NULL, 'h'},
@@ -255,12 +482,17 @@ int qcd_main (int argc, char **argv)
       {"del", no_argument, NULL, 'd'},
       {"list", no_argument, NULL, 'l'},
       {"purge", no_argument, NULL, 0},
+      {"daemon", no_argument, NULL, 0},
+      {"stop-daemon", no_argument, NULL, 0},
       {"log-level", required_argument, NULL, 0},
+      {"trace", required_argument, NULL, 0},
+      {"log-file", required_argument, NULL, 0},
       {0, 0, 0, 0}
     };
 
    int opt;
    int ret = 0;
+   optind = 0; // Full reinitialization, in case we have run before
    while (ret == 0)
      {
      int option_index = 0;
@@ -278,6 +510,16 @@ int qcd_main (int argc, char **argv)
            show_version = TRUE;
          else if (strcmp (long_options[option_index].name, "log-level") == 0)
            log_level = atoi (optarg); 
+         else if (strcmp (long_options[option_index].name, "log-file") == 0)
+           {
+           if (!klog_open_file (optarg))
+             fprintf (stderr, "qcd: Can't open log file %s: %s\n", optarg, 
+               strerror (errno));
+           }
+         else if (strcmp (long_options[option_index].name, "trace") == 0)
+           {
+           if (!ktrace_on) qcd_trace_init (optarg, argc, argv);
+           }
          else if (strcmp (long_options[option_index].name, "add") == 0)
            add_cwd = TRUE; 
          else if (strcmp (long_options[option_index].name, "del") == 0)
@@ -286,6 +528,11 @@ int qcd_main (int argc, char **argv)
            show_list = TRUE; 
          else if (strcmp (long_options[option_index].name, "purge") == 0)
            purge = TRUE; 
+         else if (strcmp (long_options[option_index].name, "daemon") == 0)
+           start_daemon = TRUE; 
+         else if (strcmp (long_options[option_index].name, 
+              "stop-daemon") == 0)
+           stop_daemon = TRUE; 
          else
            ret = EINVAL; 
          break;
@@ -307,119 +554,195 @@ int qcd_main (int argc, char **argv)
   if (show_version)
     {
     qcd_show_version(); 
-    printf (".\n");
-    exit (0);
+    result_fn (".", user_data);
+    return;
     }
 
   if (show_usage)
     {
     qcd_show_usage (argv[0], stderr); 
-    printf (".\n");
-    exit (0);
+    result_fn (".", user_data);
+    return;
     }
 
   klog_set_log_level (log_level);
   klog_set_handler (qcd_log_handler);
 
-  // Find the databse file. Note that db_path must be free'd from 
-  // this point on, however the program exits.
+  // Find the databse file. Note that db_path and qcd_db must be free'd 
+  // from this point on, however we return. qcd_db is the
+  // one database session for the whole invocation -- the file is 
+  // opened the first time an operation needs it, and not before.
   KPath *db_path = kpath_new_home();
   kpath_append_utf8 (db_path, (UTF8 *)QCD_DB_FILE);
+  QcdDb *qcd_db = qcd_db_new (db_path);
+
+  span = KTRACE_BEGIN ("rc");
+  KProps *rc = qcd_read_rc();
+  qcd_db_configure (qcd_db, rc);
+  BOOL async_record = kprops_get_boolean_utf8 (rc, 
+    (UTF8 *)"async_record", FALSE);
+  kprops_destroy (rc);
+  KTRACE_END (span);
+  if (async_record)
+    qcd_db_defer_visits (qcd_db);
 
-  if (purge)
+  char *result = NULL;
+
+  if (start_daemon || stop_daemon)
+    {
+    BOOL is_daemon = FALSE;
+    KString *error = NULL;
+    BOOL ok = start_daemon ? qcd_daemon_start (qcd_db, &is_daemon, &error)
+      : qcd_daemon_stop (qcd_db, &error);
+    if (!ok)
+      {
+      char *s = (char *)kstring_to_utf8 (error);
+      fprintf (stderr, "qcd: %s\n", s);
+      free (s);
+      kstring_destroy (error);
+      }
+    if (is_daemon)
+      {
+      // The daemon itself gets here when it has stopped. It must not 
+      //   return, or run the parent's exit handlers, because it may be 
+      //   a fork of the user's shell
+      qcd_db_destroy (qcd_db);
+      kpath_destroy (db_path);
+      _exit (0);
+      }
+    }
+  else if (purge)
     {
     // Remove the DB file. It will be created again when required
-    kpath_unlink (db_path);
-    printf (".\n");
-    if (db_path) kpath_destroy (db_path);
-    exit (0);
+    KString *error = NULL;
+    if (!qcd_db_purge (qcd_db, &error))
+      {
+      char *s = (char *)kstring_to_utf8 (error);
+      fprintf (stderr, "Can't purge database: %s\n", s);
+      free (s);
+      kstring_destroy (error);
+      }
     }
-
-  if (add_cwd)
+  else if (add_cwd)
     {
     // Add to the database, if the path is valid. We don't want to add
     //   broken directories to the database
     char cwd[PATH_MAX];
     if (getcwd (cwd, PATH_MAX - 1))
-      qcd_check_and_add (db_path, cwd); 
+      qcd_check_and_add (qcd_db, cwd); 
     else
       fprintf (stderr, "Can't add current directory: %s\n", strerror (errno));
-    printf (".\n");
-    if (db_path) kpath_destroy (db_path);
-    exit (0);
     }
-
-  if (del_cwd)
+  else if (del_cwd)
     {
     char cwd[PATH_MAX];
     if (getcwd (cwd, PATH_MAX - 1))
-      qcd_ops_del (db_path, cwd); 
+      qcd_ops_del (qcd_db, cwd); 
     else
       fprintf (stderr, "Can't delete current directory: %s\n", 
        strerror (errno));
-    printf (".\n");
-    if (db_path) kpath_destroy (db_path);
-    exit (0);
     }
-
-  if (show_list)
+  else if (show_list)
     {
-    if (!qcd_match (db_path, "%"))
-      printf (".\n");
-    if (db_path) kpath_destroy (db_path);
-    exit (0);
+    qcd_match (qcd_db, "%", &result);
     }
-
-  if (argc - optind == 0)
+  else if (argc - optind == 0)
     {
-    // We got no arguments. We want to change to the home
-    //   directory. So return getenv ("HOME"). This will
-    //   crash if HOME is not set. But when does that happen on
-    //   Linux?
-    printf ("%s\n", getenv ("HOME"));
-    if (db_path) kpath_destroy (db_path);
-    exit (0);
+    // We got no arguments. qcd_fast_path() usually deals with this,
+    //   but not when there were options, like --log-level
+    const char *home = getenv ("HOME");
+    if (home)
+      result = strdup (home);
+    else
+      fprintf (stderr, "cd: HOME not set\n");
     }
-
-  if (argc - optind == 1)
+  else if (argc - optind == 1)
     {
     // We have one argument, so this is an attempt to change
     //  directory
     const char *orig_dir = argv[optind]; 
     // is_complete will implicitly add the directory to the database if it is
     //  of a format that makes it suitable to be added. In any event,
-    //  we just echo the original directory so the built-in cd can 
+    //  we just return the original directory so the built-in cd can 
     //  pick it up
-    if (qcd_is_complete (db_path, orig_dir))
+    if (qcd_is_complete (qcd_db, orig_dir, orig_dir == not_dir))
       {
-      printf ("%s\n", orig_dir);
-      if (db_path) kpath_destroy (db_path);
-      exit (0);
+      result = strdup (orig_dir);
       }
-    else if (qcd_match (db_path, orig_dir))
+    else if (qcd_match (qcd_db, orig_dir, &result))
       {
       // If this isn't a complete, valid directory, call qcd_match
       //  to process further. qcd_match will either find a matching
       //  directory in the list, or prompt the user. In either case,
       //  we take no further action here, as the selected directory
-      //  will have been printed by qcd_match.
+      //  will have been set by qcd_match.
       }
     else
       {
       // The argument was neither a valid directory, nor found in the
-      //  list, even after prompting the user. Just echo it -- there's
+      //  list, even after prompting the user. Just return it -- there's
       //  nothing more we can do here.
-      printf ("%s\n", orig_dir);
+      result = strdup (orig_dir);
       }
     }
   else
     {
     fprintf (stderr, "cd: too many arguments\n");
-    printf (".\n");
     }
   
-  if (db_path) kpath_destroy (db_path);
-  exit (0); 
+  // The database connection is closed before the result is delivered, 
+  //   so that it is not inherited by the process that records visits
+  qcd_db_close (qcd_db);
+  span = KTRACE_BEGIN ("result");
+  result_fn (result ? result : ".", user_data);
+  KTRACE_END (span);
+  free (result);
+  if (qcd_db_has_deferred (qcd_db))
+    qcd_write_deferred_in_background (qcd_db);
+
+  qcd_db_destroy (qcd_db);
+  kpath_destroy (db_path);
   }
 
+/*============================================================================
+  
+  qcd_print_result
+
+  Print the directory for the shell, and close stdout, so that the 
+  shell can read all of it while we record the visit. This writes
+  to the file descriptor directly, because setting up a stdio 
+  buffer would be most of the work of 'cd ..'. 
+
+  ==========================================================================*/
+static void qcd_print_result (const char *dir, void *user_data)
+  {
+  struct iovec iov[2] = 
+    {
+    { (void *)dir, strlen (dir) },
+    { "\n", 1 }
+    };
+  fflush (stdout);
+  if (writev (STDOUT_FILENO, iov, 2) < 0)
+    klog_error (KLOG_CLASS, "Can't write result: %s", strerror (errno));
+  fclose (stdout);
+  }
+
+/*============================================================================
+  
+  qcd_main 
+
+  ==========================================================================*/
+int qcd_main (int argc, char **argv)
+  {
+  // Note that this function _must_ print a directory name to stdout,
+  //  whatever else it does. stdout from this program becomes stdin
+  //  for the shell built-in cd, so it can't just stop with no output.
+  // The program runs for a moment, so it can allocate from the arena;
+  //  the builtin, which lives as long as the shell, does not
+  karena_init ();
+  qcd_run (argc, argv, qcd_print_result, NULL);
+  qcd_db_release_heap ();
+  karena_release ();
+  exit (0); 
+  }
 
@@ -12,3 +12,13 @@
 #pragma once
 
 extern int qcd_main (int argc, char **argv);
+
+/** Called by qcd_run() with the directory that cd should change to */
+typedef void (*QcdResultFn) (const char *dir, void *user_data);
+
+/** Process the command line, and pass the directory that cd should 
+    change to to result_fn. Unlike qcd_main(), this returns, so it can 
+    be used by the bash builtin. */
+extern void qcd_run (int argc, char **argv, QcdResultFn result_fn, 
+              void *user_data);
+
@@ -29,7 +29,7 @@
   Add an entry to the database
 
   ==========================================================================*/
-void qcd_ops_add (const KPath *db_path, const char *dir)
+void qcd_ops_add (QcdDb *qcd_db, const char *dir)
   {
   KLOG_IN
   // TODO we should remove all multiple and unnecessary / characters
@@ -44,29 +44,17 @@ void qcd_ops_add (const KPath *db_path, const char *dir)
 
   // TODO canonicalize?
    
-  QcdDb *qcd_db = qcd_db_new (db_path);
   KString *error = NULL;
-  if (qcd_db_open (qcd_db, &error))
+  if (qcd_db_add_dir (qcd_db, (UTF8 *)trimmed_dir, &error))
     {
-    if (qcd_db_add_dir (qcd_db, (UTF8 *)trimmed_dir, &error))
-      {
-      }
-    else
-      {
-      char *s = (char *)kstring_to_utf8 (error);
-      klog_error (KLOG_CLASS, "Can't add directory to database: %s", s); 
-      free (s);
-      kstring_destroy (error);
-      }
     }
   else
     {
     char *s = (char *)kstring_to_utf8 (error);
-    klog_error (KLOG_CLASS, "Can't open database: %s", s); 
-      free (s);
+    klog_error (KLOG_CLASS, "Can't add directory to database: %s", s); 
+    free (s);
     kstring_destroy (error);
     }
-  qcd_db_destroy(qcd_db);
 
   free (trimmed_dir);
   KLOG_OUT
@@ -79,35 +67,20 @@ void qcd_ops_add (const KPath *db_path, const char *dir)
   Remove an entry to the database
 
   ==========================================================================*/
-void qcd_ops_del (const KPath *db_path, const char *dir)
+void qcd_ops_del (QcdDb *qcd_db, const char *dir)
   {
   KLOG_IN
-  QcdDb *qcd_db = qcd_db_new (db_path);
   KString *error = NULL;
-  if (qcd_db_open (qcd_db, &error))
+  if (qcd_db_del_dir (qcd_db, (UTF8 *)dir, &error))
     {
-    if (qcd_db_del_dir (qcd_db, (UTF8 *)dir, &error))
-      {
-      }
-    else
-      {
-      char *s = (char *)kstring_to_utf8 (error);
-      klog_error (KLOG_CLASS, "Can't add directory to database: %s", s); 
-      // TODO put this error where the user can actually see it
-      free (s);
-      kstring_destroy (error);
-      }
     }
   else
     {
-      // TODO put this error where the user can actually see it
     char *s = (char *)kstring_to_utf8 (error);
-    klog_error (KLOG_CLASS, "Can't open database: %s", s); 
+    klog_error (KLOG_CLASS, "Can't delete directory from database: %s", s); 
+    // TODO put this error where the user can actually see it
     free (s);
     kstring_destroy (error);
     }
-  qcd_db_destroy(qcd_db);
   KLOG_OUT
   }
-
-
@@ -11,6 +11,8 @@
 
 #pragma once
 
-extern void qcd_ops_add (const KPath *db_path, const char *dir);
-extern void qcd_ops_del (const KPath *db_path, const char *dir);
+#include "qcd_db.h"
+
+extern void qcd_ops_add (QcdDb *qcd_db, const char *dir);
+extern void qcd_ops_del (QcdDb *qcd_db, const char *dir);
 
@@ -0,0 +1,95 @@
+/*============================================================================
+  
+  qcd 
+  
+  qcd_pattern.c
+
+  Matching of directory names against search terms, outside the 
+  database. This has to give exactly the same results as the 'like' 
+  queries in qcd_db.c, so a term matches the same directories whichever
+  way it is looked up.
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> 
+#include <klib/klib.h> 
+#include "qcd_pattern.h" 
+
+#define KLOG_CLASS "qcd.pattern"
+
+/*============================================================================
+  
+  qcd_pattern_fold
+
+  ==========================================================================*/
+void qcd_pattern_fold (char *s)
+  {
+  for (; *s; s++)
+    if (*s >= 'A' && *s <= 'Z') *s += 'a' - 'A';
+  }
+
+/*============================================================================
+  
+  qcd_pattern_next_char
+
+  Skip over one UTF-8 character
+
+  ==========================================================================*/
+static const char *qcd_pattern_next_char (const char *s)
+  {
+  s++;
+  while ((*s & 0xC0) == 0x80) s++;
+  return s;
+  }
+
+/*============================================================================
+  
+  qcd_pattern_like
+
+  The usual wildcard match, which backtracks only to the most recent %.
+  That is enough, because whatever the later part of the pattern could
+  match after an earlier %, it can also match after the later one.
+
+  ==========================================================================*/
+BOOL qcd_pattern_like (const char *pattern, const char *s)
+  {
+  const char *p = pattern;
+  const char *star_p = NULL; // Pattern just after the last %
+  const char *star_s = NULL; // Where the last % started matching
+
+  while (*s)
+    {
+    if (*p == '%')
+      {
+      star_p = ++p;
+      star_s = s;
+      }
+    else if (*p == '_')
+      {
+      p++;
+      s = qcd_pattern_next_char (s);
+      }
+    else if (*p && *p == *s)
+      {
+      p++;
+      s++;
+      }
+    else if (star_p)
+      {
+      // Let the last % swallow one more character, and try again
+      p = star_p;
+      star_s = qcd_pattern_next_char (star_s);
+      s = star_s;
+      }
+    else
+      return FALSE;
+    }
+
+  while (*p == '%') p++;
+  return *p == 0;
+  }
+
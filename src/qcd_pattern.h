@@ -0,0 +1,24 @@
+/*============================================================================
+  
+  qcd  
+  
+  qcd_pattern.h
+
+  Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
+  GNU Public Licence, v3.0
+
+  ==========================================================================*/
+
+#pragma once
+
+#include <klib/klib.h>
+
+/** Fold the ASCII letters in s to lower case, in place, the same way 
+    that SQLite's 'like' operator does. */
+extern void      qcd_pattern_fold (char *s);
+
+/** Match s against a 'like' pattern, in which % matches any sequence of
+    characters, and _ matches any single UTF-8 character. Both pattern
+    and s should already have been folded with qcd_pattern_fold(). */
+extern BOOL      qcd_pattern_like (const char *pattern, const char *s);
+